@@ -0,0 +1,232 @@
+#include "gzip.h"
+
+#include <cstring>
+
+namespace app {
+
+namespace {
+constexpr uint32_t kCrcNibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+constexpr uint16_t kLengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t kDistBase[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,    49,    65,    97,    129,
+                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr uint8_t kDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Member ID, deflate, no flags, no mtime, no extra flags, unknown OS.
+constexpr uint8_t kGzipHeader[10] = {0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF};
+
+} // namespace
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= p[i];
+    crc = kCrcNibble[crc & 0x0F] ^ (crc >> 4);
+    crc = kCrcNibble[crc & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+void GzipWriter::begin(GzipSink sink, void* ctx) {
+  static_assert(2 * kGzipWindow <= 0xFFFF, "window positions are stored + 1 in 16 bits");
+  sink_ = sink;
+  ctx_ = ctx;
+  memset(head_, 0, sizeof(head_));
+  memset(prev_, 0, sizeof(prev_));
+  fill_ = 0;
+  pos_ = 0;
+  bits_ = 0;
+  bit_count_ = 0;
+  out_len_ = 0;
+  crc_ = 0;
+  in_size_ = 0;
+  out_size_ = 0;
+  for (uint8_t b : kGzipHeader) {
+    put_byte(b);
+  }
+  // One final block with the fixed tables for the whole stream.
+  put_bits(1, 1);
+  put_bits(1, 2);
+}
+
+void GzipWriter::write(const void* data, size_t len) {
+  const auto* src = static_cast<const uint8_t*>(data);
+  crc_ = crc32_update(crc_, src, len);
+  in_size_ += static_cast<uint32_t>(len);
+  while (len > 0) {
+    if (fill_ == sizeof(window_)) {
+      compress(false);
+      slide();
+    }
+    size_t n = sizeof(window_) - fill_;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(window_ + fill_, src, n);
+    fill_ += n;
+    src += n;
+    len -= n;
+  }
+}
+
+void GzipWriter::finish() {
+  compress(true);
+  put_literal(256);
+  if (bit_count_ > 0) {
+    put_bits(0, 8 - bit_count_);
+  }
+  for (int i = 0; i < 4; ++i) {
+    put_byte(static_cast<uint8_t>(crc_ >> (8 * i)));
+  }
+  for (int i = 0; i < 4; ++i) {
+    put_byte(static_cast<uint8_t>(in_size_ >> (8 * i)));
+  }
+  flush_out();
+}
+
+uint32_t GzipWriter::hash(const uint8_t* p) {
+  uint32_t v = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+  return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+void GzipWriter::insert(size_t pos) {
+  uint32_t h = hash(window_ + pos);
+  prev_[pos & (kGzipWindow - 1)] = head_[h];
+  head_[h] = static_cast<uint16_t>(pos + 1);
+}
+
+// Greedy matching: the longest of up to kMaxChain earlier strings with the
+// same 3-byte hash. Without final, stops while a full match could still
+// reach past the buffered input.
+void GzipWriter::compress(bool final) {
+  while (pos_ < fill_) {
+    size_t avail = fill_ - pos_;
+    if (!final && avail < kMaxMatch) {
+      break;
+    }
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    if (avail >= kMinMatch) {
+      size_t limit = avail < kMaxMatch ? avail : kMaxMatch;
+      size_t cand = head_[hash(window_ + pos_)];
+      size_t last = pos_;
+      for (size_t chain = 0; chain < kMaxChain && cand != 0; ++chain) {
+        size_t at = cand - 1;
+        if (at >= last || pos_ - at > kGzipWindow) {
+          break;
+        }
+        size_t len = 0;
+        while (len < limit && window_[at + len] == window_[pos_ + len]) {
+          ++len;
+        }
+        if (len > best_len) {
+          best_len = len;
+          best_dist = pos_ - at;
+          if (len == limit) {
+            break;
+          }
+        }
+        last = at;
+        cand = prev_[at & (kGzipWindow - 1)];
+      }
+      insert(pos_);
+    }
+    if (best_len >= kMinMatch) {
+      put_match(best_len, best_dist);
+      for (size_t i = 1; i < best_len; ++i) {
+        if (pos_ + i + kMinMatch <= fill_) {
+          insert(pos_ + i);
+        }
+      }
+      pos_ += best_len;
+    } else {
+      put_literal(window_[pos_]);
+      ++pos_;
+    }
+  }
+}
+
+// Drops the older half of the buffer; positions in the hash chains move
+// down with it and those that fall off become empty.
+void GzipWriter::slide() {
+  memmove(window_, window_ + kGzipWindow, fill_ - kGzipWindow);
+  fill_ -= kGzipWindow;
+  pos_ -= kGzipWindow;
+  for (uint16_t& v : head_) {
+    v = v > kGzipWindow ? static_cast<uint16_t>(v - kGzipWindow) : 0;
+  }
+  for (uint16_t& v : prev_) {
+    v = v > kGzipWindow ? static_cast<uint16_t>(v - kGzipWindow) : 0;
+  }
+}
+
+void GzipWriter::put_bits(uint32_t value, uint8_t count) {
+  bits_ |= value << bit_count_;
+  bit_count_ += count;
+  while (bit_count_ >= 8) {
+    put_byte(static_cast<uint8_t>(bits_));
+    bits_ >>= 8;
+    bit_count_ -= 8;
+  }
+}
+
+// Huffman codes are packed starting from their most significant bit.
+void GzipWriter::put_huffman(uint16_t code, uint8_t count) {
+  uint32_t reversed = 0;
+  for (uint8_t i = 0; i < count; ++i) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  put_bits(reversed, count);
+}
+
+void GzipWriter::put_literal(uint16_t symbol) {
+  if (symbol < 144) {
+    put_huffman(0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    put_huffman(0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    put_huffman(symbol - 256, 7);
+  } else {
+    put_huffman(0xC0 + symbol - 280, 8);
+  }
+}
+
+void GzipWriter::put_match(size_t length, size_t distance) {
+  size_t code = 28;
+  while (kLengthBase[code] > length) {
+    --code;
+  }
+  put_literal(static_cast<uint16_t>(257 + code));
+  put_bits(static_cast<uint32_t>(length - kLengthBase[code]), kLengthExtra[code]);
+  size_t dist = 29;
+  while (kDistBase[dist] > distance) {
+    --dist;
+  }
+  put_huffman(static_cast<uint16_t>(dist), 5);
+  put_bits(static_cast<uint32_t>(distance - kDistBase[dist]), kDistExtra[dist]);
+}
+
+void GzipWriter::put_byte(uint8_t value) {
+  out_[out_len_++] = value;
+  if (out_len_ == sizeof(out_)) {
+    flush_out();
+  }
+}
+
+void GzipWriter::flush_out() {
+  if (out_len_ == 0) {
+    return;
+  }
+  out_size_ += static_cast<uint32_t>(out_len_);
+  sink_(out_, out_len_, ctx_);
+  out_len_ = 0;
+}
+
+} // namespace app
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace app {
+
+// CRC-32 (IEEE, as used by gzip); start with crc = 0.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+
+constexpr size_t kGzipWindow = 2048; // power of two
+constexpr size_t kGzipOutChunk = 1024;
+
+using GzipSink = void (*)(const uint8_t* data, size_t len, void* ctx);
+
+// Streaming gzip encoder for dynamic responses. Input is matched against the
+// last kGzipWindow bytes and coded with the fixed deflate Huffman tables, so
+// no tables are built or sent and memory is the ~10 KB of this object no
+// matter how long the stream is. Compressed bytes reach sink in chunks of at
+// most kGzipOutChunk.
+//
+// Plain data with no constructor: allocate it with malloc and call begin().
+class GzipWriter {
+ public:
+  void begin(GzipSink sink, void* ctx);
+  void write(const void* data, size_t len);
+  // Codes what is buffered and writes the end of the stream.
+  void finish();
+
+  uint32_t in_bytes() const {
+    return in_size_;
+  }
+  uint32_t out_bytes() const {
+    return out_size_;
+  }
+
+ private:
+  static constexpr size_t kHashBits = 10;
+  static constexpr size_t kMinMatch = 3;
+  static constexpr size_t kMaxMatch = 258;
+  static constexpr size_t kMaxChain = 8;
+
+  static uint32_t hash(const uint8_t* p);
+  void compress(bool final);
+  void slide();
+  void insert(size_t pos);
+  void put_bits(uint32_t value, uint8_t count);
+  void put_huffman(uint16_t code, uint8_t count);
+  void put_literal(uint16_t symbol);
+  void put_match(size_t length, size_t distance);
+  void put_byte(uint8_t value);
+  void flush_out();
+
+  GzipSink sink_;
+  void* ctx_;
+  uint8_t window_[2 * kGzipWindow];
+  uint16_t head_[1 << kHashBits]; // position + 1 of the newest string per hash, 0 for none
+  uint16_t prev_[kGzipWindow];    // position + 1 of the previous string with the same hash
+  size_t fill_;
+  size_t pos_;
+  uint32_t bits_;
+  uint8_t bit_count_;
+  uint8_t out_[kGzipOutChunk];
+  size_t out_len_;
+  uint32_t crc_;
+  uint32_t in_size_;
+  uint32_t out_size_;
+};
+
+} // namespace app
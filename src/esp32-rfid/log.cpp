@@ -2,89 +2,284 @@
 
 #include <cstring>
 #include <LittleFS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "gzip.h"
+#include "rtc.h"
+#include "settings.h"
+#include "timing.h"
+#include "users.h"
 
 namespace {
-constexpr const char* kLogsPath = "/logs.txt";
-constexpr const char* kLogsTmpPath = "/logs.tmp";
-constexpr size_t kMaxFileLogs = 10000;
+// Text log of earlier firmware; imported into the ring once, then removed.
+constexpr const char* kLegacyLogsPath = "/logs.txt";
+constexpr size_t kLoadBatch = 32;
+constexpr size_t kTextLineMax = 160;
+constexpr uint32_t kFlushWaitMs = 1000;
+constexpr const char* kIndexPath = "/logidx.bin";
+constexpr char kIndexMagic[4] = {'L', 'I', 'X', '1'};
+constexpr uint32_t kNoBlock = 0xFFFFFFFFu;
 
-bool ensure_fs() {
-  static bool started = false;
-  if (!started) {
-    started = LittleFS.begin();
+constexpr uint32_t kStageMagic = 0x3253544C; // "LTS2"
+constexpr uint32_t kStageSlots = 128;        // LogBuffer::kPendingEvents
+constexpr uint32_t kRunSeq = 0xFFFFFFFFu;
+
+// Copy of one queued event in RTC memory. RTC slow memory wants aligned
+// 32-bit stores, so everything staged is written through stage_store_words()
+// and stage_clear_words(), or one uint32_t field at a time.
+struct StagedEvent {
+  uint32_t words[5]; // AccessEvent
+  uint32_t seq;      // queue position
+  uint32_t crc;      // over words and seq
+};
+
+struct LogStage {
+  uint32_t magic;
+  uint32_t flushed;       // first queue position not yet in the ring
+  uint32_t flushed_check; // ~flushed
+  StagedEvent run;        // open run of repeated denials, seq kRunSeq
+  StagedEvent slots[kStageSlots];
+};
+
+static_assert(sizeof(app::AccessEvent) == sizeof(StagedEvent::words), "an event fills the staged words");
+
+// Survives software and watchdog resets (not power loss); at power-on it
+// holds noise that fails the magic and CRC checks.
+RTC_NOINIT_ATTR LogStage g_log_stage;
+
+uint32_t staged_crc(const StagedEvent& slot) {
+  return app::crc32_update(0, &slot, offsetof(StagedEvent, crc));
+}
+
+void stage_store_words(uint32_t* dest, const uint32_t* src, size_t words) {
+  for (size_t i = 0; i < words; ++i) {
+    dest[i] = src[i];
   }
-  return started;
 }
 
-size_t count_lines(File& file) {
-  size_t count = 0;
-  while (file.available()) {
-    char c = static_cast<char>(file.read());
-    if (c == '\n') {
-      count++;
-    }
+void stage_clear_words(uint32_t* dest, size_t words) {
+  for (size_t i = 0; i < words; ++i) {
+    dest[i] = 0;
   }
-  return count;
 }
 
-bool trim_file_if_needed() {
-  if (!ensure_fs()) {
+void stage_write(StagedEvent* dest_slot, uint32_t seq, const app::AccessEvent& event) {
+  StagedEvent slot;
+  memcpy(slot.words, &event, sizeof(slot.words));
+  slot.seq = seq;
+  slot.crc = staged_crc(slot);
+  stage_store_words(reinterpret_cast<uint32_t*>(dest_slot), reinterpret_cast<const uint32_t*>(&slot),
+                    sizeof(slot) / sizeof(uint32_t));
+}
+
+void stage_event(uint32_t seq, const app::AccessEvent& event) {
+  stage_write(&g_log_stage.slots[seq % kStageSlots], seq, event);
+}
+
+void stage_run(const app::AccessEvent& event) {
+  stage_write(&g_log_stage.run, kRunSeq, event);
+}
+
+void stage_drop_run() {
+  g_log_stage.run.seq = 0;
+}
+
+// The check word goes first: a reset between the two stores leaves them
+// disagreeing, and the events were already written by then.
+void stage_mark_flushed(uint32_t seq) {
+  g_log_stage.flushed_check = ~seq;
+  g_log_stage.flushed = seq;
+}
+
+// Record of the 16-byte format, before runs were coalesced.
+struct AccessEventV1 {
+  uint64_t uid;
+  uint32_t time;
+  uint8_t uid_len;
+  uint8_t reader;
+  uint8_t result;
+  uint8_t flags;
+};
+
+bool upgrade_event(const uint8_t* in, uint16_t in_size, uint8_t* out) {
+  if (in_size != sizeof(AccessEventV1)) {
     return false;
   }
-  File src = LittleFS.open(kLogsPath, FILE_READ);
-  if (!src) {
+  AccessEventV1 old;
+  memcpy(&old, in, sizeof(old));
+  app::AccessEvent event{};
+  event.set_key(app::UidKey{old.uid, old.uid_len});
+  event.time = old.time;
+  event.reader = old.reader;
+  event.result = old.result;
+  event.flags = old.flags;
+  memcpy(out, &event, sizeof(event));
+  return true;
+}
+
+struct IndexHeader {
+  char magic[4];
+  uint32_t covered; // every record before this sequence number is summarized
+  uint16_t block_records;
+  uint16_t blocks;
+};
+
+bool event_matches(const app::AccessEvent& event, const app::LogQuery& q) {
+  // A run matches when any part of it falls inside [from, to].
+  if ((q.from || q.to) &&
+      (!(event.flags & app::kEventClock) || event.last() < q.from || (q.to && event.time > q.to))) {
     return false;
   }
-  size_t total = count_lines(src);
-  src.close();
-  if (total <= kMaxFileLogs) {
-    return true;
-  }
-
-  size_t skip = total - kMaxFileLogs;
-  src = LittleFS.open(kLogsPath, FILE_READ);
-  if (!src) {
+  if (q.reader && event.reader != q.reader) {
     return false;
   }
-  File dst = LittleFS.open(kLogsTmpPath, FILE_WRITE);
-  if (!dst) {
-    src.close();
+  if (q.results && !(q.results & (1u << (event.result & 7)))) {
     return false;
   }
-  while (src.available()) {
-    String line = src.readStringUntil('\n');
-    if (skip > 0) {
-      skip--;
+  return q.uid.len == 0 || app::uid_equal(event.key(), q.uid);
+}
+
+bool ensure_fs() {
+  static bool started = false;
+  if (!started) {
+    started = LittleFS.begin();
+  }
+  return started;
+}
+
+// Visits the persisted events in [first, end), oldest first, skipping
+// segments that cannot be read. fn gets the sequence number of a batch of
+// consecutive events and returns false to stop.
+template <typename Fn>
+void scan_ring(const app::LogRing& ring, uint32_t first, uint32_t end, Fn fn) {
+  app::AccessEvent batch[kLoadBatch];
+  for (uint32_t seq = first; seq != end;) {
+    size_t want = end - seq < kLoadBatch ? end - seq : kLoadBatch;
+    size_t got = ring.read(seq, batch, want);
+    if (got == 0) {
+      seq += app::kLogSegmentRecords - seq % app::kLogSegmentRecords;
+      if (end - seq > app::kLogRingCapacity) {
+        break;
+      }
       continue;
     }
-    line.trim();
-    if (line.length() == 0) {
-      continue;
+    if (!fn(seq, batch, got)) {
+      break;
     }
-    dst.println(line);
+    seq += static_cast<uint32_t>(got);
   }
-  src.close();
-  dst.close();
-  LittleFS.remove(kLogsPath);
-  LittleFS.rename(kLogsTmpPath, kLogsPath);
-  return true;
 }
 
-bool append_line(const String& line) {
-  if (!ensure_fs()) {
-    return false;
+// Blanks separators, quotes and control bytes so the field is safe both in the
+// CSV line and inside the /logs JSON "msg" string.
+void sanitize_csv_field(const char* src, char* dest, size_t dest_len) {
+  size_t out = 0;
+  for (size_t i = 0; src && src[i] != '\0' && out + 1 < dest_len; ++i) {
+    char c = src[i];
+    if (c == ',' || c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+      c = ' ';
+    }
+    dest[out++] = c;
   }
-  File file = LittleFS.open(kLogsPath, FILE_APPEND);
-  if (!file) {
-    file = LittleFS.open(kLogsPath, FILE_WRITE);
+  dest[out] = '\0';
+}
+
+const char* result_name(uint8_t result) {
+  switch (static_cast<app::AccessResult>(result)) {
+    case app::AccessResult::Granted:
+      return "granted";
+    case app::AccessResult::Denied:
+      return "denied";
+    case app::AccessResult::Unknown:
+      return "unknown";
+    case app::AccessResult::OutOfSchedule:
+      return "schedule";
   }
-  if (!file) {
+  return "denied";
+}
+
+// Current name of the event's user; empty for rules and deleted users.
+void event_name(const app::UsersDb& users, const app::AccessEvent& event, char* out, size_t out_len) {
+  out[0] = '\0';
+  if (event.flags & app::kEventRule) {
+    return;
+  }
+  app::UserRecord user{};
+  users.read_lock();
+  bool found = users.get_user(event.key(), &user);
+  users.read_unlock();
+  if (found) {
+    strncpy(out, user.name, out_len - 1);
+    out[out_len - 1] = '\0';
+  }
+}
+
+// Parses a "ts,[DD/MM/YYYY,HH:MM:SS,]relay,status,uid,name[,xN,last]" line
+// of the old text log or an export.
+bool parse_legacy_line(const String& line, const app::Settings& settings, app::AccessEvent* out) {
+  int fields[10];
+  int count = 0;
+  fields[count++] = 0;
+  for (int i = 0; i < static_cast<int>(line.length()) && count < 10; ++i) {
+    if (line[i] == ',') {
+      fields[count++] = i + 1;
+    }
+  }
+  bool dated = count >= 7 && line.substring(fields[1], fields[2] - 1).indexOf('/') > 0;
+  int relay = dated ? 3 : 1;
+  if (count < relay + 3) {
     return false;
   }
-  file.println(line);
-  file.close();
+  memset(out, 0, sizeof(*out));
+  out->time = static_cast<uint32_t>(line.substring(0, fields[1] - 1).toInt());
+  if (dated) {
+    app::RtcDateTime dt{};
+    String date = line.substring(fields[1], fields[2] - 1);
+    String time = line.substring(fields[2], fields[3] - 1);
+    dt.day = static_cast<uint8_t>(date.substring(0, 2).toInt());
+    dt.month = static_cast<uint8_t>(date.substring(3, 5).toInt());
+    dt.year = static_cast<uint16_t>(date.substring(6).toInt());
+    dt.hour = static_cast<uint8_t>(time.substring(0, 2).toInt());
+    dt.minute = static_cast<uint8_t>(time.substring(3, 5).toInt());
+    dt.second = static_cast<uint8_t>(time.substring(6).toInt());
+    out->time = app::rtc_to_epoch(dt);
+    out->flags |= app::kEventClock;
+  }
+  String name = line.substring(fields[relay], fields[relay + 1] - 1);
+  out->reader = name == settings.relay1_name ? 1 : (name == settings.relay2_name ? 2 : 0);
+  bool granted = line.substring(fields[relay + 1], fields[relay + 2] - 1) == "granted";
+  out->result = static_cast<uint8_t>(granted ? app::AccessResult::Granted : app::AccessResult::Denied);
+  int uid_end = relay + 3 < count ? fields[relay + 3] - 1 : static_cast<int>(line.length());
+  String uid_text = line.substring(fields[relay + 2], uid_end);
+  app::UidKey uid{};
+  if (app::uid_parse(uid_text.c_str(), &uid)) {
+    out->set_key(uid);
+  }
+  if (count >= relay + 6 && line[fields[relay + 4]] == 'x') {
+    long repeats = line.substring(fields[relay + 4] + 1, fields[relay + 5] - 1).toInt() - 1;
+    int last_end = relay + 6 < count ? fields[relay + 6] - 1 : static_cast<int>(line.length());
+    String last_text = line.substring(fields[relay + 5], last_end);
+    uint32_t last = 0;
+    if (dated && last_text.indexOf(':') > 0) {
+      // Time of day of the last swipe; a run can cross midnight.
+      uint32_t day_start = out->time - out->time % 86400;
+      last = day_start + last_text.substring(0, 2).toInt() * 3600 + last_text.substring(3, 5).toInt() * 60 +
+             last_text.substring(6).toInt();
+      if (last < out->time) {
+        last += 86400;
+      }
+    } else {
+      last = static_cast<uint32_t>(last_text.toInt());
+    }
+    if (repeats > 0 && last >= out->time) {
+      out->repeats = static_cast<uint16_t>(repeats > UINT16_MAX ? UINT16_MAX : repeats);
+      out->span = static_cast<uint16_t>(last - out->time > UINT16_MAX ? UINT16_MAX : last - out->time);
+    }
+  }
   return true;
 }
+
 } // namespace
 
 namespace app {
@@ -92,167 +287,550 @@ namespace app {
 void LogBuffer::init() {
   head_ = 0;
   count_ = 0;
-  for (auto & entry : entries_) {
-    entry.ts_ms = 0;
-    entry.msg[0] = '\0';
+  run_open_ = false;
+  memset(entries_, 0, sizeof(entries_));
+  if (!index_mutex_) {
+    index_mutex_ = xSemaphoreCreateMutex();
+  }
+  if (!ram_mutex_) {
+    ram_mutex_ = xSemaphoreCreateMutex();
   }
 }
 
 bool LogBuffer::load() {
-  if (!ensure_fs()) {
+  if (!ensure_fs() || !ring_.begin(sizeof(AccessEvent), upgrade_event)) {
     return false;
   }
-  if (!LittleFS.exists(kLogsPath)) {
-    return true;
+  load_index();
+  import_legacy();
+  recover_staged();
+  // Only the newest kMaxLogs records are read back; sequence numbers give
+  // their position directly, so boot time does not grow with the log.
+  uint32_t end = ring_.end();
+  uint32_t first = ring_.first();
+  uint32_t start = end - first > kMaxLogs ? end - kMaxLogs : first;
+  AccessEvent tail[kMaxLogs];
+  size_t got = ring_.read(start, tail, end - start);
+  for (size_t i = 0; i < got; ++i) {
+    add_internal(tail[i], false);
+  }
+  return true;
+}
+
+void LogBuffer::import_legacy() {
+  if (!LittleFS.exists(kLegacyLogsPath)) {
+    return;
   }
-  File file = LittleFS.open(kLogsPath, FILE_READ);
+  File file = LittleFS.open(kLegacyLogsPath, FILE_READ);
   if (!file) {
-    return false;
+    return;
   }
+  const Settings settings = settings_get();
   while (file.available()) {
     String line = file.readStringUntil('\n');
     line.trim();
-    if (line.length() == 0) {
-      continue;
+    AccessEvent event{};
+    if (parse_legacy_line(line, settings, &event)) {
+      persist(&event, 1);
     }
-    int p1 = line.indexOf(',');
-    if (p1 < 0) {
-      continue;
-    }
-    String ts = line.substring(0, p1);
-    String msg = line.substring(p1 + 1);
-    add_internal(msg.c_str(), static_cast<uint32_t>(ts.toInt()), false);
   }
   file.close();
-  return true;
+  LittleFS.remove(kLegacyLogsPath);
 }
 
-bool LogBuffer::save() const {
-  if (!ensure_fs()) {
-    return false;
+void LogBuffer::add_internal(const AccessEvent& event, bool persist) {
+  xSemaphoreTake(ram_mutex_, portMAX_DELAY);
+  size_t idx = (head_ + count_) % kMaxLogs;
+  if (count_ == kMaxLogs) {
+    idx = head_;
+    head_ = (head_ + 1) % kMaxLogs;
+  } else {
+    count_++;
   }
-  File file = LittleFS.open(kLogsPath, FILE_WRITE);
-  if (!file) {
-    return false;
+
+  entries_[idx] = event;
+  xSemaphoreGive(ram_mutex_);
+  if (persist) {
+    enqueue(event);
   }
-  for (size_t i = 0; i < count_; ++i) {
-    size_t idx = (head_ + i) % kMaxLogs;
-    file.print(entries_[idx].ts_ms);
-    file.print(',');
-    file.print(entries_[idx].msg);
-    file.print('\n');
+}
+
+void LogBuffer::enqueue(const AccessEvent& event) {
+  uint32_t tail = pending_tail_.load(std::memory_order_relaxed);
+  if (tail - pending_head_.load(std::memory_order_acquire) >= kPendingEvents) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
   }
-  file.close();
-  return true;
+  pending_[tail % kPendingEvents] = event;
+  pending_ms_[tail % kPendingEvents] = millis();
+  stage_event(tail, event);
+  pending_tail_.store(tail + 1, std::memory_order_release);
+  queued_.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Events queued before a software or watchdog reset are still staged in RTC
+// memory: write every intact one after the last flushed position, in order,
+// then the open run, then start an empty stage for this boot.
+void LogBuffer::recover_staged() {
+  static_assert(kStageSlots == kPendingEvents, "one staged slot per queue entry");
+  LogStage& stage = g_log_stage;
+  uint32_t count = 0;
+  if (stage.magic == kStageMagic && stage.flushed_check == ~stage.flushed) {
+    AccessEvent batch[kLoadBatch];
+    size_t n = 0;
+    uint32_t seq = stage.flushed;
+    for (; count < kStageSlots; ++seq, ++count) {
+      const StagedEvent& slot = stage.slots[seq % kStageSlots];
+      if (slot.seq != seq || slot.crc != staged_crc(slot)) {
+        break;
+      }
+      memcpy(&batch[n++], slot.words, sizeof(AccessEvent));
+      if (n == kLoadBatch) {
+        persist(batch, n);
+        n = 0;
+      }
+    }
+    // A reset between queueing a run and dropping its stage leaves it in
+    // both places; the queued copy is then the newest slot.
+    const StagedEvent& run = stage.run;
+    const StagedEvent& newest = stage.slots[(seq - 1) % kStageSlots];
+    bool queued = newest.seq == seq - 1 && memcmp(newest.words, run.words, sizeof(run.words)) == 0;
+    if (run.seq == kRunSeq && run.crc == staged_crc(run) && !queued) {
+      memcpy(&batch[n++], run.words, sizeof(AccessEvent));
+      ++count;
+    }
+    if (n > 0) {
+      persist(batch, n);
+    }
+  }
+  recovered_ = count;
+  stage_clear_words(reinterpret_cast<uint32_t*>(&stage), sizeof(stage) / sizeof(uint32_t));
+  stage.magic = kStageMagic;
+  stage_mark_flushed(0);
+  pending_head_.store(0, std::memory_order_relaxed);
+  pending_tail_.store(0, std::memory_order_relaxed);
 }
 
-static void copy_log(char* dest, size_t dest_len, const char* src) {
-  if (!dest || dest_len == 0) {
+void LogBuffer::add(const AccessEvent& event, uint32_t coalesce_ms) {
+  const uint32_t now_ms = millis();
+  if (run_open_) {
+    AccessEvent& run = entries_[(head_ + count_ - 1) % kMaxLogs];
+    bool same = event.reader == run.reader && event.result == run.result && event.flags == run.flags &&
+                uid_equal(event.key(), run.key());
+    // The window runs from the first swipe, so a steady stream of retries
+    // still reaches flash every window.
+    if (same && now_ms - run_started_ms_ < run_window_ms_ && event.time >= run.time &&
+        event.time - run.time <= UINT16_MAX && run.repeats < UINT16_MAX) {
+      xSemaphoreTake(ram_mutex_, portMAX_DELAY);
+      run.repeats++;
+      run.span = static_cast<uint16_t>(event.time - run.time);
+      xSemaphoreGive(ram_mutex_);
+      stage_run(run);
+      return;
+    }
+    close_run();
+  }
+  if (coalesce_ms == 0 || event.result == static_cast<uint8_t>(AccessResult::Granted)) {
+    add_internal(event, true);
     return;
   }
-  if (!src) {
-    dest[0] = '\0';
+  // A denial opens a run: it shows in the RAM ring at once and is queued
+  // when the run ends.
+  add_internal(event, false);
+  run_open_ = true;
+  run_started_ms_ = now_ms;
+  run_window_ms_ = coalesce_ms < kMaxLogCoalesceMs ? coalesce_ms : kMaxLogCoalesceMs;
+  stage_run(event);
+}
+
+void LogBuffer::close_run() {
+  if (!run_open_) {
     return;
   }
-  strncpy(dest, src, dest_len - 1);
-  dest[dest_len - 1] = '\0';
+  run_open_ = false;
+  enqueue(entries_[(head_ + count_ - 1) % kMaxLogs]);
+  stage_drop_run();
 }
 
-void LogBuffer::add_internal(const char* msg, uint32_t ts_ms, bool persist) {
-  size_t idx = (head_ + count_) % kMaxLogs;
-  if (count_ == kMaxLogs) {
-    idx = head_;
-    head_ = (head_ + 1) % kMaxLogs;
+void LogBuffer::close_expired_run(uint32_t now_ms) {
+  if (run_open_ && now_ms - run_started_ms_ >= run_window_ms_) {
+    close_run();
+  }
+}
+
+size_t LogBuffer::format_text(const AccessEvent& event, const Settings& settings, const char* name, char* out,
+                              size_t out_len) {
+  const char* relay_name = event.reader == 1 ? settings.relay1_name : (event.reader == 2 ? settings.relay2_name : "");
+  char relay_field[32];
+  char uid_field[kUidTextLen];
+  char name_field[40];
+  sanitize_csv_field(relay_name, relay_field, sizeof(relay_field));
+  uid_format(event.key(), uid_field, sizeof(uid_field));
+  sanitize_csv_field(name, name_field, sizeof(name_field));
+  const char* status = event.result == static_cast<uint8_t>(AccessResult::Granted) ? "granted" : "denied";
+
+  int len = 0;
+  if (event.flags & kEventClock) {
+    RtcDateTime dt{};
+    rtc_from_epoch(event.time, &dt);
+    len = snprintf(out, out_len, "%02u/%02u/%04u,%02u:%02u:%02u,%s,%s,%s,%s", dt.day, dt.month, dt.year, dt.hour,
+                   dt.minute, dt.second, relay_field, status, uid_field, name_field);
   } else {
-    count_++;
+    len = snprintf(out, out_len, "%s,%s,%s,%s", relay_field, status, uid_field, name_field);
+  }
+  if (len < 0) {
+    out[0] = '\0';
+    return 0;
+  }
+  size_t used = static_cast<size_t>(len) < out_len ? static_cast<size_t>(len) : out_len - 1;
+  if (event.repeats > 0) {
+    // A run adds the number of swipes and the last one: its time of day, or
+    // millis() without a clock.
+    int extra = 0;
+    if (event.flags & kEventClock) {
+      RtcDateTime last{};
+      rtc_from_epoch(event.last(), &last);
+      extra = snprintf(out + used, out_len - used, ",x%u,%02u:%02u:%02u", event.repeats + 1u, last.hour, last.minute,
+                       last.second);
+    } else {
+      extra = snprintf(out + used, out_len - used, ",x%u,%lu", event.repeats + 1u,
+                       static_cast<unsigned long>(event.last()));
+    }
+    if (extra > 0) {
+      used += static_cast<size_t>(extra) < out_len - used ? static_cast<size_t>(extra) : out_len - used - 1;
+    }
   }
+  return used;
+}
 
-  entries_[idx].ts_ms = ts_ms;
-  copy_log(entries_[idx].msg, sizeof(entries_[idx].msg), msg);
-  if (persist) {
-    String line;
-    line.reserve(200);
-    line += ts_ms;
-    line += ',';
-    line += msg;
-    append_line(line);
-    trim_file_if_needed();
+size_t LogBuffer::format_json(const AccessEvent& event, const Settings& settings, const UsersDb& users, char* out,
+                              size_t out_len) {
+  char name[32];
+  char name_json[2 * sizeof(name)];
+  char msg[kTextLineMax];
+  char uid[kUidTextLen];
+  event_name(users, event, name, sizeof(name));
+  json_escape(name, name_json, sizeof(name_json));
+  format_text(event, settings, name, msg, sizeof(msg));
+  uid_format(event.key(), uid, sizeof(uid));
+  int len = snprintf(out, out_len,
+                     "{\"ts\":%lu,\"clock\":%s,\"reader\":%u,\"result\":\"%s\",\"uid\":\"%s\",\"name\":\"%s\","
+                     "\"count\":%u,\"last\":%lu,\"msg\":\"%s\"}",
+                     static_cast<unsigned long>(event.time), (event.flags & kEventClock) ? "true" : "false",
+                     static_cast<unsigned>(event.reader), result_name(event.result), uid, name_json, event.repeats + 1u,
+                     static_cast<unsigned long>(event.last()), msg);
+  if (len < 0 || static_cast<size_t>(len) >= out_len) {
+    out[0] = '\0';
+    return 0;
   }
+  return static_cast<size_t>(len);
 }
 
-void LogBuffer::add(const char* msg, uint32_t ts_ms) {
-  add_internal(msg, ts_ms, true);
+size_t LogBuffer::recent(AccessEvent* out, size_t max) const {
+  xSemaphoreTake(ram_mutex_, portMAX_DELAY);
+  size_t n = count_ < max ? count_ : max;
+  size_t start = head_ + count_ - n;
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = entries_[(start + i) % kMaxLogs];
+  }
+  xSemaphoreGive(ram_mutex_);
+  return n;
 }
 
-String LogBuffer::to_json() const {
-  String json = "{\"logs\":[";
-  for (size_t i = 0; i < count_; ++i) {
-    size_t idx = (head_ + i) % kMaxLogs;
-    if (i > 0) {
-      json += ',';
+void LogBuffer::clear_ram() {
+  close_run();
+  xSemaphoreTake(ram_mutex_, portMAX_DELAY);
+  head_ = 0;
+  count_ = 0;
+  xSemaphoreGive(ram_mutex_);
+}
+
+void LogBuffer::clear_all() {
+  clear_ram();
+  flush(kFlushWaitMs);
+  ring_.clear();
+  reset_index();
+}
+
+bool LogBuffer::persist(const AccessEvent* events, size_t count) {
+  uint32_t seq = 0;
+  // Records are written in order, so whatever reached the ring is a prefix.
+  const uint32_t append_start = micros();
+  size_t written = ring_.append(events, count, &seq);
+  timing_record(TimingProbe::LogAppend, micros() - append_start);
+  xSemaphoreTake(index_mutex_, portMAX_DELAY);
+  index_events(seq, events, written);
+  if (seq / kLogIndexBlock != (seq + written) / kLogIndexBlock) {
+    save_index();
+  }
+  xSemaphoreGive(index_mutex_);
+  return written == count;
+}
+
+void LogBuffer::index_events(uint32_t seq, const AccessEvent* events, size_t count) {
+  for (size_t i = 0; i < count; ++i, ++seq) {
+    const AccessEvent& event = events[i];
+    uint32_t block = seq / kLogIndexBlock;
+    BlockSummary& summary = index_[block % kLogIndexBlocks];
+    if (summary.block != block) {
+      memset(&summary, 0, sizeof(summary));
+      summary.block = block;
+      summary.min_time = UINT32_MAX;
+      if (seq % kLogIndexBlock != 0) {
+        // Earlier records of this block were never summarized: match anything.
+        summary.min_time = 0;
+        summary.max_time = UINT32_MAX;
+        summary.readers = 0xFF;
+        summary.results = 0xFF;
+        memset(summary.uids, 0xFF, sizeof(summary.uids));
+      }
+    }
+    ++summary.count;
+    summary.readers |= static_cast<uint8_t>(1u << (event.reader & 7));
+    summary.results |= static_cast<uint8_t>(1u << (event.result & 7));
+    if (event.flags & kEventClock) {
+      summary.min_time = event.time < summary.min_time ? event.time : summary.min_time;
+      summary.max_time = event.last() > summary.max_time ? event.last() : summary.max_time;
     }
-    json += "{\"ts\":";
-    json += entries_[idx].ts_ms;
-    json += ",\"msg\":\"";
-    json += entries_[idx].msg;
-    json += "\"}";
+    uint32_t h = uid_hash(event.key());
+    summary.uids[(h & 0xFF) >> 3] |= static_cast<uint8_t>(1u << (h & 7));
+    summary.uids[((h >> 8) & 0xFF) >> 3] |= static_cast<uint8_t>(1u << ((h >> 8) & 7));
+  }
+  indexed_end_ = seq;
+}
+
+void LogBuffer::load_index() {
+  xSemaphoreTake(index_mutex_, portMAX_DELAY);
+  for (auto& summary : index_) {
+    summary.block = kNoBlock;
+  }
+  const uint32_t first = ring_.first();
+  const uint32_t end = ring_.end();
+  uint32_t covered = first;
+  IndexHeader header{};
+  File file = LittleFS.open(kIndexPath, FILE_READ);
+  if (file && file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) == sizeof(header) &&
+      memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) == 0 && header.block_records == kLogIndexBlock &&
+      header.blocks == kLogIndexBlocks &&
+      file.read(reinterpret_cast<uint8_t*>(index_), sizeof(index_)) == sizeof(index_)) {
+    covered = header.covered;
+  }
+  if (file) {
+    file.close();
+  }
+  if (covered - first > end - first) {
+    covered = first;
+  }
+  // Summaries are saved at block boundaries; re-read the records after the
+  // last saved one, starting from the beginning of their block.
+  uint32_t start = covered - covered % kLogIndexBlock;
+  if (start - first > end - first) {
+    start = first;
+  }
+  for (uint32_t block = start / kLogIndexBlock; block <= end / kLogIndexBlock; ++block) {
+    index_[block % kLogIndexBlocks].block = kNoBlock;
   }
-  json += "]}";
-  return json;
+  indexed_end_ = start;
+  scan_ring(ring_, start, end, [this](uint32_t seq, const AccessEvent* events, size_t n) {
+    index_events(seq, events, n);
+    return true;
+  });
+  if (end - start >= kLogIndexBlock) {
+    save_index();
+  }
+  xSemaphoreGive(index_mutex_);
 }
 
-String LogBuffer::to_text() const {
-  String out;
-  for (size_t i = 0; i < count_; ++i) {
-    size_t idx = (head_ + i) % kMaxLogs;
-    out += entries_[idx].ts_ms;
-    out += ',';
-    out += entries_[idx].msg;
-    out += '\n';
+bool LogBuffer::save_index() {
+  IndexHeader header{};
+  memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+  header.covered = indexed_end_;
+  header.block_records = kLogIndexBlock;
+  header.blocks = kLogIndexBlocks;
+  File file = LittleFS.open(kIndexPath, FILE_WRITE);
+  if (!file) {
+    return false;
   }
-  return out;
+  bool ok = file.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header)) == sizeof(header) &&
+            file.write(reinterpret_cast<const uint8_t*>(index_), sizeof(index_)) == sizeof(index_);
+  file.close();
+  return ok;
 }
 
-bool LogBuffer::import_text(const char* text) {
-  if (!text) {
+void LogBuffer::reset_index() {
+  xSemaphoreTake(index_mutex_, portMAX_DELAY);
+  for (auto& summary : index_) {
+    summary.block = kNoBlock;
+  }
+  indexed_end_ = ring_.end();
+  save_index();
+  xSemaphoreGive(index_mutex_);
+}
+
+bool LogBuffer::block_matches(const BlockSummary& summary, const LogQuery& q) {
+  if ((q.from || q.to) && (summary.min_time > summary.max_time || summary.max_time < q.from ||
+                           (q.to && summary.min_time > q.to))) {
+    return false;
+  }
+  if (q.reader && !(summary.readers & (1u << (q.reader & 7)))) {
+    return false;
+  }
+  if (q.results && !(summary.results & q.results)) {
     return false;
   }
-  clear_all();
-  String data(text);
-  int start = 0;
-  while (start < data.length()) {
-    int end = data.indexOf('\n', start);
-    if (end < 0) {
-      end = data.length();
+  if (q.uid.len) {
+    uint32_t h = uid_hash(q.uid);
+    if (!(summary.uids[(h & 0xFF) >> 3] & (1u << (h & 7))) ||
+        !(summary.uids[((h >> 8) & 0xFF) >> 3] & (1u << ((h >> 8) & 7)))) {
+      return false;
     }
-    String line = data.substring(start, end);
-    line.trim();
-    start = end + 1;
-    if (line.length() == 0) {
-      continue;
+  }
+  return true;
+}
+
+void LogBuffer::query(const LogQuery& q, LogQueryEmit emit, void* ctx, LogQueryResult* result) const {
+  memset(result, 0, sizeof(*result));
+  const uint32_t first = ring_.first();
+  const uint32_t end = ring_.end();
+  uint32_t seq = q.has_cursor ? q.cursor : first;
+  if (seq - first > end - first) {
+    // Overwritten since the cursor was handed out.
+    seq = first;
+  }
+  const uint32_t limit = q.limit ? q.limit : 1;
+  AccessEvent batch[kLoadBatch];
+  while (seq != end && result->matched < limit && result->scanned < kLogQueryScanMax) {
+    uint32_t block = seq / kLogIndexBlock;
+    uint32_t block_end = (block + 1) * kLogIndexBlock;
+    if (block_end - seq > end - seq) {
+      block_end = end;
     }
-    int p1 = line.indexOf(',');
-    if (p1 < 0) {
+    xSemaphoreTake(index_mutex_, portMAX_DELAY);
+    const BlockSummary& summary = index_[block % kLogIndexBlocks];
+    bool skip = summary.block == block && !block_matches(summary, q);
+    xSemaphoreGive(index_mutex_);
+    if (skip) {
+      ++result->blocks_skipped;
+      seq = block_end;
       continue;
     }
-    String ts = line.substring(0, p1);
-    String msg = line.substring(p1 + 1);
-    add_internal(msg.c_str(), static_cast<uint32_t>(ts.toInt()), false);
+    while (seq != block_end && result->matched < limit) {
+      size_t want = block_end - seq < kLoadBatch ? block_end - seq : kLoadBatch;
+      size_t got = ring_.read(seq, batch, want);
+      if (got == 0) {
+        seq = block_end;
+        break;
+      }
+      size_t i = 0;
+      for (; i < got && result->matched < limit; ++i) {
+        if (event_matches(batch[i], q)) {
+          emit(batch[i], ctx);
+          ++result->matched;
+        }
+      }
+      result->scanned += static_cast<uint32_t>(i);
+      seq += static_cast<uint32_t>(i);
+    }
   }
-  return save();
+  result->next = seq;
+  result->more = seq != end;
 }
 
-void LogBuffer::clear_ram() {
-  head_ = 0;
-  count_ = 0;
+size_t LogBuffer::write_behind(uint32_t max_age_ms, size_t max_events) {
+  uint32_t head = pending_head_.load(std::memory_order_relaxed);
+  uint32_t tail = pending_tail_.load(std::memory_order_acquire);
+  uint32_t waiting = tail - head;
+  if (waiting == 0) {
+    flush_requested_.store(false, std::memory_order_relaxed);
+    return 0;
+  }
+  bool due = flush_requested_.load(std::memory_order_relaxed) || waiting >= max_events ||
+             millis() - pending_ms_[head % kPendingEvents] >= max_age_ms;
+  if (!due) {
+    return 0;
+  }
+  // At most two runs: up to the end of the array, then from its start.
+  uint32_t first = head % kPendingEvents;
+  uint32_t run = kPendingEvents - first;
+  if (run > waiting) {
+    run = waiting;
+  }
+  bool ok = persist(&pending_[first], run);
+  if (ok && run < waiting) {
+    ok = persist(&pending_[0], waiting - run);
+  }
+  // A failed write is not retried: the events stay in the RAM ring and the
+  // queue keeps moving.
+  (ok ? flushed_ : dropped_).fetch_add(waiting, std::memory_order_relaxed);
+  // Before the slots can be reused, so a recovery never replays them.
+  stage_mark_flushed(tail);
+  pending_head_.store(tail, std::memory_order_release);
+  return ok ? waiting : 0;
 }
 
-void LogBuffer::clear_all() {
-  clear_ram();
-  if (!ensure_fs()) {
-    return;
+bool LogBuffer::flush(uint32_t timeout_ms) {
+  close_run();
+  uint32_t start = millis();
+  while (pending_tail_.load(std::memory_order_relaxed) != pending_head_.load(std::memory_order_acquire)) {
+    flush_requested_.store(true, std::memory_order_relaxed);
+    if (millis() - start >= timeout_ms) {
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return true;
+}
+
+void LogBuffer::writer_stats(LogWriterStats* out) const {
+  out->queued = queued_.load(std::memory_order_relaxed);
+  out->flushed = flushed_.load(std::memory_order_relaxed);
+  out->dropped = dropped_.load(std::memory_order_relaxed);
+  out->pending = pending_tail_.load(std::memory_order_relaxed) - pending_head_.load(std::memory_order_relaxed);
+  out->recovered = recovered_;
+  out->stored = ring_.count();
+}
+
+void LogBuffer::snapshot(uint32_t* first, uint32_t* end) const {
+  *first = ring_.first();
+  *end = ring_.end();
+}
+
+size_t LogBuffer::export_text(const LogExportRange& range, const UsersDb& users, LogExportSink sink,
+                              void* ctx) const {
+  const Settings settings = settings_get();
+  const size_t stop = range.length > SIZE_MAX - range.offset ? SIZE_MAX : range.offset + range.length;
+  char chunk[kLogExportChunk];
+  size_t used = 0;
+  size_t total = 0;
+  scan_ring(ring_, range.first, range.end, [&](uint32_t, const AccessEvent* events, size_t n) {
+    char name[32];
+    char line[kTextLineMax + 12];
+    for (size_t i = 0; i < n; ++i) {
+      event_name(users, events[i], name, sizeof(name));
+      int head = snprintf(line, sizeof(line), "%lu,", static_cast<unsigned long>(events[i].time));
+      size_t len = static_cast<size_t>(head);
+      len += format_text(events[i], settings, name, line + len, sizeof(line) - len - 1);
+      line[len++] = '\n';
+      // Only the part of the line inside [offset, stop) goes to the sink.
+      size_t from = range.offset > total ? range.offset - total : 0;
+      size_t to = stop > total ? (stop - total < len ? stop - total : len) : 0;
+      total += len;
+      if (!sink || from >= to) {
+        continue;
+      }
+      if (used + (to - from) > sizeof(chunk)) {
+        sink(chunk, used, ctx);
+        used = 0;
+      }
+      memcpy(chunk + used, line + from, to - from);
+      used += to - from;
+    }
+    return !sink || total < stop;
+  });
+  if (sink && used > 0) {
+    sink(chunk, used, ctx);
   }
-  LittleFS.remove(kLogsPath);
+  return total;
 }
 
 } // namespace app
@@ -1,32 +1,236 @@
 #pragma once
 
 #include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "log_ring.h"
+#include "uid.h"
 
 namespace app {
 
-struct LogEntry {
-  uint32_t ts_ms;
-  char msg[160];
+struct Settings;
+class UsersDb;
+
+enum class AccessResult : uint8_t {
+  Granted = 0,
+  Denied = 1,        // known credential without the door's group, or outside its terms
+  Unknown = 2,       // no user and no rule
+  OutOfSchedule = 3  // user's or door's week profile
+};
+
+constexpr uint8_t kEventClock = 0x01; // time is unix seconds, else millis()
+constexpr uint8_t kEventRule = 0x02;  // matched a credential rule, not a user
+
+// One swipe, or a run of identical denied swipes, 20 bytes in RAM and on
+// flash. Names, dates and text are only produced when the log is viewed or
+// exported: the user name is looked up by UID at that point, so a renamed
+// user shows the new name and a deleted one none. The UID is split like in
+// the user table so the record needs no 8-byte alignment.
+struct AccessEvent {
+  uint32_t uid_lo;
+  uint32_t uid_hi;
+  uint32_t time;    // first swipe
+  uint16_t repeats; // identical swipes after the first folded into this record
+  uint16_t span;    // last swipe - time, in the units of time
+  uint8_t uid_len;
+  uint8_t reader;
+  uint8_t result; // AccessResult
+  uint8_t flags;
+
+  UidKey key() const {
+    return UidKey{(static_cast<uint64_t>(uid_hi) << 32) | uid_lo, uid_len};
+  }
+  void set_key(const UidKey& uid) {
+    uid_lo = static_cast<uint32_t>(uid.value);
+    uid_hi = static_cast<uint32_t>(uid.value >> 32);
+    uid_len = uid.len;
+  }
+  uint32_t last() const {
+    return time + span;
+  }
+};
+
+static_assert(sizeof(AccessEvent) == 20, "AccessEvent is the on-flash record");
+
+// Limits for Settings::log_flush_ms/log_flush_events; the event limit keeps
+// a full batch well inside the queue.
+constexpr uint32_t kMaxLogFlushMs = 60000;
+constexpr uint16_t kMaxLogFlushEvents = 64;
+// Limit for Settings::log_coalesce_ms; keeps a run's span inside 16 bits
+// when time is millis().
+constexpr uint32_t kMaxLogCoalesceMs = 60000;
+constexpr uint32_t kLogQueryScanMax = 4096;
+
+// Write-behind counters for /status. dropped counts events lost to a full
+// queue or a failed write; pending is what a power loss right now would cost
+// (a software or watchdog reset costs nothing, see LogBuffer). recovered is
+// what the last boot took back from the RTC stage.
+struct LogWriterStats {
+  uint32_t queued;
+  uint32_t flushed;
+  uint32_t dropped;
+  uint32_t pending;
+  uint32_t stored;
+  uint32_t recovered;
 };
 
+// The persisted log is summarized per block of kLogIndexBlock records: time
+// range, readers, results and a 256-bit filter of UIDs. A query reads only
+// the blocks whose summary can match.
+constexpr uint32_t kLogIndexBlock = 256;
+constexpr uint32_t kLogIndexBlocks = kLogRingCapacity / kLogIndexBlock;
+static_assert(kLogSegmentRecords % kLogIndexBlock == 0, "index blocks must not straddle segments");
+
+// Filters for LogBuffer::query(); zero fields match anything. from/to are
+// unix times and only match events logged with a valid clock. results is a
+// mask of 1 << AccessResult.
+struct LogQuery {
+  uint32_t from;
+  uint32_t to;
+  UidKey uid;
+  uint8_t reader;
+  uint8_t results;
+  bool has_cursor;
+  uint32_t cursor; // sequence number to resume from
+  uint16_t limit;
+};
+
+struct LogQueryResult {
+  uint32_t matched;
+  uint32_t scanned;        // records read from flash
+  uint32_t blocks_skipped; // blocks ruled out by their summary
+  uint32_t next;           // cursor for the next page
+  bool more;
+};
+
+using LogQueryEmit = void (*)(const AccessEvent& event, void* ctx);
+
+constexpr size_t kLogExportChunk = 2048;
+// LogBuffer::format_json() at its longest: a full message line, an escaped
+// 31-character name and the fixed fields.
+constexpr size_t kLogJsonMax = 416;
+// Newest events kept in RAM and served by /logs.
+constexpr size_t kLogRecentMax = 50;
+
+struct LogExportRange {
+  uint32_t first;
+  uint32_t end;
+  size_t offset;
+  size_t length; // SIZE_MAX for the rest
+};
+
+using LogExportSink = void (*)(const char* data, size_t len, void* ctx);
+
+// add() keeps the event in the RAM ring and queues it for the storage task,
+// so the swipe path never waits for flash. The queue is a lock-free single
+// producer (logic_task) / single consumer (storage task) ring. Each queued
+// event is also staged with a CRC in RTC memory, which survives software
+// and watchdog resets; load() writes whatever was staged but not flushed.
 class LogBuffer {
  public:
   void init();
   bool load();
-  bool save() const;
-  void add(const char* msg, uint32_t ts_ms);
-  String to_json() const;
-  String to_text() const;
-  bool import_text(const char* text);
+  // Producer side. A denied swipe identical in reader, UID and result to the
+  // one before it, within coalesce_ms of the first, is folded into that
+  // record; the record is queued for flash once the run ends (see
+  // close_expired_run()). 0 logs every swipe on its own.
+  void add(const AccessEvent& event, uint32_t coalesce_ms);
+  // Producer side: queues the open run once its window has passed. Call
+  // regularly so a run ends without waiting for the next swipe.
+  void close_expired_run(uint32_t now_ms);
+  // Copies up to max of the newest events in the RAM ring into out, oldest
+  // first, and returns how many. Safe to call from other tasks: the copy is
+  // taken under a mutex the producer holds only while it edits the ring.
+  size_t recent(AccessEvent* out, size_t max) const;
   void clear_ram();
   void clear_all();
+  // Sequence numbers of the persisted log right now; an export of that range
+  // renders the same bytes until the oldest segment is reused.
+  void snapshot(uint32_t* first, uint32_t* end) const;
+  // Renders records [range.first, range.end) as "time,msg" lines, oldest
+  // first, and passes the bytes in [offset, offset + length) to sink in
+  // chunks of at most kLogExportChunk. A null sink only counts. Returns the
+  // bytes rendered, which is the full length when sink is null. Safe to call
+  // from other tasks; users is read under its read lock.
+  size_t export_text(const LogExportRange& range, const UsersDb& users, LogExportSink sink, void* ctx) const;
+
+  // The message part of a line, "[DD/MM/YYYY,HH:MM:SS,]relay,status,uid,name",
+  // with relay names from settings; status is granted or denied.
+  static size_t format_text(const AccessEvent& event, const Settings& settings, const char* name, char* out,
+                            size_t out_len);
+  // One event as the JSON object used by /logs and /logs/query; out needs
+  // kLogJsonMax.
+  static size_t format_json(const AccessEvent& event, const Settings& settings, const UsersDb& users, char* out,
+                            size_t out_len);
+
+  // Walks the persisted log from the cursor (or the oldest record), calling
+  // emit for up to limit matches. Stops after kLogQueryScanMax records so a
+  // sparse match cannot stall the caller; result->next resumes from there.
+  // Safe to call from other tasks.
+  void query(const LogQuery& q, LogQueryEmit emit, void* ctx, LogQueryResult* result) const;
+
+  // Storage task side: writes the queued events as one batch once max_events
+  // are waiting, the oldest has waited max_age_ms, or a flush was requested.
+  // Returns the number written.
+  size_t write_behind(uint32_t max_age_ms, size_t max_events);
+  // Producer side: asks the storage task to write everything queued and waits
+  // up to timeout_ms for it. True when the queue is empty.
+  bool flush(uint32_t timeout_ms);
+  void writer_stats(LogWriterStats* out) const;
 
  private:
-  void add_internal(const char* msg, uint32_t ts_ms, bool persist);
-  static constexpr size_t kMaxLogs = 50;
-  LogEntry entries_[kMaxLogs];
+  struct BlockSummary {
+    uint32_t block; // seq / kLogIndexBlock, kNoBlock when not trustworthy
+    uint32_t min_time;
+    uint32_t max_time;
+    uint16_t count;
+    uint8_t readers; // 1 << reader
+    uint8_t results; // 1 << AccessResult
+    uint8_t uids[32];
+  };
+
+  void add_internal(const AccessEvent& event, bool persist);
+  void enqueue(const AccessEvent& event);
+  void close_run();
+  void import_legacy();
+  void recover_staged();
+  // Appends to the ring and keeps the block summaries in step.
+  bool persist(const AccessEvent* events, size_t count);
+  void index_events(uint32_t seq, const AccessEvent* events, size_t count);
+  void load_index();
+  bool save_index();
+  void reset_index();
+  static bool block_matches(const BlockSummary& summary, const LogQuery& q);
+  static constexpr size_t kMaxLogs = kLogRecentMax;
+  static constexpr uint32_t kPendingEvents = 128;
+  // Guards entries_, head_ and count_ against recent() on other tasks.
+  SemaphoreHandle_t ram_mutex_ = nullptr;
+  AccessEvent entries_[kMaxLogs];
   size_t head_ = 0;
   size_t count_ = 0;
+  LogRing ring_;
+
+  AccessEvent pending_[kPendingEvents];
+  uint32_t pending_ms_[kPendingEvents];
+  std::atomic<uint32_t> pending_head_{0}; // consumer
+  std::atomic<uint32_t> pending_tail_{0}; // producer
+  std::atomic<bool> flush_requested_{false};
+  std::atomic<uint32_t> queued_{0};
+  std::atomic<uint32_t> flushed_{0};
+  std::atomic<uint32_t> dropped_{0};
+  uint32_t recovered_ = 0;
+
+  // Open run of repeated denials: the newest entry of the RAM ring, not yet
+  // queued.
+  bool run_open_ = false;
+  uint32_t run_started_ms_ = 0;
+  uint32_t run_window_ms_ = 0;
+
+  SemaphoreHandle_t index_mutex_ = nullptr;
+  BlockSummary index_[kLogIndexBlocks];
+  uint32_t indexed_end_ = 0;
 };
 
 } // namespace app
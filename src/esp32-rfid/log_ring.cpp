@@ -0,0 +1,336 @@
+#include "log_ring.h"
+
+#include <LittleFS.h>
+#include <cstring>
+
+namespace app {
+
+namespace {
+constexpr const char* kRingHeaderPath = "/logring.bin";
+constexpr const char* kRingUpgradePath = "/logup.tmp";
+constexpr const char* kRingTrimPath = "/logtrim.tmp";
+constexpr char kRingMagic[4] = {'L', 'R', 'G', '1'};
+
+struct RingHeader {
+  char magic[4];
+  uint16_t record_size;
+  uint16_t segment_records;
+  uint16_t segments;
+  uint16_t upgraded; // segments from head already converted to a new record size
+  uint32_t head;
+  uint32_t tail;
+};
+
+void segment_path(uint32_t seq, char* out, size_t out_len) {
+  snprintf(out, out_len, "/log%02u.bin", static_cast<unsigned>((seq / kLogSegmentRecords) % kLogSegments));
+}
+
+bool write_raw_header(const RingHeader& header) {
+  File file = LittleFS.open(kRingHeaderPath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  bool ok = file.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header)) == sizeof(header);
+  file.close();
+  return ok;
+}
+
+// Rewrites the segments of a ring from header->record_size to record_size,
+// oldest first, each through a temporary file renamed over the original.
+// header->upgraded counts steps, two per segment (converted, renamed), and is
+// saved after each one, so a reset resumes where it stopped instead of
+// converting a segment twice. A torn last record is dropped.
+bool upgrade_segments(RingHeader* header, uint16_t record_size, LogRecordUpgrade upgrade) {
+  constexpr size_t kBatch = 16;
+  const uint16_t old_size = header->record_size;
+  if (old_size == 0 || old_size > kLogRecordMax || record_size > kLogRecordMax) {
+    return false;
+  }
+  uint8_t in[kBatch * kLogRecordMax];
+  uint8_t out[kBatch * kLogRecordMax];
+  const uint32_t segments = (header->tail - header->head) / kLogSegmentRecords + 1;
+  for (uint32_t step = header->upgraded; step < 2 * segments; ++step) {
+    char path[16];
+    segment_path(header->head + (step / 2) * kLogSegmentRecords, path, sizeof(path));
+    if (step % 2 == 0) {
+      File src = LittleFS.open(path, FILE_READ);
+      File dst = LittleFS.open(kRingUpgradePath, FILE_WRITE);
+      if (!dst) {
+        src.close();
+        return false;
+      }
+      bool ok = true;
+      size_t got = 0;
+      while (ok && src && (got = src.read(in, kBatch * old_size) / old_size) > 0) {
+        for (size_t r = 0; ok && r < got; ++r) {
+          ok = upgrade(in + r * old_size, old_size, out + r * record_size);
+        }
+        ok = ok && dst.write(out, got * record_size) == got * record_size;
+      }
+      src.close();
+      dst.close();
+      if (!ok) {
+        LittleFS.remove(kRingUpgradePath);
+        return false;
+      }
+    } else if (LittleFS.exists(kRingUpgradePath) && !LittleFS.rename(kRingUpgradePath, path)) {
+      // Gone means the rename happened before a reset.
+      return false;
+    }
+    header->upgraded = static_cast<uint16_t>(step + 1);
+    if (!write_raw_header(*header)) {
+      return false;
+    }
+  }
+  header->record_size = record_size;
+  header->upgraded = 0;
+  return write_raw_header(*header);
+}
+
+// Cuts a segment back to its first bytes, dropping a torn trailing record.
+// LittleFS has no truncate, so the kept part is copied to a temporary file
+// that replaces the segment.
+bool trim_segment(const char* path, size_t bytes) {
+  File src = LittleFS.open(path, FILE_READ);
+  if (!src) {
+    return false;
+  }
+  File dst = LittleFS.open(kRingTrimPath, FILE_WRITE);
+  if (!dst) {
+    src.close();
+    return false;
+  }
+  uint8_t buf[512];
+  bool ok = true;
+  while (ok && bytes > 0) {
+    size_t want = bytes < sizeof(buf) ? bytes : sizeof(buf);
+    ok = src.read(buf, want) == want && dst.write(buf, want) == want;
+    bytes -= want;
+  }
+  src.close();
+  dst.close();
+  if (!ok || !LittleFS.rename(kRingTrimPath, path)) {
+    LittleFS.remove(kRingTrimPath);
+    return false;
+  }
+  return true;
+}
+
+class RingLock {
+ public:
+  explicit RingLock(SemaphoreHandle_t mutex) : mutex_(mutex) {
+    if (mutex_) {
+      xSemaphoreTake(mutex_, portMAX_DELAY);
+    }
+  }
+  ~RingLock() {
+    if (mutex_) {
+      xSemaphoreGive(mutex_);
+    }
+  }
+
+ private:
+  SemaphoreHandle_t mutex_;
+};
+
+} // namespace
+
+bool LogRing::begin(uint16_t record_size, LogRecordUpgrade upgrade) {
+  if (!mutex_) {
+    mutex_ = xSemaphoreCreateMutex();
+  }
+  RingLock lock(mutex_);
+  record_size_ = record_size;
+  head_ = 0;
+  tail_ = 0;
+  tail_count_ = 0;
+  tail_closed_ = false;
+  if (!LittleFS.begin()) {
+    return false;
+  }
+
+  RingHeader header{};
+  File file = LittleFS.open(kRingHeaderPath, FILE_READ);
+  bool valid = file && file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) == sizeof(header);
+  if (file) {
+    file.close();
+  }
+  valid = valid && memcmp(header.magic, kRingMagic, sizeof(kRingMagic)) == 0 &&
+          header.segment_records == kLogSegmentRecords && header.segments == kLogSegments &&
+          header.head % kLogSegmentRecords == 0 && header.tail % kLogSegmentRecords == 0 &&
+          header.tail - header.head < kLogRingCapacity;
+  if (valid && header.record_size != record_size) {
+    valid = upgrade && upgrade_segments(&header, record_size, upgrade);
+  }
+  if (!valid) {
+    wipe();
+    return write_header();
+  }
+
+  head_ = header.head;
+  tail_ = header.tail;
+  char path[16];
+  segment_path(tail_, path, sizeof(path));
+  File tail = LittleFS.open(path, FILE_READ);
+  if (tail) {
+    size_t size = tail.size();
+    tail.close();
+    tail_count_ = static_cast<uint32_t>(size / record_size_);
+    if (tail_count_ > kLogSegmentRecords) {
+      tail_count_ = kLogSegmentRecords;
+    } else if (size % record_size_ != 0 && !trim_segment(path, tail_count_ * record_size_)) {
+      // A power loss mid-append left part of a record; when it cannot be
+      // cut off, the next append starts a new segment instead of writing
+      // behind it.
+      tail_closed_ = true;
+    }
+  }
+  LittleFS.remove(kRingTrimPath);
+  return true;
+}
+
+bool LogRing::write_header() const {
+  RingHeader header{};
+  memcpy(header.magic, kRingMagic, sizeof(kRingMagic));
+  header.record_size = record_size_;
+  header.segment_records = kLogSegmentRecords;
+  header.segments = kLogSegments;
+  header.head = head_;
+  header.tail = tail_;
+  return write_raw_header(header);
+}
+
+void LogRing::wipe() {
+  char path[16];
+  for (uint32_t i = 0; i < kLogSegments; ++i) {
+    segment_path(i * kLogSegmentRecords, path, sizeof(path));
+    LittleFS.remove(path);
+  }
+  LittleFS.remove(kRingUpgradePath);
+}
+
+bool LogRing::rotate() {
+  uint32_t next = tail_ + kLogSegmentRecords;
+  uint32_t head = head_;
+  if (next - head >= kLogRingCapacity) {
+    head += kLogSegmentRecords;
+  }
+  // Truncate before the header moves: a reset in between leaves the old
+  // header pointing at full segments plus one short oldest segment.
+  char path[16];
+  segment_path(next, path, sizeof(path));
+  File file = LittleFS.open(path, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  file.close();
+  head_ = head;
+  tail_ = next;
+  tail_count_ = 0;
+  tail_closed_ = false;
+  return write_header();
+}
+
+size_t LogRing::append(const void* records, size_t count, uint32_t* first) {
+  RingLock lock(mutex_);
+  *first = tail_ + tail_count_;
+  if (record_size_ == 0) {
+    return 0;
+  }
+  const auto* src = static_cast<const uint8_t*>(records);
+  size_t done = 0;
+  while (done < count) {
+    if ((tail_count_ >= kLogSegmentRecords || tail_closed_) && !rotate()) {
+      return done;
+    }
+    if (done == 0) {
+      // Past a closed segment the records start in the next one.
+      *first = tail_ + tail_count_;
+    }
+    size_t run = kLogSegmentRecords - tail_count_;
+    if (run > count - done) {
+      run = count - done;
+    }
+    char path[16];
+    segment_path(tail_, path, sizeof(path));
+    File file = LittleFS.open(path, FILE_APPEND);
+    if (!file) {
+      return done;
+    }
+    size_t bytes = run * record_size_;
+    size_t written = file.write(src, bytes);
+    file.close();
+    tail_count_ += static_cast<uint32_t>(written / record_size_);
+    done += written / record_size_;
+    if (written != bytes) {
+      if (written % record_size_ != 0 && !trim_segment(path, tail_count_ * record_size_)) {
+        tail_closed_ = true;
+      }
+      return done;
+    }
+    src += bytes;
+  }
+  return done;
+}
+
+size_t LogRing::read(uint32_t seq, void* out, size_t max) const {
+  RingLock lock(mutex_);
+  uint32_t last = tail_ + tail_count_;
+  if (record_size_ == 0 || seq - head_ >= last - head_) {
+    return 0;
+  }
+  auto* dest = static_cast<uint8_t*>(out);
+  size_t done = 0;
+  while (done < max && seq != last) {
+    uint32_t in_segment = kLogSegmentRecords - seq % kLogSegmentRecords;
+    size_t want = max - done;
+    if (want > in_segment) {
+      want = in_segment;
+    }
+    if (want > last - seq) {
+      want = last - seq;
+    }
+    char path[16];
+    segment_path(seq, path, sizeof(path));
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+      break;
+    }
+    size_t got = 0;
+    if (file.seek((seq % kLogSegmentRecords) * record_size_)) {
+      got = file.read(dest + done * record_size_, want * record_size_) / record_size_;
+    }
+    file.close();
+    done += got;
+    seq += got;
+    if (got < want) {
+      break;
+    }
+  }
+  return done;
+}
+
+bool LogRing::clear() {
+  RingLock lock(mutex_);
+  wipe();
+  // Keep counting from the old end so cursors handed out earlier never
+  // point into new records.
+  uint32_t end = tail_ + tail_count_;
+  head_ = end - end % kLogSegmentRecords + (end % kLogSegmentRecords ? kLogSegmentRecords : 0);
+  tail_ = head_;
+  tail_count_ = 0;
+  tail_closed_ = false;
+  return write_header();
+}
+
+uint32_t LogRing::first() const {
+  RingLock lock(mutex_);
+  return head_;
+}
+
+uint32_t LogRing::end() const {
+  RingLock lock(mutex_);
+  return tail_ + tail_count_;
+}
+
+} // namespace app
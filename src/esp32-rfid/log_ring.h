@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+namespace app {
+
+constexpr size_t kLogSegments = 16;
+constexpr size_t kLogSegmentRecords = 2048;
+constexpr size_t kLogRingCapacity = kLogSegments * kLogSegmentRecords;
+constexpr size_t kLogRecordMax = 32;
+
+// Converts one record written with an older record size into out; false if
+// that size is not supported.
+using LogRecordUpgrade = bool (*)(const uint8_t* in, uint16_t in_size, uint8_t* out);
+
+// Fixed-size records in a ring of segment files (/log00.bin../log15.bin)
+// described by a small header (/logring.bin). Records are addressed by a
+// running sequence number: seq picks the segment and the offset inside it,
+// so an append is one record write at the end of the newest segment and the
+// header is only rewritten when the ring rotates. Rotation truncates the
+// oldest segment and reuses it in place.
+//
+// LittleFS cannot rewrite the middle of a file without copying the rest of
+// it, so the ring rotates whole segments rather than single slots.
+class LogRing {
+ public:
+  // Opens the ring for records of record_size bytes. A ring written with a
+  // different record size is converted segment by segment through upgrade
+  // when not null, resuming after a reset; any other geometry mismatch
+  // starts a new, empty ring.
+  bool begin(uint16_t record_size, LogRecordUpgrade upgrade);
+  // Appends count records, opening each segment once. Returns the number
+  // written, which are the first ones; first gets the sequence number of
+  // the first one.
+  size_t append(const void* records, size_t count, uint32_t* first);
+  // Reads up to max records starting at seq; stops at the end of the ring or
+  // at a segment that cannot be read. Returns the number read.
+  size_t read(uint32_t seq, void* out, size_t max) const;
+  bool clear();
+
+  // Oldest and one-past-newest sequence numbers.
+  uint32_t first() const;
+  uint32_t end() const;
+  size_t count() const {
+    return end() - first();
+  }
+
+ private:
+  bool write_header() const;
+  bool rotate();
+  void wipe();
+
+  SemaphoreHandle_t mutex_ = nullptr;
+  uint16_t record_size_ = 0;
+  uint32_t head_ = 0; // first seq of the oldest segment
+  uint32_t tail_ = 0; // first seq of the segment being appended to
+  uint32_t tail_count_ = 0;
+  bool tail_closed_ = false; // torn record that could not be cut off; rotate first
+};
+
+} // namespace app
@@ -4,71 +4,74 @@
 #include <cstring>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
 
 #include "log.h"
 #include "messages.h"
 #include "relay.h"
 #include "settings.h"
 #include "rtc.h"
+#include "rules.h"
+#include "schedule.h"
+#include "stats.h"
+#include "timing.h"
 #include "users.h"
 
 namespace app {
 
 namespace {
 constexpr uint32_t kRelayPulseMs = 600;
+constexpr uint32_t kExpireIntervalMs = 30000;
+constexpr uint32_t kStoragePollMs = 20;
+constexpr uint32_t kLogFlushWaitMs = 1000;
+constexpr uint32_t kStatsFlushWaitMs = 1000;
 
 struct LastRfidState {
   uint8_t reader_id = 0;
-  char uid[kUidMaxLen] = {0};
+  UidKey uid{};
   bool allowed = false;
   uint32_t ts_ms = 0;
 };
 
-void sanitize_csv_field(const char* src, char* dest, size_t dest_len) {
-  if (!dest || dest_len == 0) {
-    return;
-  }
-  if (!src) {
-    dest[0] = '\0';
+UsersDb g_users;
+LogBuffer g_logs;
+AccessStats g_stats;
+
+// All replies are assembled here; responses are large and only one is in
+// flight at a time since the logic task handles requests sequentially.
+LogicResponse g_response;
+
+LogicResponse& begin_response(bool ok) {
+  memset(&g_response, 0, sizeof(g_response));
+  g_response.ok = ok ? 1 : 0;
+  return g_response;
+}
+
+void finish_response(QueueHandle_t reply) {
+  if (reply == nullptr) {
     return;
   }
-  size_t out = 0;
-  for (size_t i = 0; src[i] != '\0' && out + 1 < dest_len; ++i) {
-    char c = src[i];
-    if (c == ',' || c == '\r' || c == '\n') {
-      c = ' ';
-    }
-    dest[out++] = c;
-  }
-  dest[out] = '\0';
+  xQueueSend(reply, &g_response, pdMS_TO_TICKS(100));
 }
 
 void send_response(QueueHandle_t reply, bool ok, const String& json) {
   if (reply == nullptr) {
     return;
   }
-  static LogicResponse resp;
-  memset(&resp, 0, sizeof(resp));
-  resp.ok = ok ? 1 : 0;
+  LogicResponse& resp = begin_response(ok);
   strncpy(resp.json, json.c_str(), sizeof(resp.json) - 1);
-  resp.json[sizeof(resp.json) - 1] = '\0';
-  xQueueSend(reply, &resp, pdMS_TO_TICKS(100));
+  finish_response(reply);
 }
 
 void send_response_cstr(QueueHandle_t reply, bool ok, const char* json) {
   if (reply == nullptr) {
     return;
   }
-  static LogicResponse resp;
-  memset(&resp, 0, sizeof(resp));
-  resp.ok = ok ? 1 : 0;
+  LogicResponse& resp = begin_response(ok);
   if (json) {
     strncpy(resp.json, json, sizeof(resp.json) - 1);
-    resp.json[sizeof(resp.json) - 1] = '\0';
-  } else {
-    resp.json[0] = '\0';
   }
-  xQueueSend(reply, &resp, pdMS_TO_TICKS(100));
+  finish_response(reply);
 }
 
 void send_uart_feedback(AppQueues* queues, uint8_t reader_id, bool allowed) {
@@ -84,29 +87,81 @@ void send_uart_feedback(AppQueues* queues, uint8_t reader_id, bool allowed) {
 
 } // namespace
 
+const UsersDb& logic_users() {
+  return g_users;
+}
+
+const LogBuffer& logic_logs() {
+  return g_logs;
+}
+
+const AccessStats& logic_stats() {
+  return g_stats;
+}
+
+void storage_task(void* param) {
+  (void)param;
+  for (;;) {
+    const Settings settings = settings_get();
+    g_logs.write_behind(settings.log_flush_ms, settings.log_flush_events);
+    g_stats.save_if_due(millis());
+    g_users.write_snapshot_if_requested();
+    vTaskDelay(pdMS_TO_TICKS(kStoragePollMs));
+  }
+}
+
 void logic_task(void* param) {
   auto* queues = static_cast<AppQueues*>(param);
 
-  static UsersDb users;
-  static LogBuffer logs;
+  UsersDb& users = g_users;
+  LogBuffer& logs = g_logs;
+  AccessStats& stats = g_stats;
   static LastRfidState last_rfid;
+  static ScheduleTable schedules;
+  static RuleTable rules;
 
   users.init();
   logs.init();
+  stats.init();
+  schedules.init();
+  rules.init();
   users.load();
   logs.load();
+  stats.load();
+  schedules.load();
+  rules.load();
   relay_init();
   auto settings = settings_get();
   relay_set_state(1, settings.relay1_state);
   relay_set_state(2, settings.relay2_state);
 
+  uint32_t last_expire_ms = 0;
+  bool expire_backlog = false;
+
   QueueSetHandle_t set = xQueueCreateSet(16);
   xQueueAddToSet(queues->rfid_queue, set);
   xQueueAddToSet(queues->logic_queue, set);
 
   for (;;) {
     QueueSetMemberHandle_t active = xQueueSelectFromSet(set, pdMS_TO_TICKS(200));
+    // A run of denied swipes goes to the queue once its window has passed,
+    // swipe or not.
+    logs.close_expired_run(millis());
     if (active == nullptr) {
+      // Idle: journal used-up visitor uses and, once the users journal is
+      // long, hand it to the storage task to fold into a new snapshot.
+      users.flush_terms();
+      users.compact_if_needed();
+      users.flush_usage_if_due(millis());
+      // Visitor expiry: advance the timer wheel and purge one batch; keep
+      // going on the next idle pass while a backlog remains.
+      uint32_t now_ms = millis();
+      if (expire_backlog || now_ms - last_expire_ms >= kExpireIntervalMs) {
+        last_expire_ms = now_ms;
+        RtcDateTime now{};
+        uint32_t epoch = (rtc_has_valid_time() && rtc_get_datetime(&now)) ? rtc_to_epoch(now) : 0;
+        expire_backlog = users.expire(epoch) != 0;
+      }
       continue;
     }
 
@@ -114,47 +169,59 @@ void logic_task(void* param) {
       RfidEvent event{};
       if (xQueueReceive(queues->rfid_queue, &event, 0) == pdTRUE) {
         const uint8_t relay_id = event.reader_id;
-        bool allowed = users.authorized(event.uid, relay_id);
+        const Settings settings = settings_get();
+        RtcDateTime dt{};
+        bool has_time = rtc_has_valid_time() && rtc_get_datetime(&dt);
+        int16_t week_slot = has_time ? schedule_slot(dt) : kNoScheduleSlot;
+
         UserRecord user{};
-        bool has_user = users.get_user(event.uid, &user);
+        bool allowed = false;
+        uint32_t door_groups = (relay_id == 1) ? settings.relay1_groups : settings.relay2_groups;
+        uint32_t epoch = has_time ? rtc_to_epoch(dt) : 0;
+        const uint32_t lookup_start = micros();
+        const bool known_user = users.lookup(event.uid, door_groups, epoch, &user, &allowed);
+        timing_record(TimingProbe::UserLookup, micros() - lookup_start);
+        bool has_user = known_user;
+        bool by_rule = false;
+        if (!has_user) {
+          // No exact record: fall back to the range and facility-code rules.
+          const CredentialRule* rule = rules.match(event.uid);
+          if (rule) {
+            has_user = true;
+            by_rule = true;
+            user.groups = rule->groups;
+            user.schedule = rule->schedule;
+            strncpy(user.name, rule->name, sizeof(user.name) - 1);
+            allowed = (rule->groups & door_groups) != 0;
+          }
+        }
+        AccessResult result = has_user ? (allowed ? AccessResult::Granted : AccessResult::Denied) : AccessResult::Unknown;
+        if (allowed) {
+          // One bit test each for the user's and the door's week profile.
+          uint8_t door_schedule = (relay_id == 1) ? settings.relay1_schedule : settings.relay2_schedule;
+          allowed = schedules.allows(user.schedule, week_slot) && schedules.allows(door_schedule, week_slot);
+          if (!allowed) {
+            result = AccessResult::OutOfSchedule;
+          }
+        }
+
+        if (known_user) {
+          users.record_use(event.uid, relay_id, allowed, has_time ? &dt : nullptr);
+        }
 
         last_rfid.reader_id = relay_id;
-        strncpy(last_rfid.uid, event.uid, sizeof(last_rfid.uid) - 1);
-        last_rfid.uid[sizeof(last_rfid.uid) - 1] = '\0';
+        last_rfid.uid = event.uid;
         last_rfid.allowed = allowed;
         last_rfid.ts_ms = millis();
 
-        const char* relay_name = (relay_id == 1) ? settings_get().relay1_name : settings_get().relay2_name;
-        char relay_field[32];
-        char uid_field[24];
-        char name_field[40];
-        sanitize_csv_field(relay_name, relay_field, sizeof(relay_field));
-        sanitize_csv_field(event.uid, uid_field, sizeof(uid_field));
-        sanitize_csv_field(user.name, name_field, sizeof(name_field));
-
-        const char* status = allowed ? "granted" : "denied";
-        char base_msg[120];
-        if (allowed && has_user) {
-          snprintf(base_msg, sizeof(base_msg), "%s,%s,%s,%s",
-                   relay_field, status, uid_field, name_field);
-        } else {
-          snprintf(base_msg, sizeof(base_msg), "%s,%s,%s,",
-                   relay_field, status, uid_field);
-        }
-
-        char log_msg[160];
-        if (rtc_has_valid_time()) {
-          RtcDateTime dt{};
-          if (rtc_get_datetime(&dt)) {
-            snprintf(log_msg, sizeof(log_msg), "%02u/%02u/%04u,%02u:%02u:%02u,%s",
-                     dt.day, dt.month, dt.year, dt.hour, dt.minute, dt.second, base_msg);
-          } else {
-            snprintf(log_msg, sizeof(log_msg), "%s", base_msg);
-          }
-        } else {
-          snprintf(log_msg, sizeof(log_msg), "%s", base_msg);
-        }
-        logs.add(log_msg, last_rfid.ts_ms);
+        AccessEvent entry{};
+        entry.set_key(event.uid);
+        entry.time = has_time ? epoch : last_rfid.ts_ms;
+        entry.reader = relay_id;
+        entry.result = static_cast<uint8_t>(result);
+        entry.flags = (has_time ? kEventClock : 0) | (by_rule ? kEventRule : 0);
+        logs.add(entry, settings.log_coalesce_ms);
+        stats.record(relay_id, allowed, epoch);
         
         if (!allowed) {
           send_uart_feedback(queues, relay_id, false);
@@ -174,9 +241,12 @@ void logic_task(void* param) {
       }
 
       switch (req.type) {
-        case LogicRequestType::GetUsers: {
-          String json = users.to_json();
-          send_response(req.reply_queue, true, json);
+        case LogicRequestType::UsersBatch: {
+          LogicResponse& resp = begin_response(true);
+          resp.total = static_cast<uint32_t>(users.apply_batch(req.payload.users_batch.ops, req.payload.users_batch.count));
+          resp.generation = users.generation();
+          lent_release(req.payload.users_batch.ops);
+          finish_response(req.reply_queue);
           break;
         }
         case LogicRequestType::AddUser: {
@@ -186,11 +256,17 @@ void logic_task(void* param) {
             send_response_cstr(req.reply_queue, false, "{\"ok\":false,\"error\":\"uid_exists\"}");
             break;
           }
+          UserTerms terms{};
+          terms.valid_from = req.payload.add_user.valid_from;
+          terms.valid_until = req.payload.add_user.valid_until;
+          terms.uses_left = req.payload.add_user.uses_left;
+          terms.limited_uses = req.payload.add_user.limited_uses != 0;
           bool ok = users.add_user(req.payload.add_user.uid,
                                    req.payload.add_user.name,
-                                   req.payload.add_user.relay1 != 0,
-                                   req.payload.add_user.relay2 != 0);
-          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false,\"error\":\"save_failed\"}");
+                                   req.payload.add_user.groups,
+                                   req.payload.add_user.schedule,
+                                   &terms);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false,\"error\":\"full\"}");
           break;
         }
         case LogicRequestType::DeleteUser: {
@@ -198,13 +274,83 @@ void logic_task(void* param) {
           send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
           break;
         }
-        case LogicRequestType::GetLogs: {
-          String json = logs.to_json();
+        case LogicRequestType::GetSchedules: {
+          String json = schedules.to_json();
           send_response(req.reply_queue, true, json);
           break;
         }
-        case LogicRequestType::ReloadUsers: {
-          bool ok = users.load();
+        case LogicRequestType::SetSchedule: {
+          bool ok = schedules.set(req.payload.schedule.id, req.payload.schedule.name, req.payload.schedule.spec);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false,\"error\":\"invalid schedule\"}");
+          break;
+        }
+        case LogicRequestType::DeleteSchedule: {
+          bool ok = schedules.remove(req.payload.schedule.id);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
+          break;
+        }
+        case LogicRequestType::GetRules: {
+          LogicResponse& resp = begin_response(true);
+          size_t offset = req.payload.rule.offset;
+          size_t next = rules.count();
+          static const char kHead[] = "{\"rules\":[";
+          static const size_t kTailMax = 48;
+          size_t used = sizeof(kHead) - 1;
+          memcpy(resp.json, kHead, used);
+          used += rules.to_json(offset, resp.json + used, sizeof(resp.json) - used - kTailMax, &next);
+          if (next < rules.count()) {
+            snprintf(resp.json + used, sizeof(resp.json) - used, "],\"total\":%u,\"next\":%u}",
+                     static_cast<unsigned>(rules.count()), static_cast<unsigned>(next));
+          } else {
+            snprintf(resp.json + used, sizeof(resp.json) - used, "],\"total\":%u,\"next\":null}",
+                     static_cast<unsigned>(rules.count()));
+          }
+          resp.total = static_cast<uint32_t>(rules.count());
+          finish_response(req.reply_queue);
+          break;
+        }
+        case LogicRequestType::AddRule: {
+          bool ok = req.payload.rule.schedule < kMaxSchedules &&
+                    rules.add(req.payload.rule.spec, req.payload.rule.name, req.payload.rule.groups, req.payload.rule.schedule);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false,\"error\":\"invalid or overlapping rule\"}");
+          break;
+        }
+        case LogicRequestType::DeleteRule: {
+          bool ok = rules.remove(req.payload.rule.spec);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
+          break;
+        }
+        case LogicRequestType::RestoreRules: {
+          bool ok = rules.replace_from(kRulesRestorePath);
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
+          break;
+        }
+        case LogicRequestType::CompactUsers: {
+          bool ok = users.save();
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
+          break;
+        }
+        case LogicRequestType::FlushUsage: {
+          bool ok = logs.flush(kLogFlushWaitMs);
+          ok = users.flush_terms() && ok;
+          ok = users.flush_usage() && ok;
+          ok = stats.flush(kStatsFlushWaitMs) && ok;
+          send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
+          break;
+        }
+        case LogicRequestType::ImportUsersBegin: {
+          users.begin_import();
+          send_response_cstr(req.reply_queue, true, "{\"ok\":true}");
+          break;
+        }
+        case LogicRequestType::ImportUsersChunk: {
+          users.import_chunk(req.payload.import_chunk.data, req.payload.import_chunk.len);
+          lent_release(req.payload.import_chunk.data);
+          send_response_cstr(req.reply_queue, true, "{\"ok\":true}");
+          break;
+        }
+        case LogicRequestType::ImportUsersEnd: {
+          bool ok = users.end_import(req.payload.import_end.commit != 0);
           send_response_cstr(req.reply_queue, ok, ok ? "{\"ok\":true}" : "{\"ok\":false}");
           break;
         }
@@ -222,7 +368,9 @@ void logic_task(void* param) {
           String json = "{\"rfid\":{\"reader\":";
           json += last_rfid.reader_id;
           json += ",\"uid\":\"";
-          json += last_rfid.uid;
+          if (uid_valid(last_rfid.uid)) {
+            json += uid_to_string(last_rfid.uid);
+          }
           json += "\",\"allowed\":";
           json += (last_rfid.allowed ? "true" : "false");
           json += ",\"ts\":";
@@ -4,6 +4,24 @@
 
 namespace app {
 
+class AccessStats;
+class LogBuffer;
+class UsersDb;
+
 void logic_task(void* param);
+// Low-priority writer that moves queued log events to flash in batches.
+void storage_task(void* param);
+
+// The user table owned by logic_task. Other tasks may only read it, inside
+// UsersDb::read_lock()/read_unlock().
+const UsersDb& logic_users();
+
+// The access log owned by logic_task. Other tasks may only read its
+// persisted part (snapshot(), export_text(), query()), the copy from
+// recent() and writer_stats().
+const LogBuffer& logic_logs();
+
+// Access counters updated by logic_task; other tasks use snapshot().
+const AccessStats& logic_stats();
 
 } // namespace app
@@ -63,6 +63,9 @@ void app::maintenance_task(void* param) {
           Serial.println("IO0 2s hold: resetting WiFi settings (AP mode).");
           app::settings_set_wifi(false, "", "");
           app::settings_set_wifi_static(false, "", "", "");
+          app::LogicRequest req{};
+          req.type = app::LogicRequestType::FlushUsage;
+          xQueueSend(app::g_queues.logic_queue, &req, 0);
           vTaskDelay(pdMS_TO_TICKS(200));
           ESP.restart();
         }
@@ -90,6 +93,7 @@ void app_setup() {
   xTaskCreatePinnedToCore(app::reader_uart_task, "reader_uart_task", 4096, &app::g_queues, 2, nullptr, 1);
   xTaskCreatePinnedToCore(app::web_task, "web_task", 8192, &app::g_queues, 2, nullptr, 0);
   xTaskCreatePinnedToCore(app::maintenance_task, "maint_task", 4096, nullptr, 1, nullptr, 0);
+  xTaskCreatePinnedToCore(app::storage_task, "storage_task", 4096, nullptr, 1, nullptr, 0);
 }
 
 void app_loop() {
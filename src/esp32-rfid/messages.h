@@ -1,18 +1,60 @@
 #pragma once
 
 #include <Arduino.h>
+#include <atomic>
+#include <new>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
+#include "rules.h"
+#include "schedule.h"
+#include "uid.h"
+
 namespace app {
 
-constexpr size_t kUidMaxLen = 20;
+struct UserBatchOp;
+
 constexpr size_t kNameMaxLen = 32;
 constexpr size_t kLogicResponseMax = 6144;
 
+// Heap buffer a request lends to logic_task. It starts with the sender's
+// reference; lent_share() adds logic_task's just before the request is
+// queued, and each side calls lent_release() when done with it. The last
+// one frees it, so a buffer whose request timed out is freed once logic_task
+// has finished with it, never while it is still being read or written.
+struct LentHeader {
+  std::atomic<uint32_t> refs;
+  uint32_t reserved; // keeps the data 8-byte aligned
+};
+
+inline void* lent_alloc(size_t bytes) {
+  void* mem = malloc(sizeof(LentHeader) + bytes);
+  if (!mem) {
+    return nullptr;
+  }
+  auto* head = new (mem) LentHeader;
+  head->refs.store(1, std::memory_order_relaxed);
+  return head + 1;
+}
+
+inline void lent_share(void* data) {
+  static_cast<LentHeader*>(data)[-1].refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void lent_release(void* data) {
+  if (!data) {
+    return;
+  }
+  LentHeader* head = static_cast<LentHeader*>(data) - 1;
+  if (head->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    head->~LentHeader();
+    free(head);
+  }
+}
+
 struct RfidEvent {
   uint8_t reader_id; // 1 or 2
-  char uid[kUidMaxLen];
+  UidKey uid;
 };
 
 struct UartCmd {
@@ -26,14 +68,24 @@ struct UartCmd {
 };
 
 enum class LogicRequestType : uint8_t {
-  GetUsers,
+  UsersBatch,
+  GetSchedules,
+  SetSchedule,
+  DeleteSchedule,
+  GetRules,
+  AddRule,
+  DeleteRule,
+  RestoreRules,
   AddUser,
   DeleteUser,
-  GetLogs,
   ClearLogsRam,
   ClearLogsAll,
   GetLastRfid,
-  ReloadUsers,
+  CompactUsers,
+  FlushUsage,
+  ImportUsersBegin,
+  ImportUsersChunk,
+  ImportUsersEnd,
   TriggerRelay,
   SetRelayState
 };
@@ -43,14 +95,45 @@ struct LogicRequest {
   QueueHandle_t reply_queue;
   union {
     struct {
-      char uid[kUidMaxLen];
+      // Owned by the sender; results are written back in place.
+      // From lent_alloc(); results are written back into it and the logic
+      // task releases it after applying.
+      UserBatchOp* ops;
+      uint16_t count;
+    } users_batch;
+    struct {
+      UidKey uid;
       char name[kNameMaxLen];
-      uint8_t relay1;
-      uint8_t relay2;
+      uint32_t groups;
+      uint8_t schedule;
+      uint8_t limited_uses;
+      uint16_t uses_left;
+      uint32_t valid_from;
+      uint32_t valid_until;
     } add_user;
     struct {
-      char uid[kUidMaxLen];
+      UidKey uid;
     } del_user;
+    struct {
+      uint8_t id;
+      char name[kScheduleNameLen];
+      char spec[kScheduleSpecLen];
+    } schedule;
+    struct {
+      char spec[kRuleSpecLen];
+      char name[kRuleNameLen];
+      uint32_t groups;
+      uint8_t schedule;
+      uint16_t offset;
+    } rule;
+    struct {
+      // From lent_alloc(); the logic task releases it once parsed.
+      char* data;
+      uint16_t len;
+    } import_chunk;
+    struct {
+      uint8_t commit;
+    } import_end;
     struct {
       uint8_t relay_id;
       uint32_t duration_ms;
@@ -64,6 +147,9 @@ struct LogicRequest {
 
 struct LogicResponse {
   uint8_t ok;
+  // UsersBatch reports the number of applied ops and the new generation.
+  uint32_t total;
+  uint32_t generation;
   char json[kLogicResponseMax];
 };
 
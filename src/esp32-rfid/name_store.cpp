@@ -0,0 +1,262 @@
+#include "name_store.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+constexpr size_t kNameMaxChars = 31;
+constexpr size_t kInitialBuckets = 64;
+
+uint32_t hash_name(const char* name, size_t len) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= static_cast<uint8_t>(name[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+} // namespace
+
+namespace app {
+
+void NameStore::clear() {
+  for (size_t i = 0; i < block_count_; ++i) {
+    free(blocks_[i]);
+    blocks_[i] = nullptr;
+  }
+  for (size_t i = 0; i < kMaxEntryChunks; ++i) {
+    free(entries_[i]);
+    entries_[i] = nullptr;
+  }
+  free(buckets_);
+  buckets_ = nullptr;
+  bucket_count_ = 0;
+  block_count_ = 0;
+  block_used_ = 0;
+  wasted_ = 0;
+  entry_count_ = 0;
+  free_head_ = kNoEntry;
+  live_ = 0;
+}
+
+NameStore::Entry* NameStore::entry(uint16_t id) const {
+  Entry* chunk = entries_[id / kEntriesPerChunk];
+  return chunk ? &chunk[id % kEntriesPerChunk] : nullptr;
+}
+
+uint16_t NameStore::new_entry() {
+  if (free_head_ != kNoEntry) {
+    uint16_t id = free_head_;
+    free_head_ = entry(id)->next;
+    return id;
+  }
+  if (entry_count_ == 0) {
+    entry_count_ = 1; // id 0 is kEmpty
+  }
+  if (entry_count_ >= kNoEntry) {
+    return kNoEntry;
+  }
+  size_t chunk = entry_count_ / kEntriesPerChunk;
+  if (!entries_[chunk]) {
+    entries_[chunk] = static_cast<Entry*>(malloc(sizeof(Entry) * kEntriesPerChunk));
+    if (!entries_[chunk]) {
+      return kNoEntry;
+    }
+  }
+  return static_cast<uint16_t>(entry_count_++);
+}
+
+const char* NameStore::store_text(const char* name, size_t len) {
+  if (block_count_ == 0 || block_used_ + len + 1 > kBlockSize) {
+    if (block_count_ >= kMaxBlocks) {
+      return nullptr;
+    }
+    char* block = static_cast<char*>(malloc(kBlockSize));
+    if (!block) {
+      return nullptr;
+    }
+    if (block_count_ > 0) {
+      wasted_ += kBlockSize - block_used_;
+    }
+    blocks_[block_count_++] = block;
+    block_used_ = 0;
+  }
+  char* text = blocks_[block_count_ - 1] + block_used_;
+  memcpy(text, name, len);
+  text[len] = '\0';
+  block_used_ += len + 1;
+  return text;
+}
+
+bool NameStore::grow_buckets() {
+  size_t count = bucket_count_ ? bucket_count_ * 2 : kInitialBuckets;
+  uint16_t* buckets = static_cast<uint16_t*>(malloc(sizeof(uint16_t) * count));
+  if (!buckets) {
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    buckets[i] = kNoEntry;
+  }
+  for (size_t id = 1; id < entry_count_; ++id) {
+    Entry* e = entry(static_cast<uint16_t>(id));
+    if (!e->text) {
+      continue;
+    }
+    size_t b = hash_name(e->text, strlen(e->text)) & (count - 1);
+    e->next = buckets[b];
+    buckets[b] = static_cast<uint16_t>(id);
+  }
+  free(buckets_);
+  buckets_ = buckets;
+  bucket_count_ = count;
+  return true;
+}
+
+uint16_t NameStore::acquire(const char* name) {
+  if (!name || name[0] == '\0') {
+    return kEmpty;
+  }
+  size_t len = strnlen(name, kNameMaxChars);
+  if (!buckets_ && !grow_buckets()) {
+    return kEmpty;
+  }
+  uint32_t h = hash_name(name, len);
+  for (uint16_t id = buckets_[h & (bucket_count_ - 1)]; id != kNoEntry; id = entry(id)->next) {
+    Entry* e = entry(id);
+    if (strncmp(e->text, name, len) == 0 && e->text[len] == '\0') {
+      if (e->refs == 0xFFFF) {
+        break;
+      }
+      e->refs++;
+      return id;
+    }
+  }
+  uint16_t id = new_entry();
+  if (id == kNoEntry) {
+    return kEmpty;
+  }
+  Entry* e = entry(id);
+  e->text = store_text(name, len);
+  if (!e->text) {
+    e->next = free_head_;
+    free_head_ = id;
+    return kEmpty;
+  }
+  e->refs = 1;
+  size_t b = h & (bucket_count_ - 1);
+  e->next = buckets_[b];
+  buckets_[b] = id;
+  live_++;
+  if (live_ > bucket_count_) {
+    grow_buckets();
+  }
+  return id;
+}
+
+void NameStore::release(uint16_t id) {
+  if (id == kEmpty || id >= entry_count_) {
+    return;
+  }
+  Entry* e = entry(id);
+  if (!e->text || e->refs == 0) {
+    return;
+  }
+  if (--e->refs > 0) {
+    return;
+  }
+  size_t len = strlen(e->text);
+  uint16_t* link = &buckets_[hash_name(e->text, len) & (bucket_count_ - 1)];
+  while (*link != kNoEntry && *link != id) {
+    link = &entry(*link)->next;
+  }
+  if (*link == id) {
+    *link = e->next;
+  }
+  e->text = nullptr;
+  e->next = free_head_;
+  free_head_ = id;
+  live_--;
+  wasted_ += len + 1;
+  if (wasted_ > kBlockSize * 2 && wasted_ * 2 > block_count_ * kBlockSize) {
+    compact();
+  }
+}
+
+const char* NameStore::get(uint16_t id) const {
+  if (id == kEmpty || id >= entry_count_) {
+    return "";
+  }
+  const Entry* e = entry(id);
+  return (e && e->text) ? e->text : "";
+}
+
+size_t NameStore::bytes_used() const {
+  size_t chunks = (entry_count_ + kEntriesPerChunk - 1) / kEntriesPerChunk;
+  return block_count_ * kBlockSize + chunks * kEntriesPerChunk * sizeof(Entry) +
+         bucket_count_ * sizeof(uint16_t);
+}
+
+void NameStore::compact() {
+  // Reserve every new block up front so a failed allocation leaves the
+  // arena untouched.
+  size_t needed = 0;
+  size_t used = 0;
+  for (size_t id = 1; id < entry_count_; ++id) {
+    const Entry* e = entry(static_cast<uint16_t>(id));
+    if (!e->text) {
+      continue;
+    }
+    size_t len = strlen(e->text) + 1;
+    if (needed == 0 || used + len > kBlockSize) {
+      needed++;
+      used = 0;
+    }
+    used += len;
+  }
+  char** fresh = static_cast<char**>(malloc(sizeof(char*) * (needed ? needed : 1)));
+  if (!fresh) {
+    return;
+  }
+  for (size_t i = 0; i < needed; ++i) {
+    fresh[i] = static_cast<char*>(malloc(kBlockSize));
+    if (!fresh[i]) {
+      for (size_t j = 0; j < i; ++j) {
+        free(fresh[j]);
+      }
+      free(fresh);
+      return;
+    }
+  }
+  size_t block = 0;
+  used = 0;
+  bool started = false;
+  for (size_t id = 1; id < entry_count_; ++id) {
+    Entry* e = entry(static_cast<uint16_t>(id));
+    if (!e->text) {
+      continue;
+    }
+    size_t len = strlen(e->text) + 1;
+    if (started && used + len > kBlockSize) {
+      block++;
+      used = 0;
+    }
+    started = true;
+    memcpy(fresh[block] + used, e->text, len);
+    e->text = fresh[block] + used;
+    used += len;
+  }
+  for (size_t i = 0; i < block_count_; ++i) {
+    free(blocks_[i]);
+    blocks_[i] = nullptr;
+  }
+  for (size_t i = 0; i < needed; ++i) {
+    blocks_[i] = fresh[i];
+  }
+  free(fresh);
+  block_count_ = needed;
+  block_used_ = used;
+  wasted_ = 0;
+}
+
+} // namespace app
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace app {
+
+// Deduplicated, reference-counted string arena for user names. Names are
+// packed into fixed-size blocks and addressed by a 16-bit id so the hot
+// user table only carries two bytes per name.
+class NameStore {
+ public:
+  static constexpr uint16_t kEmpty = 0;
+
+  void clear();
+  uint16_t acquire(const char* name);
+  void release(uint16_t id);
+  const char* get(uint16_t id) const;
+  size_t bytes_used() const;
+
+ private:
+  struct Entry {
+    const char* text;
+    uint16_t refs;
+    uint16_t next; // hash chain when in use, free list otherwise
+  };
+
+  static constexpr size_t kBlockSize = 2048;
+  static constexpr size_t kMaxBlocks = 512;
+  static constexpr size_t kEntriesPerChunk = 256;
+  static constexpr size_t kMaxEntryChunks = 256;
+  static constexpr uint16_t kNoEntry = 0xFFFF;
+
+  Entry* entry(uint16_t id) const;
+  uint16_t new_entry();
+  const char* store_text(const char* name, size_t len);
+  bool grow_buckets();
+  void compact();
+
+  char* blocks_[kMaxBlocks] = {nullptr};
+  size_t block_count_ = 0;
+  size_t block_used_ = 0;
+  size_t wasted_ = 0;
+  Entry* entries_[kMaxEntryChunks] = {nullptr};
+  size_t entry_count_ = 0;
+  uint16_t free_head_ = kNoEntry;
+  uint16_t* buckets_ = nullptr;
+  size_t bucket_count_ = 0;
+  size_t live_ = 0;
+};
+
+} // namespace app
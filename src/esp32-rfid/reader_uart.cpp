@@ -57,25 +57,16 @@ bool parse_line(const char* line, RfidEvent* out) {
   if (*p == '\0') {
     return false;
   }
-  char uid[kUidMaxLen] = {0};
-  size_t idx = 0;
-  while (*p && idx + 1 < sizeof(uid)) {
-    char c = *p++;
-    if (c == '\r' || c == '\n') {
-      break;
-    }
-    if (c >= 'a' && c <= 'f') {
-      c = static_cast<char>(c - 'a' + 'A');
-    }
-    uid[idx++] = c;
+  const char* end = p;
+  while (*end && *end != '\r' && *end != '\n') {
+    ++end;
   }
-  uid[idx] = '\0';
-  if (idx == 0) {
+  UidKey uid{};
+  if (!uid_parse(p, static_cast<size_t>(end - p), &uid)) {
     return false;
   }
   out->reader_id = static_cast<uint8_t>(reader);
-  strncpy(out->uid, uid, sizeof(out->uid) - 1);
-  out->uid[sizeof(out->uid) - 1] = '\0';
+  out->uid = uid;
   return true;
 }
 
@@ -106,4 +106,37 @@ bool rtc_get_datetime(RtcDateTime* out) {
   return true;
 }
 
+uint32_t rtc_to_epoch(const RtcDateTime& dt) {
+  // Days from civil (Howard Hinnant), with March as the first month.
+  int32_t y = dt.year - (dt.month <= 2 ? 1 : 0);
+  int32_t era = y / 400;
+  int32_t yoe = y - era * 400;
+  int32_t mp = (dt.month + 9) % 12;
+  int32_t doy = (153 * mp + 2) / 5 + dt.day - 1;
+  int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int32_t days = era * 146097 + doe - 719468;
+  return static_cast<uint32_t>(days) * 86400u + dt.hour * 3600u + dt.minute * 60u + dt.second;
+}
+
+void rtc_from_epoch(uint32_t epoch, RtcDateTime* out) {
+  if (!out) {
+    return;
+  }
+  uint32_t days = epoch / 86400u;
+  uint32_t rem = epoch % 86400u;
+  out->hour = static_cast<uint8_t>(rem / 3600);
+  out->minute = static_cast<uint8_t>(rem / 60 % 60);
+  out->second = static_cast<uint8_t>(rem % 60);
+  int32_t z = static_cast<int32_t>(days) + 719468;
+  int32_t era = z / 146097;
+  int32_t doe = z - era * 146097;
+  int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int32_t mp = (5 * doy + 2) / 153;
+  int32_t month = mp < 10 ? mp + 3 : mp - 9;
+  out->day = static_cast<uint8_t>(doy - (153 * mp + 2) / 5 + 1);
+  out->month = static_cast<uint8_t>(month);
+  out->year = static_cast<uint16_t>(yoe + era * 400 + (month <= 2 ? 1 : 0));
+}
+
 } // namespace app
@@ -20,4 +20,8 @@ void rtc_set_time_valid(bool valid);
 bool rtc_set_datetime(const RtcDateTime& dt);
 bool rtc_get_datetime(RtcDateTime* out);
 
+// Unix seconds for a calendar time (treated as UTC) and back.
+uint32_t rtc_to_epoch(const RtcDateTime& dt);
+void rtc_from_epoch(uint32_t epoch, RtcDateTime* out);
+
 } // namespace app
@@ -0,0 +1,324 @@
+#include "rules.h"
+
+#include <LittleFS.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "schedule.h"
+
+namespace app {
+
+namespace {
+constexpr const char* kRulesPath = "/rules.txt";
+constexpr const char* kRulesSavePath = "/rules.new";
+constexpr size_t kRulesGrowBy = 64;
+constexpr uint8_t kFacilityUidLen = 6;
+
+void copy_clean(const char* src, char* dest, size_t dest_len) {
+  size_t out = 0;
+  for (size_t i = 0; src && src[i] != '\0' && out + 1 < dest_len; ++i) {
+    char c = src[i];
+    if (c == '|' || c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+      continue;
+    }
+    dest[out++] = c;
+  }
+  dest[out] = '\0';
+}
+
+bool key_less(uint8_t len_a, uint64_t a, uint8_t len_b, uint64_t b) {
+  return len_a != len_b ? len_a < len_b : a < b;
+}
+
+} // namespace
+
+bool rule_parse_spec(const char* spec, uint8_t* uid_len, uint64_t* lo, uint64_t* hi) {
+  if (!spec || !uid_len || !lo || !hi) {
+    return false;
+  }
+  while (*spec == ' ' || *spec == '\t') {
+    ++spec;
+  }
+  size_t len = strlen(spec);
+  while (len > 0 && (spec[len - 1] == ' ' || spec[len - 1] == '\t' || spec[len - 1] == '\r')) {
+    --len;
+  }
+  if (len > 3 && strncasecmp(spec, "fc:", 3) == 0) {
+    char* end = nullptr;
+    unsigned long code = strtoul(spec + 3, &end, 10);
+    if (end != spec + len || end == spec + 3 || code > 0xFF) {
+      return false;
+    }
+    *uid_len = kFacilityUidLen;
+    *lo = static_cast<uint64_t>(code) << 16;
+    *hi = *lo | 0xFFFF;
+    return true;
+  }
+
+  UidKey first{};
+  UidKey last{};
+  const char* dash = static_cast<const char*>(memchr(spec, '-', len));
+  if (dash) {
+    if (!uid_parse(spec, static_cast<size_t>(dash - spec), &first) ||
+        !uid_parse(dash + 1, len - static_cast<size_t>(dash - spec) - 1, &last) || first.len != last.len) {
+      return false;
+    }
+  } else {
+    // Trailing '?' digits match anything: "12AB????" is 12AB0000-12ABFFFF.
+    if (len == 0 || len > kUidMaxDigits) {
+      return false;
+    }
+    char low[kUidTextLen];
+    char high[kUidTextLen];
+    size_t fixed = len;
+    while (fixed > 0 && spec[fixed - 1] == '?') {
+      --fixed;
+    }
+    memcpy(low, spec, fixed);
+    memcpy(high, spec, fixed);
+    memset(low + fixed, '0', len - fixed);
+    memset(high + fixed, 'F', len - fixed);
+    if (!uid_parse(low, len, &first) || !uid_parse(high, len, &last)) {
+      return false;
+    }
+  }
+  if (last.value < first.value) {
+    return false;
+  }
+  *uid_len = first.len;
+  *lo = first.value;
+  *hi = last.value;
+  return true;
+}
+
+void rule_format_spec(const CredentialRule& rule, char* out, size_t out_len) {
+  char lo[kUidTextLen];
+  char hi[kUidTextLen];
+  uid_format(UidKey{rule.lo, rule.uid_len}, lo, sizeof(lo));
+  uid_format(UidKey{rule.hi, rule.uid_len}, hi, sizeof(hi));
+  snprintf(out, out_len, "%s-%s", lo, hi);
+}
+
+void RuleTable::init() {
+  free(rules_);
+  rules_ = nullptr;
+  count_ = 0;
+  capacity_ = 0;
+}
+
+bool RuleTable::load() {
+  init();
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  if (!LittleFS.exists(kRulesPath)) {
+    return true;
+  }
+  return load_file(kRulesPath);
+}
+
+bool RuleTable::replace_from(const char* path) {
+  if (!LittleFS.begin() || !LittleFS.exists(path)) {
+    return false;
+  }
+  init();
+  bool ok = load_file(path) && save();
+  LittleFS.remove(path);
+  if (!ok) {
+    load();
+  }
+  return ok;
+}
+
+bool RuleTable::load_file(const char* path) {
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  // Every valid line is kept; a malformed line, an unknown schedule or an
+  // overlap with an earlier line makes the load report failure.
+  bool ok = true;
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    if (line.length() == 0) {
+      continue;
+    }
+    int p1 = line.indexOf('|');
+    int p2 = p1 >= 0 ? line.indexOf('|', p1 + 1) : -1;
+    int p3 = p2 >= 0 ? line.indexOf('|', p2 + 1) : -1;
+    if (p1 <= 0 || p3 < 0) {
+      ok = false;
+      continue;
+    }
+    CredentialRule rule{};
+    String spec = line.substring(0, p1);
+    long schedule = line.substring(p3 + 1).toInt();
+    if (!rule_parse_spec(spec.c_str(), &rule.uid_len, &rule.lo, &rule.hi) || schedule < 0 ||
+        schedule >= static_cast<long>(kMaxSchedules)) {
+      ok = false;
+      continue;
+    }
+    copy_clean(line.substring(p1 + 1, p2).c_str(), rule.name, sizeof(rule.name));
+    rule.groups = static_cast<uint32_t>(strtoul(line.substring(p2 + 1, p3).c_str(), nullptr, 0));
+    rule.schedule = static_cast<uint8_t>(schedule);
+    if (!insert(rule)) {
+      ok = false;
+    }
+  }
+  file.close();
+  return ok;
+}
+
+// Written to a temporary file and renamed over /rules.txt, so a power loss
+// or a full filesystem leaves the previous rules in place.
+bool RuleTable::save() const {
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  File file = LittleFS.open(kRulesSavePath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  char line[kRuleSpecLen + kRuleNameLen + 24];
+  bool ok = true;
+  for (size_t i = 0; i < count_ && ok; ++i) {
+    const CredentialRule& rule = rules_[i];
+    char spec[kRuleSpecLen];
+    rule_format_spec(rule, spec, sizeof(spec));
+    int len = snprintf(line, sizeof(line), "%s|%s|%lu|%u\n", spec, rule.name, static_cast<unsigned long>(rule.groups),
+                       static_cast<unsigned>(rule.schedule));
+    ok = len > 0 && static_cast<size_t>(len) < sizeof(line) &&
+         file.write(reinterpret_cast<const uint8_t*>(line), static_cast<size_t>(len)) == static_cast<size_t>(len);
+  }
+  file.close();
+  if (!ok || !LittleFS.rename(kRulesSavePath, kRulesPath)) {
+    LittleFS.remove(kRulesSavePath);
+    return false;
+  }
+  return true;
+}
+
+size_t RuleTable::upper_bound(uint8_t uid_len, uint64_t value) const {
+  size_t low = 0;
+  size_t high = count_;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (key_less(uid_len, value, rules_[mid].uid_len, rules_[mid].lo)) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+bool RuleTable::insert(const CredentialRule& rule) {
+  size_t pos = upper_bound(rule.uid_len, rule.lo);
+  if (pos > 0 && rules_[pos - 1].uid_len == rule.uid_len && rules_[pos - 1].hi >= rule.lo) {
+    return false;
+  }
+  if (pos < count_ && rules_[pos].uid_len == rule.uid_len && rules_[pos].lo <= rule.hi) {
+    return false;
+  }
+  if (count_ == capacity_) {
+    if (capacity_ >= kMaxRules) {
+      return false;
+    }
+    size_t capacity = capacity_ + kRulesGrowBy;
+    auto* grown = static_cast<CredentialRule*>(realloc(rules_, capacity * sizeof(CredentialRule)));
+    if (!grown) {
+      return false;
+    }
+    rules_ = grown;
+    capacity_ = capacity;
+  }
+  memmove(&rules_[pos + 1], &rules_[pos], (count_ - pos) * sizeof(CredentialRule));
+  rules_[pos] = rule;
+  ++count_;
+  return true;
+}
+
+bool RuleTable::add(const char* spec, const char* name, uint32_t groups, uint8_t schedule) {
+  CredentialRule rule{};
+  if (!rule_parse_spec(spec, &rule.uid_len, &rule.lo, &rule.hi)) {
+    return false;
+  }
+  copy_clean(name, rule.name, sizeof(rule.name));
+  rule.groups = groups;
+  rule.schedule = schedule;
+  if (!insert(rule)) {
+    return false;
+  }
+  if (!save()) {
+    // Keep RAM in step with the file.
+    size_t pos = upper_bound(rule.uid_len, rule.lo) - 1;
+    memmove(&rules_[pos], &rules_[pos + 1], (count_ - pos - 1) * sizeof(CredentialRule));
+    --count_;
+    return false;
+  }
+  return true;
+}
+
+bool RuleTable::remove(const char* spec) {
+  uint8_t uid_len = 0;
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  if (!rule_parse_spec(spec, &uid_len, &lo, &hi)) {
+    return false;
+  }
+  size_t pos = upper_bound(uid_len, lo);
+  if (pos == 0) {
+    return false;
+  }
+  --pos;
+  if (rules_[pos].uid_len != uid_len || rules_[pos].lo != lo || rules_[pos].hi != hi) {
+    return false;
+  }
+  CredentialRule removed = rules_[pos];
+  memmove(&rules_[pos], &rules_[pos + 1], (count_ - pos - 1) * sizeof(CredentialRule));
+  --count_;
+  if (!save()) {
+    insert(removed);
+    return false;
+  }
+  return true;
+}
+
+const CredentialRule* RuleTable::match(const UidKey& uid) const {
+  size_t pos = upper_bound(uid.len, uid.value);
+  if (pos == 0) {
+    return nullptr;
+  }
+  const CredentialRule& rule = rules_[pos - 1];
+  if (rule.uid_len != uid.len || uid.value > rule.hi) {
+    return nullptr;
+  }
+  return &rule;
+}
+
+size_t RuleTable::to_json(size_t offset, char* out, size_t out_len, size_t* next) const {
+  size_t used = 0;
+  size_t i = offset;
+  for (; i < count_; ++i) {
+    const CredentialRule& rule = rules_[i];
+    char spec[kRuleSpecLen];
+    rule_format_spec(rule, spec, sizeof(spec));
+    int len = snprintf(out + used, out_len - used, "%s{\"spec\":\"%s\",\"name\":\"%s\",\"groups\":%lu,\"schedule\":%u}",
+                       used ? "," : "", spec, rule.name, static_cast<unsigned long>(rule.groups),
+                       static_cast<unsigned>(rule.schedule));
+    if (len < 0 || used + static_cast<size_t>(len) >= out_len) {
+      break;
+    }
+    used += static_cast<size_t>(len);
+  }
+  if (out_len > 0) {
+    out[used] = '\0';
+  }
+  if (next) {
+    *next = i;
+  }
+  return used;
+}
+
+} // namespace app
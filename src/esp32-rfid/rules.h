@@ -0,0 +1,67 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "uid.h"
+
+namespace app {
+
+constexpr size_t kMaxRules = 1024;
+constexpr size_t kRuleNameLen = 16;
+constexpr size_t kRuleSpecLen = 2 * kUidMaxDigits + 2;
+// Where /restore collects a [rules] section before the table is replaced.
+constexpr const char* kRulesRestorePath = "/rules.tmp";
+
+// Grants a contiguous block of credentials of one length, e.g. a whole
+// facility code, without a user record per card.
+struct CredentialRule {
+  uint64_t lo;
+  uint64_t hi;
+  uint32_t groups;
+  uint8_t uid_len;
+  uint8_t schedule;
+  char name[kRuleNameLen];
+};
+
+// Accepts "LO-HI" (hex, same number of digits), a wildcard such as "12AB????"
+// and "fc:N" for the facility code of a 26-bit card (6-digit UID, FC in the
+// top byte).
+bool rule_parse_spec(const char* spec, uint8_t* uid_len, uint64_t* lo, uint64_t* hi);
+void rule_format_spec(const CredentialRule& rule, char* out, size_t out_len);
+
+// Disjoint ranges sorted by (uid_len, lo), so a swipe that misses the user
+// table finds its rule with one binary search. Stored in /rules.txt as
+// "LO-HI|name|groups|schedule" lines.
+class RuleTable {
+ public:
+  void init();
+  bool load();
+  bool save() const;
+  // Replaces the table with the rules in path (the /rules.txt format, e.g.
+  // from a restore), saves it and removes path. Keeps the saved rules when
+  // that fails, including when a line is malformed, names a schedule past
+  // kMaxSchedules or overlaps another.
+  bool replace_from(const char* path);
+  // Fails on a bad spec, an overlap with an existing rule, a full table or
+  // a failed save; add() and remove() change nothing then.
+  bool add(const char* spec, const char* name, uint32_t groups, uint8_t schedule);
+  bool remove(const char* spec);
+  const CredentialRule* match(const UidKey& uid) const;
+  size_t count() const {
+    return count_;
+  }
+  // Renders rules from offset as JSON objects until out is full; next is
+  // the offset to continue from, or count() when done.
+  size_t to_json(size_t offset, char* out, size_t out_len, size_t* next) const;
+
+ private:
+  bool load_file(const char* path);
+  size_t upper_bound(uint8_t uid_len, uint64_t value) const;
+  bool insert(const CredentialRule& rule);
+
+  CredentialRule* rules_ = nullptr;
+  size_t count_ = 0;
+  size_t capacity_ = 0;
+};
+
+} // namespace app
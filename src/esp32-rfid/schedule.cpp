@@ -0,0 +1,254 @@
+#include "schedule.h"
+
+#include <LittleFS.h>
+#include <cstring>
+
+namespace app {
+
+namespace {
+constexpr const char* kSchedulesPath = "/schedules.txt";
+constexpr int kSlotsPerDay = 24 * 4;
+
+const char* const kDayNames[7] = {"mon", "tue", "wed", "thu", "fri", "sat", "sun"};
+
+const char* skip_spaces(const char* p) {
+  while (*p == ' ' || *p == '\t') {
+    ++p;
+  }
+  return p;
+}
+
+int parse_day(const char* p, const char** end) {
+  for (int d = 0; d < 7; ++d) {
+    if (strncasecmp(p, kDayNames[d], 3) == 0) {
+      *end = p + 3;
+      return d;
+    }
+  }
+  return -1;
+}
+
+// Parses H:MM or HH:MM into minutes since midnight; 24:00 is accepted.
+int parse_time(const char* p, const char** end) {
+  int hour = 0;
+  int digits = 0;
+  while (*p >= '0' && *p <= '9' && digits < 2) {
+    hour = hour * 10 + (*p - '0');
+    ++p;
+    ++digits;
+  }
+  if (digits == 0 || *p != ':') {
+    return -1;
+  }
+  ++p;
+  if (p[0] < '0' || p[0] > '5' || p[1] < '0' || p[1] > '9') {
+    return -1;
+  }
+  int minute = (p[0] - '0') * 10 + (p[1] - '0');
+  *end = p + 2;
+  int total = hour * 60 + minute;
+  return total <= 24 * 60 ? total : -1;
+}
+
+void set_range(uint32_t* bits, int from, int to) {
+  for (int slot = from; slot < to; ++slot) {
+    int wrapped = slot % static_cast<int>(kScheduleSlots);
+    bits[wrapped >> 5] |= 1u << (wrapped & 31);
+  }
+}
+
+void copy_clean(const char* src, char* dest, size_t dest_len) {
+  size_t out = 0;
+  for (size_t i = 0; src && src[i] != '\0' && out + 1 < dest_len; ++i) {
+    char c = src[i];
+    if (c == '|' || c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+      continue;
+    }
+    dest[out++] = c;
+  }
+  dest[out] = '\0';
+}
+
+} // namespace
+
+int16_t schedule_slot(const RtcDateTime& dt) {
+  if (dt.month < 1 || dt.month > 12 || dt.day < 1 || dt.day > 31 || dt.hour > 23 || dt.minute > 59) {
+    return kNoScheduleSlot;
+  }
+  // Sakamoto's day-of-week (0 = Sunday), shifted so Monday is day 0.
+  static const uint8_t kMonthOffset[12] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+  int y = dt.year - (dt.month < 3 ? 1 : 0);
+  int dow = (y + y / 4 - y / 100 + y / 400 + kMonthOffset[dt.month - 1] + dt.day) % 7;
+  int day = (dow + 6) % 7;
+  return static_cast<int16_t>(day * kSlotsPerDay + dt.hour * 4 + dt.minute / 15);
+}
+
+bool schedule_compile(const char* spec, uint32_t* bits) {
+  if (!spec || !bits) {
+    return false;
+  }
+  memset(bits, 0, sizeof(uint32_t) * kScheduleWords);
+  const char* p = skip_spaces(spec);
+  bool any = false;
+  while (*p != '\0') {
+    int first = -1;
+    int last = -1;
+    if (strncasecmp(p, "daily", 5) == 0) {
+      first = 0;
+      last = 6;
+      p += 5;
+    } else {
+      first = parse_day(p, &p);
+      if (first < 0) {
+        return false;
+      }
+      last = first;
+      if (*p == '-') {
+        last = parse_day(p + 1, &p);
+        if (last < 0) {
+          return false;
+        }
+      }
+    }
+    p = skip_spaces(p);
+    int start = 0;
+    int end = 24 * 60;
+    if (*p >= '0' && *p <= '9') {
+      start = parse_time(p, &p);
+      if (start < 0 || start >= 24 * 60 || *p != '-') {
+        return false;
+      }
+      end = parse_time(p + 1, &p);
+      if (end < 0 || end == start) {
+        return false;
+      }
+    }
+    int from = start / 15;
+    int to = (end + 14) / 15;
+    if (end < start) {
+      to += kSlotsPerDay;
+    }
+    for (int d = first;; d = (d + 1) % 7) {
+      set_range(bits, d * kSlotsPerDay + from, d * kSlotsPerDay + to);
+      if (d == last) {
+        break;
+      }
+    }
+    any = true;
+    p = skip_spaces(p);
+    if (*p == ';') {
+      p = skip_spaces(p + 1);
+    } else if (*p != '\0') {
+      return false;
+    }
+  }
+  return any;
+}
+
+void ScheduleTable::init() {
+  memset(profiles_, 0, sizeof(profiles_));
+}
+
+bool ScheduleTable::load() {
+  init();
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  if (!LittleFS.exists(kSchedulesPath)) {
+    return true;
+  }
+  File file = LittleFS.open(kSchedulesPath, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    int p1 = line.indexOf('|');
+    int p2 = p1 >= 0 ? line.indexOf('|', p1 + 1) : -1;
+    if (p1 <= 0 || p2 < 0) {
+      continue;
+    }
+    long id = line.substring(0, p1).toInt();
+    String name = line.substring(p1 + 1, p2);
+    String spec = line.substring(p2 + 1);
+    set_internal(static_cast<uint8_t>(id), name.c_str(), spec.c_str());
+  }
+  file.close();
+  return true;
+}
+
+bool ScheduleTable::save() const {
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  File file = LittleFS.open(kSchedulesPath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  for (size_t id = 1; id < kMaxSchedules; ++id) {
+    const Profile& profile = profiles_[id];
+    if (!profile.in_use) {
+      continue;
+    }
+    file.print(static_cast<unsigned>(id));
+    file.print('|');
+    file.print(profile.name);
+    file.print('|');
+    file.println(profile.spec);
+  }
+  file.close();
+  return true;
+}
+
+bool ScheduleTable::set_internal(uint8_t id, const char* name, const char* spec) {
+  if (id == kScheduleAlways || id >= kMaxSchedules || !spec || strlen(spec) >= kScheduleSpecLen) {
+    return false;
+  }
+  uint32_t bits[kScheduleWords];
+  if (!schedule_compile(spec, bits)) {
+    return false;
+  }
+  Profile& profile = profiles_[id];
+  memcpy(profile.bits, bits, sizeof(bits));
+  copy_clean(name, profile.name, sizeof(profile.name));
+  copy_clean(spec, profile.spec, sizeof(profile.spec));
+  profile.in_use = true;
+  return true;
+}
+
+bool ScheduleTable::set(uint8_t id, const char* name, const char* spec) {
+  if (!set_internal(id, name, spec)) {
+    return false;
+  }
+  return save();
+}
+
+bool ScheduleTable::remove(uint8_t id) {
+  if (id == kScheduleAlways || id >= kMaxSchedules || !profiles_[id].in_use) {
+    return false;
+  }
+  memset(&profiles_[id], 0, sizeof(Profile));
+  return save();
+}
+
+String ScheduleTable::to_json() const {
+  String json = "{\"schedules\":[{\"id\":0,\"name\":\"always\",\"spec\":\"\"}";
+  for (size_t id = 1; id < kMaxSchedules; ++id) {
+    const Profile& profile = profiles_[id];
+    if (!profile.in_use) {
+      continue;
+    }
+    json += ",{\"id\":";
+    json += static_cast<unsigned>(id);
+    json += ",\"name\":\"";
+    json += profile.name;
+    json += "\",\"spec\":\"";
+    json += profile.spec;
+    json += "\"}";
+  }
+  json += "]}";
+  return json;
+}
+
+} // namespace app
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "rtc.h"
+
+namespace app {
+
+// A week split into 15-minute slots, Monday 00:00 = slot 0.
+constexpr size_t kScheduleSlots = 7 * 24 * 4;
+constexpr size_t kScheduleWords = kScheduleSlots / 32;
+constexpr size_t kMaxSchedules = 16;
+constexpr size_t kScheduleNameLen = 16;
+constexpr size_t kScheduleSpecLen = 96;
+// Profile 0 is built in and always allows; it is also the only profile that
+// works without a valid RTC.
+constexpr uint8_t kScheduleAlways = 0;
+constexpr int16_t kNoScheduleSlot = -1;
+
+// Slot for a calendar date/time, or kNoScheduleSlot if dt is out of range.
+int16_t schedule_slot(const RtcDateTime& dt);
+
+// Compiles a spec such as "mon-fri 07:30-18:00; sat 08:00-12:00" into a week
+// bitmap. Days are mon..sun, a range "mon-fri" or "daily"; a window ending
+// before it starts runs past midnight. Start times round down and end times
+// round up to the slot grid.
+bool schedule_compile(const char* spec, uint32_t* bits);
+
+// Named week profiles, compiled once when defined so a swipe only tests
+// one bit. Stored in /schedules.txt as "id|name|spec" lines.
+class ScheduleTable {
+ public:
+  void init();
+  bool load();
+  bool save() const;
+  bool set(uint8_t id, const char* name, const char* spec);
+  bool remove(uint8_t id);
+  String to_json() const;
+
+  bool allows(uint8_t id, int16_t slot) const {
+    if (id == kScheduleAlways) {
+      return true;
+    }
+    if (id >= kMaxSchedules || slot < 0 || slot >= static_cast<int16_t>(kScheduleSlots) || !profiles_[id].in_use) {
+      return false;
+    }
+    return (profiles_[id].bits[slot >> 5] >> (slot & 31)) & 1u;
+  }
+
+ private:
+  struct Profile {
+    bool in_use;
+    char name[kScheduleNameLen];
+    char spec[kScheduleSpecLen];
+    uint32_t bits[kScheduleWords];
+  };
+
+  bool set_internal(uint8_t id, const char* name, const char* spec);
+
+  Profile profiles_[kMaxSchedules] = {};
+};
+
+} // namespace app
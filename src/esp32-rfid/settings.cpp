@@ -3,11 +3,30 @@
 #include <LittleFS.h>
 #include <cstring>
 
+#include "log.h"
+
 namespace app {
 
 namespace {
 constexpr const char* kSettingsPath = "/settings.txt";
-Settings g_settings{false, false, false, "", "", false, "", "", "", "Relay 1", "Relay 2", false, false, false, "", "", ""};
+Settings g_settings{false, false, false, "", "", false, "", "", "", "Relay 1", "Relay 2", false, false, 0, 0, 1, 2, 1000, 16, 30000, false, "", "", ""};
+
+// Keeps the write-behind bound within what the log queue can hold, and the
+// coalescing window within its limit, however the values arrived (file,
+// restore or API).
+void clamp_log_limits(Settings* settings) {
+  if (settings->log_flush_ms > kMaxLogFlushMs) {
+    settings->log_flush_ms = kMaxLogFlushMs;
+  }
+  if (settings->log_flush_events < 1) {
+    settings->log_flush_events = 1;
+  } else if (settings->log_flush_events > kMaxLogFlushEvents) {
+    settings->log_flush_events = kMaxLogFlushEvents;
+  }
+  if (settings->log_coalesce_ms > kMaxLogCoalesceMs) {
+    settings->log_coalesce_ms = kMaxLogCoalesceMs;
+  }
+}
 } // namespace
 
 void settings_init() {
@@ -26,6 +45,13 @@ void settings_init() {
   g_settings.relay2_name[sizeof(g_settings.relay2_name) - 1] = '\0';
   g_settings.relay1_state = false;
   g_settings.relay2_state = false;
+  g_settings.relay1_schedule = 0;
+  g_settings.relay2_schedule = 0;
+  g_settings.relay1_groups = 1;
+  g_settings.relay2_groups = 2;
+  g_settings.log_flush_ms = 1000;
+  g_settings.log_flush_events = 16;
+  g_settings.log_coalesce_ms = 30000;
   g_settings.auth_enabled = false;
   g_settings.auth_user[0] = '\0';
   g_settings.auth_pass[0] = '\0';
@@ -112,6 +138,41 @@ bool settings_load() {
       value.trim();
       g_settings.relay2_state = (value == "1" || value == "true" || value == "yes");
     }
+    if (line.startsWith("relay1_schedule=")) {
+      String value = line.substring(16);
+      value.trim();
+      g_settings.relay1_schedule = static_cast<uint8_t>(value.toInt());
+    }
+    if (line.startsWith("relay2_schedule=")) {
+      String value = line.substring(16);
+      value.trim();
+      g_settings.relay2_schedule = static_cast<uint8_t>(value.toInt());
+    }
+    if (line.startsWith("relay1_groups=")) {
+      String value = line.substring(14);
+      value.trim();
+      g_settings.relay1_groups = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 0));
+    }
+    if (line.startsWith("relay2_groups=")) {
+      String value = line.substring(14);
+      value.trim();
+      g_settings.relay2_groups = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 0));
+    }
+    if (line.startsWith("log_flush_ms=")) {
+      String value = line.substring(13);
+      value.trim();
+      g_settings.log_flush_ms = static_cast<uint32_t>(value.toInt());
+    }
+    if (line.startsWith("log_flush_events=")) {
+      String value = line.substring(17);
+      value.trim();
+      g_settings.log_flush_events = static_cast<uint16_t>(value.toInt());
+    }
+    if (line.startsWith("log_coalesce_ms=")) {
+      String value = line.substring(16);
+      value.trim();
+      g_settings.log_coalesce_ms = static_cast<uint32_t>(value.toInt());
+    }
     if (line.startsWith("auth_enabled=")) {
       String value = line.substring(13);
       value.trim();
@@ -134,6 +195,7 @@ bool settings_load() {
     }
   }
   file.close();
+  clamp_log_limits(&g_settings);
   return true;
 }
 
@@ -171,6 +233,20 @@ bool settings_save() {
   file.println(g_settings.relay1_state ? "1" : "0");
   file.print("relay2_state=");
   file.println(g_settings.relay2_state ? "1" : "0");
+  file.print("relay1_schedule=");
+  file.println(g_settings.relay1_schedule);
+  file.print("relay2_schedule=");
+  file.println(g_settings.relay2_schedule);
+  file.print("relay1_groups=");
+  file.println(g_settings.relay1_groups);
+  file.print("relay2_groups=");
+  file.println(g_settings.relay2_groups);
+  file.print("log_flush_ms=");
+  file.println(g_settings.log_flush_ms);
+  file.print("log_flush_events=");
+  file.println(g_settings.log_flush_events);
+  file.print("log_coalesce_ms=");
+  file.println(g_settings.log_coalesce_ms);
   file.print("auth_enabled=");
   file.println(g_settings.auth_enabled ? "1" : "0");
   file.print("auth_user=");
@@ -250,6 +326,31 @@ bool settings_set_relay_state(uint8_t relay_id, bool enabled) {
   return settings_save();
 }
 
+bool settings_set_relay_schedules(uint8_t relay1, uint8_t relay2) {
+  g_settings.relay1_schedule = relay1;
+  g_settings.relay2_schedule = relay2;
+  return settings_save();
+}
+
+bool settings_set_relay_groups(uint32_t relay1, uint32_t relay2) {
+  g_settings.relay1_groups = relay1;
+  g_settings.relay2_groups = relay2;
+  return settings_save();
+}
+
+bool settings_set_log_flush(uint32_t max_age_ms, uint16_t max_events) {
+  g_settings.log_flush_ms = max_age_ms;
+  g_settings.log_flush_events = max_events;
+  clamp_log_limits(&g_settings);
+  return settings_save();
+}
+
+bool settings_set_log_coalesce(uint32_t window_ms) {
+  g_settings.log_coalesce_ms = window_ms;
+  clamp_log_limits(&g_settings);
+  return settings_save();
+}
+
 bool settings_set_auth(bool enabled, const char* user, const char* pass, const char* api_key) {
   g_settings.auth_enabled = enabled;
   if (user) {
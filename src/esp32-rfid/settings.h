@@ -18,6 +18,19 @@ struct Settings {
   char relay2_name[24];
   bool relay1_state;
   bool relay2_state;
+  uint8_t relay1_schedule;
+  uint8_t relay2_schedule;
+  // Access groups each door admits; users.h kGroupRelay1/kGroupRelay2 by default.
+  uint32_t relay1_groups;
+  uint32_t relay2_groups;
+  // Write-behind bound: queued log events reach flash once this many are
+  // waiting or the oldest has waited this long. Loading and the setter clamp
+  // both to log.h kMaxLogFlushMs/kMaxLogFlushEvents.
+  uint32_t log_flush_ms;
+  uint16_t log_flush_events;
+  // Denied swipes repeated within this window of the first are logged as one
+  // counted record; 0 logs each one. Clamped to log.h kMaxLogCoalesceMs.
+  uint32_t log_coalesce_ms;
   bool auth_enabled;
   char auth_user[24];
   char auth_pass[40];
@@ -34,6 +47,10 @@ bool settings_set_wifi(bool client_mode, const char* ssid, const char* pass);
 bool settings_set_wifi_static(bool enabled, const char* ip, const char* gateway, const char* mask);
 bool settings_set_relay_names(const char* relay1, const char* relay2);
 bool settings_set_relay_state(uint8_t relay_id, bool enabled);
+bool settings_set_relay_schedules(uint8_t relay1, uint8_t relay2);
+bool settings_set_relay_groups(uint32_t relay1, uint32_t relay2);
+bool settings_set_log_flush(uint32_t max_age_ms, uint16_t max_events);
+bool settings_set_log_coalesce(uint32_t window_ms);
 bool settings_set_auth(bool enabled, const char* user, const char* pass, const char* api_key);
 
 } // namespace app
@@ -0,0 +1,198 @@
+#include "stats.h"
+
+#include <LittleFS.h>
+#include <cstring>
+#include <freertos/task.h>
+
+namespace app {
+
+namespace {
+constexpr const char* kStatsPath = "/stats.bin";
+constexpr const char* kStatsTmpPath = "/stats.tmp";
+constexpr uint32_t kStatsMagic = 0x31415453; // "STA1"
+constexpr uint32_t kSecondsPerHour = 3600;
+constexpr uint32_t kSecondsPerDay = 86400;
+
+// Written by the storage task only; keeps the 2 KB copy off its stack.
+AccessStatsData g_save_copy;
+
+void bump(uint16_t* counter) {
+  if (*counter < UINT16_MAX) {
+    ++*counter;
+  }
+}
+
+} // namespace
+
+void AccessStats::init() {
+  if (!mutex_) {
+    mutex_ = xSemaphoreCreateMutex();
+  }
+  memset(&data_, 0, sizeof(data_));
+  dirty_ = false;
+  flush_requested_ = false;
+  saved_ms_ = millis();
+}
+
+bool AccessStats::load() {
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  if (!LittleFS.exists(kStatsPath)) {
+    return true;
+  }
+  File file = LittleFS.open(kStatsPath, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  uint32_t magic = 0;
+  bool ok = file.read(reinterpret_cast<uint8_t*>(&magic), sizeof(magic)) == sizeof(magic) && magic == kStatsMagic &&
+            file.size() == sizeof(magic) + sizeof(AccessStatsData);
+  if (ok) {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    ok = file.read(reinterpret_cast<uint8_t*>(&data_), sizeof(data_)) == sizeof(data_);
+    if (!ok) {
+      memset(&data_, 0, sizeof(data_));
+    }
+    xSemaphoreGive(mutex_);
+  }
+  file.close();
+  return ok;
+}
+
+// Moves the newest slot of one reader's ring up to now, zeroing the slots
+// skipped on the way.
+void AccessStats::advance(StatsBucket* ring, size_t len, uint32_t newest, uint32_t now) {
+  if (now <= newest) {
+    return;
+  }
+  if (now - newest >= len) {
+    memset(ring, 0, sizeof(StatsBucket) * len);
+    return;
+  }
+  for (uint32_t t = newest + 1; t <= now; ++t) {
+    ring[t % len] = StatsBucket{0, 0};
+  }
+}
+
+void AccessStats::record(uint8_t reader, bool granted, uint32_t now) {
+  if (reader < 1 || reader > kStatsReaders) {
+    return;
+  }
+  const size_t r = reader - 1;
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  if (now == 0) {
+    data_.unclocked[r][granted ? 0 : 1]++;
+  } else {
+    uint32_t hour = now / kSecondsPerHour;
+    uint32_t day = now / kSecondsPerDay;
+    for (size_t i = 0; i < kStatsReaders; ++i) {
+      advance(data_.hours[i], kStatsHours, data_.hour, hour);
+      advance(data_.days[i], kStatsDays, data_.day, day);
+    }
+    if (hour > data_.hour) {
+      data_.hour = hour;
+    }
+    if (day > data_.day) {
+      data_.day = day;
+    }
+    // A clock set back still counts into its bucket while that is in range.
+    if (data_.hour - hour < kStatsHours) {
+      StatsBucket& bucket = data_.hours[r][hour % kStatsHours];
+      bump(granted ? &bucket.granted : &bucket.denied);
+    }
+    if (data_.day - day < kStatsDays) {
+      StatsBucket& bucket = data_.days[r][day % kStatsDays];
+      bump(granted ? &bucket.granted : &bucket.denied);
+    }
+  }
+  xSemaphoreGive(mutex_);
+  dirty_.store(true, std::memory_order_relaxed);
+}
+
+void AccessStats::snapshot(AccessStatsData* out) const {
+  if (!mutex_) {
+    // Not loaded yet.
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  memcpy(out, &data_, sizeof(data_));
+  xSemaphoreGive(mutex_);
+}
+
+StatsBucket AccessStats::hour_bucket(const AccessStatsData& data, uint8_t reader, uint32_t hour) {
+  if (reader < 1 || reader > kStatsReaders || hour > data.hour || data.hour - hour >= kStatsHours) {
+    return StatsBucket{0, 0};
+  }
+  return data.hours[reader - 1][hour % kStatsHours];
+}
+
+StatsBucket AccessStats::day_bucket(const AccessStatsData& data, uint8_t reader, uint32_t day) {
+  if (reader < 1 || reader > kStatsReaders || day > data.day || data.day - day >= kStatsDays) {
+    return StatsBucket{0, 0};
+  }
+  return data.days[reader - 1][day % kStatsDays];
+}
+
+bool AccessStats::save() {
+  snapshot(&g_save_copy);
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  File file = LittleFS.open(kStatsTmpPath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  uint32_t magic = kStatsMagic;
+  bool ok = file.write(reinterpret_cast<const uint8_t*>(&magic), sizeof(magic)) == sizeof(magic) &&
+            file.write(reinterpret_cast<const uint8_t*>(&g_save_copy), sizeof(g_save_copy)) == sizeof(g_save_copy);
+  file.close();
+  if (!ok || !LittleFS.rename(kStatsTmpPath, kStatsPath)) {
+    LittleFS.remove(kStatsTmpPath);
+    return false;
+  }
+  return true;
+}
+
+bool AccessStats::save_if_due(uint32_t now_ms) {
+  bool requested = flush_requested_.load(std::memory_order_relaxed);
+  if (!dirty_.load(std::memory_order_relaxed)) {
+    if (requested) {
+      save_ok_.store(true, std::memory_order_relaxed);
+      flush_requested_.store(false, std::memory_order_relaxed);
+    }
+    return true;
+  }
+  if (!requested && now_ms - saved_ms_ < kStatsSaveMs) {
+    return true;
+  }
+  // Cleared before the copy: a swipe counted during the write marks the
+  // counters dirty again.
+  dirty_.store(false, std::memory_order_relaxed);
+  saved_ms_ = now_ms;
+  bool ok = save();
+  if (!ok) {
+    dirty_.store(true, std::memory_order_relaxed);
+  }
+  // A request that arrived during this write waits for the next pass.
+  if (requested) {
+    save_ok_.store(ok, std::memory_order_relaxed);
+    flush_requested_.store(false, std::memory_order_relaxed);
+  }
+  return ok;
+}
+
+bool AccessStats::flush(uint32_t timeout_ms) {
+  uint32_t start = millis();
+  flush_requested_.store(true, std::memory_order_relaxed);
+  while (flush_requested_.load(std::memory_order_relaxed)) {
+    if (millis() - start >= timeout_ms) {
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return save_ok_.load(std::memory_order_relaxed);
+}
+
+} // namespace app
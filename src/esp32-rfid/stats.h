@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+namespace app {
+
+constexpr size_t kStatsReaders = 2;
+constexpr size_t kStatsHours = 7 * 24;
+constexpr size_t kStatsDays = 90;
+constexpr uint32_t kStatsSaveMs = 5 * 60 * 1000;
+
+struct StatsBucket {
+  uint16_t granted;
+  uint16_t denied; // denied, unknown and out-of-schedule
+};
+
+// Bucket rings indexed by unix hour % kStatsHours and unix day % kStatsDays.
+// hour/day is the newest one counted; buckets older than a ring length are
+// stale and read as zero.
+struct AccessStatsData {
+  uint32_t hour;
+  uint32_t day;
+  StatsBucket hours[kStatsReaders][kStatsHours];
+  StatsBucket days[kStatsReaders][kStatsDays];
+  uint32_t unclocked[kStatsReaders][2]; // granted, denied swipes without a valid clock
+};
+
+// Access counters per reader in hourly buckets for a week and daily buckets
+// for 90 days, updated by logic_task for every swipe so /stats never reads
+// the log. The counters live in RAM (about 2 KB) and the storage task writes
+// them to /stats.bin at most every kStatsSaveMs, so a power loss costs at
+// most that much counting.
+class AccessStats {
+ public:
+  void init();
+  bool load();
+  // now is unix time, or 0 without a valid clock. reader is 1 or 2.
+  void record(uint8_t reader, bool granted, uint32_t now);
+  // Copy for other tasks.
+  void snapshot(AccessStatsData* out) const;
+  // Bucket for a unix hour or day; zero when it is not in the ring.
+  static StatsBucket hour_bucket(const AccessStatsData& data, uint8_t reader, uint32_t hour);
+  static StatsBucket day_bucket(const AccessStatsData& data, uint8_t reader, uint32_t day);
+
+  // Storage task side: writes the counters when they changed and
+  // kStatsSaveMs has passed, or a flush was requested.
+  bool save_if_due(uint32_t now_ms);
+  // Asks the storage task to write now and waits up to timeout_ms.
+  bool flush(uint32_t timeout_ms);
+
+ private:
+  static void advance(StatsBucket* ring, size_t len, uint32_t newest, uint32_t now);
+  bool save();
+
+  SemaphoreHandle_t mutex_ = nullptr;
+  AccessStatsData data_{};
+  std::atomic<bool> dirty_{false};
+  std::atomic<bool> flush_requested_{false};
+  std::atomic<bool> save_ok_{true};
+  uint32_t saved_ms_ = 0;
+};
+
+} // namespace app
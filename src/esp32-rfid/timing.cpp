@@ -0,0 +1,33 @@
+#include "timing.h"
+
+#include <atomic>
+
+namespace app {
+
+namespace {
+struct TimingCounters {
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> last_us{0};
+  std::atomic<uint32_t> max_us{0};
+};
+
+TimingCounters g_timings[static_cast<size_t>(TimingProbe::Count)];
+} // namespace
+
+void timing_record(TimingProbe probe, uint32_t us) {
+  TimingCounters& counters = g_timings[static_cast<size_t>(probe)];
+  counters.count.fetch_add(1, std::memory_order_relaxed);
+  counters.last_us.store(us, std::memory_order_relaxed);
+  uint32_t max = counters.max_us.load(std::memory_order_relaxed);
+  while (us > max && !counters.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+  }
+}
+
+void timing_get(TimingProbe probe, TimingStat* out) {
+  const TimingCounters& counters = g_timings[static_cast<size_t>(probe)];
+  out->count = counters.count.load(std::memory_order_relaxed);
+  out->last_us = counters.last_us.load(std::memory_order_relaxed);
+  out->max_us = counters.max_us.load(std::memory_order_relaxed);
+}
+
+} // namespace app
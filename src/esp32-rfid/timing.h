@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace app {
+
+// Hot paths timed with micros() on the device; /status reports each probe.
+// There is no host benchmark: these counters are the only latency figures.
+enum class TimingProbe : uint8_t {
+  UserLookup, // UsersDb::lookup() for one swipe
+  LogAppend,  // LogRing::append() for one batch of events
+  Gzip,       // compressing one gzip response body, sending excluded
+  Count,
+};
+
+struct TimingStat {
+  uint32_t count;
+  uint32_t last_us;
+  uint32_t max_us;
+};
+
+// Safe from any task; a probe may have more than one writer.
+void timing_record(TimingProbe probe, uint32_t us);
+// Counters since boot. The fields are read one by one, so a sample landing
+// in between may show in one of them only.
+void timing_get(TimingProbe probe, TimingStat* out);
+
+} // namespace app
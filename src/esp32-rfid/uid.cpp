@@ -0,0 +1,81 @@
+#include "uid.h"
+
+namespace app {
+
+bool uid_parse(const char* text, UidKey* out) {
+  if (!text) {
+    return false;
+  }
+  return uid_parse(text, strlen(text), out);
+}
+
+bool uid_parse(const char* text, size_t len, UidKey* out) {
+  if (!text || !out) {
+    return false;
+  }
+  while (len > 0 && (*text == ' ' || *text == '\t')) {
+    ++text;
+    --len;
+  }
+  while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t' ||
+                     text[len - 1] == '\r' || text[len - 1] == '\n')) {
+    --len;
+  }
+  if (len == 0 || len > kUidMaxDigits) {
+    return false;
+  }
+  uint64_t value = 0;
+  for (size_t i = 0; i < len; ++i) {
+    char c = text[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = static_cast<uint8_t>(c - '0');
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = static_cast<uint8_t>(c - 'A' + 10);
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = static_cast<uint8_t>(c - 'a' + 10);
+    } else {
+      return false;
+    }
+    value = (value << 4) | nibble;
+  }
+  out->value = value;
+  out->len = static_cast<uint8_t>(len);
+  return true;
+}
+
+void uid_format(const UidKey& uid, char* out, size_t out_len) {
+  static const char* kHex = "0123456789ABCDEF";
+  if (!out || out_len == 0) {
+    return;
+  }
+  size_t width = uid.len;
+  if (width + 1 > out_len) {
+    width = out_len - 1;
+  }
+  uint64_t value = uid.value;
+  for (size_t i = width; i > 0; --i) {
+    out[i - 1] = kHex[value & 0x0F];
+    value >>= 4;
+  }
+  out[width] = '\0';
+}
+
+String uid_to_string(const UidKey& uid) {
+  char buf[kUidTextLen];
+  uid_format(uid, buf, sizeof(buf));
+  return String(buf);
+}
+
+uint32_t uid_hash(const UidKey& uid) {
+  // splitmix64 finalizer; the digit count keeps "1A" and "001A" apart.
+  uint64_t x = uid.value ^ (static_cast<uint64_t>(uid.len) << 56);
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return static_cast<uint32_t>(x);
+}
+
+} // namespace app
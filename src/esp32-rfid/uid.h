@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace app {
+
+// Wiegand credentials from the Nano are at most 64 bits, sent as hex.
+constexpr size_t kUidMaxDigits = 16;
+constexpr size_t kUidTextLen = kUidMaxDigits + 1;
+
+struct UidKey {
+  uint64_t value;
+  uint8_t len; // hex digits as received (keeps leading zeros), 0 = empty
+};
+
+bool uid_parse(const char* text, UidKey* out);
+bool uid_parse(const char* text, size_t len, UidKey* out);
+void uid_format(const UidKey& uid, char* out, size_t out_len);
+String uid_to_string(const UidKey& uid);
+uint32_t uid_hash(const UidKey& uid);
+
+inline bool uid_valid(const UidKey& uid) {
+  return uid.len != 0;
+}
+
+inline bool uid_equal(const UidKey& a, const UidKey& b) {
+  return a.value == b.value && a.len == b.len;
+}
+
+} // namespace app
@@ -1,11 +1,33 @@
 #include "users.h"
 
+#include <cmath>
 #include <cstring>
 #include <cstdlib>
 #include <LittleFS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 namespace {
 constexpr const char* kUsersPath = "/users.txt";
+constexpr const char* kUsersTmpPath = "/users.tmp";
+constexpr const char* kJournalPath = "/users.jnl";
+// The journal a background snapshot is folding in, and that snapshot until
+// it is complete.
+constexpr const char* kJournalOldPath = "/users.jnl.old";
+constexpr const char* kSnapshotTmpPath = "/users.new";
+constexpr size_t kSnapshotPage = 2048;
+constexpr size_t kJournalCompactAt = 200;
+constexpr const char* kUsagePath = "/usage.bin";
+constexpr const char* kUsageTmpPath = "/usage.tmp";
+constexpr uint32_t kUsageMagic = 0x31475355; // "USG1"
+
+struct UsageFileRecord {
+  uint32_t uid_lo;
+  uint32_t uid_hi;
+  uint8_t uid_len;
+  uint8_t reserved[3];
+  app::UserUsage usage;
+};
 
 bool parse_bool(const char* token) {
   if (!token) {
@@ -13,173 +35,859 @@ bool parse_bool(const char* token) {
   }
   return token[0] == '1' || token[0] == 't' || token[0] == 'T' || token[0] == 'y' || token[0] == 'Y';
 }
+
+// uid|name|relay1|relay2[|schedule[|groups[|valid_from|valid_until|uses]]].
+// Without a groups field the relay flags select groups 0 and 1; with one
+// it is the whole mask. Times are unix seconds (0 = open-ended) and an
+// empty uses field means unlimited.
+bool parse_user_line(const char* line, size_t len, app::UidKey* uid, char* name, size_t name_len,
+                     uint32_t* groups, uint8_t* schedule, app::UserTerms* terms) {
+  const char* end = line + len;
+  const char* p1 = static_cast<const char*>(memchr(line, '|', len));
+  const char* p2 = p1 ? static_cast<const char*>(memchr(p1 + 1, '|', end - p1 - 1)) : nullptr;
+  const char* p3 = p2 ? static_cast<const char*>(memchr(p2 + 1, '|', end - p2 - 1)) : nullptr;
+  if (!p1 || !p2 || !p3) {
+    return false;
+  }
+  if (!app::uid_parse(line, static_cast<size_t>(p1 - line), uid)) {
+    return false;
+  }
+  size_t n = static_cast<size_t>(p2 - p1 - 1);
+  if (n >= name_len) {
+    n = name_len - 1;
+  }
+  memcpy(name, p1 + 1, n);
+  name[n] = '\0';
+  *groups = (parse_bool(p2 + 1) ? app::kGroupRelay1 : 0) | (parse_bool(p3 + 1) ? app::kGroupRelay2 : 0);
+  *schedule = 0;
+  memset(terms, 0, sizeof(*terms));
+  const char* p4 = static_cast<const char*>(memchr(p3 + 1, '|', end - p3 - 1));
+  if (!p4) {
+    return true;
+  }
+  const char* p5 = static_cast<const char*>(memchr(p4 + 1, '|', end - p4 - 1));
+  unsigned long value = strtoul(p4 + 1, nullptr, 10);
+  if (value >= app::kMaxSchedules) {
+    return false;
+  }
+  *schedule = static_cast<uint8_t>(value);
+  if (!p5) {
+    return true;
+  }
+  const char* p6 = static_cast<const char*>(memchr(p5 + 1, '|', end - p5 - 1));
+  if (!app::parse_group_mask(p5 + 1, static_cast<size_t>((p6 ? p6 : end) - p5 - 1), groups)) {
+    return false;
+  }
+  if (!p6) {
+    return true;
+  }
+  const char* p7 = static_cast<const char*>(memchr(p6 + 1, '|', end - p6 - 1));
+  const char* p8 = p7 ? static_cast<const char*>(memchr(p7 + 1, '|', end - p7 - 1)) : nullptr;
+  if (!p8) {
+    return false;
+  }
+  terms->valid_from = static_cast<uint32_t>(strtoul(p6 + 1, nullptr, 10));
+  terms->valid_until = static_cast<uint32_t>(strtoul(p7 + 1, nullptr, 10));
+  if (p8 + 1 < end && p8[1] >= '0' && p8[1] <= '9') {
+    value = strtoul(p8 + 1, nullptr, 10);
+    if (value > UINT16_MAX) {
+      return false;
+    }
+    terms->uses_left = static_cast<uint16_t>(value);
+    terms->limited_uses = true;
+  }
+  return true;
+}
+
 } // namespace
 
 namespace app {
 
+void json_escape(const char* in, char* out, size_t out_len) {
+  size_t o = 0;
+  for (; *in && o + 2 < out_len; ++in) {
+    char c = *in;
+    if (c == '"' || c == '\\') {
+      out[o++] = '\\';
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      c = ' ';
+    }
+    out[o++] = c;
+  }
+  out[o] = '\0';
+}
+
+bool parse_group_mask(const char* text, size_t len, uint32_t* out) {
+  while (len > 0 && (*text == ' ' || *text == '\t')) {
+    ++text;
+    --len;
+  }
+  int base = 10;
+  if (len > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+    base = 16;
+    text += 2;
+    len -= 2;
+  }
+  uint64_t value = 0;
+  size_t digits = 0;
+  for (; digits < len; ++digits) {
+    char c = text[digits];
+    int d = -1;
+    if (c >= '0' && c <= '9') {
+      d = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      d = c - 'a' + 10;
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      d = c - 'A' + 10;
+    }
+    if (d < 0) {
+      break;
+    }
+    value = value * base + d;
+    if (value > 0xFFFFFFFFull) {
+      return false;
+    }
+  }
+  if (digits == 0) {
+    return false;
+  }
+  for (size_t i = digits; i < len; ++i) {
+    if (text[i] != ' ' && text[i] != '\t' && text[i] != '\r') {
+      return false;
+    }
+  }
+  *out = static_cast<uint32_t>(value);
+  return true;
+}
+
+UsersDb::WriteGuard::WriteGuard(UsersDb& db) : db_(db) {
+  if (db_.write_depth_++ > 0) {
+    return;
+  }
+  // Odd sequence turns new readers away; then wait out the ones already
+  // inside, since a write may free memory they are looking at.
+  db_.seq_.fetch_add(1);
+  while (db_.readers_.load() != 0) {
+    vTaskDelay(1);
+  }
+}
+
+UsersDb::WriteGuard::~WriteGuard() {
+  if (--db_.write_depth_ == 0) {
+    db_.seq_.fetch_add(1);
+  }
+}
+
+void UsersDb::read_lock() const {
+  for (;;) {
+    readers_.fetch_add(1);
+    if ((seq_.load() & 1) == 0) {
+      return;
+    }
+    readers_.fetch_sub(1);
+    vTaskDelay(1);
+  }
+}
+
+void UsersDb::read_unlock() const {
+  readers_.fetch_sub(1);
+}
+
 void UsersDb::init() {
-  if (users_ == nullptr) {
-    users_ = static_cast<UserRecord*>(malloc(sizeof(UserRecord) * kMaxUsers));
-    capacity_ = users_ ? kMaxUsers : 0;
-    if (!users_) {
-      users_ = static_cast<UserRecord*>(malloc(sizeof(UserRecord) * 500));
-      capacity_ = users_ ? 500 : 0;
+  WriteGuard guard(*this);
+  if (index_ == nullptr) {
+    index_resize(kInitialIndexSize);
+  }
+  if (!snapshot_mutex_) {
+    snapshot_mutex_ = xSemaphoreCreateMutex();
+  }
+  clear();
+}
+
+void UsersDb::clear() {
+  WriteGuard guard(*this);
+  snapshot_epoch_.fetch_add(1);
+  if (usage_dirty_) {
+    flush_usage();
+  }
+  for (size_t i = 0; i < chunk_count_; ++i) {
+    free(chunks_[i]);
+    chunks_[i] = nullptr;
+    free(usage_chunks_[i]);
+    usage_chunks_[i] = nullptr;
+    free(terms_chunks_[i]);
+    terms_chunks_[i] = nullptr;
+  }
+  terms_unjournaled_ = 0;
+  for (size_t i = 0; i < kWheelBuckets + 2; ++i) {
+    wheel_[i] = kNoLink;
+  }
+  chunk_count_ = 0;
+  capacity_ = 0;
+  count_ = 0;
+  free_head_ = kNoSlot;
+  names_.clear();
+  index_rebuild();
+  bloom_rebuild();
+}
+
+bool UsersDb::add_chunk() {
+  if (chunk_count_ >= kMaxChunks) {
+    return false;
+  }
+  const size_t bytes = sizeof(UserSlot) * kChunkUsers;
+  if (ESP.getFreeHeap() < kHeapReserve + bytes + kChunkUsers * kBloomBitsPerUser / 8) {
+    return false;
+  }
+  auto* chunk = static_cast<UserSlot*>(malloc(bytes));
+  if (!chunk) {
+    return false;
+  }
+  chunks_[chunk_count_++] = chunk;
+  size_t base = capacity_;
+  capacity_ += kChunkUsers;
+  for (size_t i = kChunkUsers; i > 0; --i) {
+    UserSlot& s = chunk[i - 1];
+    s.uid_len = 0;
+    s.uid_hi = 0;
+    s.groups = 0;
+    s.schedule = 0;
+    s.name = NameStore::kEmpty;
+    s.uid_lo = free_head_;
+    free_head_ = static_cast<uint32_t>(base + i - 1);
+  }
+  bloom_resize(capacity_);
+  return true;
+}
+
+size_t UsersDb::alloc_slot() {
+  if (free_head_ == kNoSlot && !add_chunk()) {
+    return kNoSlot;
+  }
+  size_t slot = free_head_;
+  free_head_ = slot_at(slot).uid_lo;
+  return slot;
+}
+
+void UsersDb::fill_record(const UserSlot& s, UserRecord* out) const {
+  out->uid = slot_key(s).value;
+  out->uid_len = s.uid_len;
+  out->in_use = true;
+  out->groups = s.groups;
+  out->schedule = s.schedule;
+  strncpy(out->name, names_.get(s.name), sizeof(out->name) - 1);
+  out->name[sizeof(out->name) - 1] = '\0';
+}
+
+size_t UsersDb::find_slot(const UidKey& uid) const {
+  if (!uid_valid(uid) || !index_ || index_size_ == 0) {
+    return kNoSlot;
+  }
+  const size_t mask = index_size_ - 1;
+  size_t pos = uid_hash(uid) & mask;
+  for (size_t probe = 0; probe < index_size_; ++probe) {
+    uint16_t entry = index_[pos];
+    if (entry == kIndexEmpty) {
+      return kNoSlot;
+    }
+    if (entry != kIndexDeleted && slot_matches(slot_at(entry), uid)) {
+      return entry;
     }
+    pos = (pos + 1) & mask;
   }
-  if (!users_ || capacity_ == 0) {
+  return kNoSlot;
+}
+
+void UsersDb::index_insert(const UidKey& uid, size_t slot) {
+  if (!index_ || index_size_ == 0) {
     return;
   }
+  const size_t mask = index_size_ - 1;
+  size_t pos = uid_hash(uid) & mask;
+  while (index_[pos] != kIndexEmpty && index_[pos] != kIndexDeleted) {
+    pos = (pos + 1) & mask;
+  }
+  if (index_[pos] == kIndexDeleted) {
+    index_deleted_--;
+  }
+  index_[pos] = static_cast<uint16_t>(slot);
+}
+
+void UsersDb::index_remove(const UidKey& uid) {
+  if (!index_ || index_size_ == 0) {
+    return;
+  }
+  const size_t mask = index_size_ - 1;
+  size_t pos = uid_hash(uid) & mask;
+  for (size_t probe = 0; probe < index_size_; ++probe) {
+    uint16_t entry = index_[pos];
+    if (entry == kIndexEmpty) {
+      return;
+    }
+    if (entry != kIndexDeleted && slot_matches(slot_at(entry), uid)) {
+      index_[pos] = kIndexDeleted;
+      index_deleted_++;
+      break;
+    }
+    pos = (pos + 1) & mask;
+  }
+  // Tombstones lengthen probe chains; start over once they take a quarter of the table.
+  if (index_deleted_ > index_size_ / 4) {
+    index_rebuild();
+  }
+}
+
+bool UsersDb::index_resize(size_t size) {
+  auto* index = static_cast<uint16_t*>(malloc(sizeof(uint16_t) * size));
+  if (!index) {
+    return false;
+  }
+  free(index_);
+  index_ = index;
+  index_size_ = size;
+  index_rebuild();
+  return true;
+}
+
+void UsersDb::index_rebuild() {
+  if (!index_ || index_size_ == 0) {
+    return;
+  }
+  for (size_t i = 0; i < index_size_; ++i) {
+    index_[i] = kIndexEmpty;
+  }
+  index_deleted_ = 0;
   for (size_t i = 0; i < capacity_; ++i) {
-    users_[i].in_use = false;
-    users_[i].uid[0] = '\0';
-    users_[i].name[0] = '\0';
-    users_[i].relay1 = false;
-    users_[i].relay2 = false;
+    const UserSlot& s = slot_at(i);
+    if (s.uid_len != 0) {
+      index_insert(slot_key(s), i);
+    }
   }
 }
 
-void UsersDb::clear() {
-  if (!users_ || capacity_ == 0) {
+void UsersDb::bloom_resize(size_t users) {
+  size_t bytes = users * kBloomBitsPerUser / 8;
+  auto* bloom = static_cast<uint8_t*>(realloc(bloom_, bytes));
+  if (!bloom) {
+    // Without a filter every lookup goes to the index.
+    free(bloom_);
+    bloom_ = nullptr;
+    bloom_bits_ = 0;
+    return;
+  }
+  bloom_ = bloom;
+  bloom_bits_ = bytes * 8;
+  bloom_rebuild();
+}
+
+void UsersDb::bloom_rebuild() {
+  bloom_set_ = 0;
+  bloom_stale_ = 0;
+  if (!bloom_) {
     return;
   }
+  memset(bloom_, 0, bloom_bits_ / 8);
   for (size_t i = 0; i < capacity_; ++i) {
-    users_[i].in_use = false;
-    users_[i].uid[0] = '\0';
-    users_[i].name[0] = '\0';
-    users_[i].relay1 = false;
-    users_[i].relay2 = false;
+    const UserSlot& s = slot_at(i);
+    if (s.uid_len != 0) {
+      bloom_add(slot_key(s));
+    }
   }
 }
 
-bool UsersDb::load() {
-  if (!LittleFS.begin()) {
-    return false;
+void UsersDb::bloom_add(const UidKey& uid) {
+  if (!bloom_) {
+    return;
+  }
+  // Double hashing: probe i is h1 + i * h2, scaled onto the bit range.
+  uint32_t h1 = uid_hash(uid);
+  uint32_t h2 = ((h1 >> 17) | (h1 << 15)) * 0x85EBCA6Bu | 1u;
+  for (uint8_t i = 0; i < kBloomHashes; ++i) {
+    size_t bit = static_cast<size_t>((static_cast<uint64_t>(h1 + i * h2) * bloom_bits_) >> 32);
+    uint8_t mask = static_cast<uint8_t>(1u << (bit & 7));
+    if ((bloom_[bit >> 3] & mask) == 0) {
+      bloom_[bit >> 3] |= mask;
+      bloom_set_++;
+    }
   }
-  if (!LittleFS.exists(kUsersPath)) {
+}
+
+bool UsersDb::bloom_may_contain(const UidKey& uid) const {
+  if (!bloom_) {
     return true;
   }
-  File file = LittleFS.open(kUsersPath, FILE_READ);
-  if (!file) {
-    return false;
+  uint32_t h1 = uid_hash(uid);
+  uint32_t h2 = ((h1 >> 17) | (h1 << 15)) * 0x85EBCA6Bu | 1u;
+  for (uint8_t i = 0; i < kBloomHashes; ++i) {
+    size_t bit = static_cast<size_t>((static_cast<uint64_t>(h1 + i * h2) * bloom_bits_) >> 32);
+    if ((bloom_[bit >> 3] & (1u << (bit & 7))) == 0) {
+      return false;
+    }
   }
-  suppress_save_ = true;
-  while (file.available()) {
-    String line = file.readStringUntil('\n');
-    line.trim();
-    if (line.length() == 0) {
-      continue;
+  return true;
+}
+
+void UsersDb::filter_stats(UserFilterStats* out) const {
+  if (!out) {
+    return;
+  }
+  out->bytes = static_cast<uint32_t>(bloom_bits_ / 8);
+  out->bits = static_cast<uint32_t>(bloom_bits_);
+  out->bits_set = static_cast<uint32_t>(bloom_set_);
+  out->hashes = kBloomHashes;
+  out->estimated_fp = bloom_bits_ ? powf(static_cast<float>(bloom_set_) / bloom_bits_, kBloomHashes) : 1.0f;
+  out->rejected = bloom_rejected_.load();
+  out->false_positives = bloom_false_positives_.load();
+}
+
+void UsersDb::apply_line(const char* line, size_t len) {
+  while (len > 0 && (line[0] == ' ' || line[0] == '\t')) {
+    ++line;
+    --len;
+  }
+  while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) {
+    --len;
+  }
+  if (len == 0) {
+    return;
+  }
+  if (line[0] == '#') {
+    if (len > 5 && memcmp(line, "#gen=", 5) == 0) {
+      stored_generation_ = static_cast<uint32_t>(strtoul(line + 5, nullptr, 10));
     }
-    int p1 = line.indexOf('|');
-    int p2 = line.indexOf('|', p1 + 1);
-    int p3 = line.indexOf('|', p2 + 1);
-    if (p1 < 0 || p2 < 0 || p3 < 0) {
+    return;
+  }
+  // Journal records carry an op prefix; snapshot lines are plain adds.
+  char op = line[0];
+  if (op == '+' || op == '-') {
+    ++line;
+    --len;
+  }
+  UidKey key{};
+  if (op == '-') {
+    if (uid_parse(line, len, &key)) {
+      remove(key);
+    }
+    return;
+  }
+  char name[32];
+  uint32_t groups = 0;
+  uint8_t schedule = 0;
+  UserTerms terms{};
+  if (!parse_user_line(line, len, &key, name, sizeof(name), &groups, &schedule, &terms)) {
+    return;
+  }
+  // A journaled '+' for a known UID is an edit: update in place so the
+  // replay bumps the generation and the change ring once, as the edit did.
+  if (op == '+' && find_slot(key) != kNoSlot) {
+    // Without room for its terms the record would keep older, looser
+    // terms; dropping it is the safe side.
+    if (!update_user(key, name, groups, schedule, &terms)) {
+      remove(key);
+    }
+    return;
+  }
+  add_user(key, name, groups, schedule, &terms);
+}
+
+void UsersDb::import_chunk(const char* data, size_t len) {
+  WriteGuard guard(*this);
+  if (!data) {
+    return;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    char c = data[i];
+    if (c == '\n') {
+      if (!import_overflow_) {
+        apply_line(import_line_, import_len_);
+        import_lines_++;
+      }
+      import_len_ = 0;
+      import_overflow_ = false;
       continue;
     }
-    String uid = line.substring(0, p1);
-    String name = line.substring(p1 + 1, p2);
-    String d1 = line.substring(p2 + 1, p3);
-    String d2 = line.substring(p3 + 1);
-    add_user(uid.c_str(), name.c_str(), parse_bool(d1.c_str()), parse_bool(d2.c_str()));
+    if (import_len_ < sizeof(import_line_)) {
+      import_line_[import_len_++] = c;
+    } else {
+      import_overflow_ = true;
+    }
   }
+}
+
+void UsersDb::begin_import() {
+  WriteGuard guard(*this);
+  clear();
+  suppress_save_ = true;
+  import_len_ = 0;
+  import_lines_ = 0;
+  import_overflow_ = false;
+}
+
+bool UsersDb::end_import(bool commit) {
+  WriteGuard guard(*this);
+  if (import_len_ > 0 && !import_overflow_) {
+    apply_line(import_line_, import_len_);
+  }
+  import_len_ = 0;
+  import_overflow_ = false;
   suppress_save_ = false;
+  // The ring only holds the tail of the import; deltas cannot span it.
+  change_floor_ = generation_;
+  if (!commit) {
+    return load();
+  }
+  bool ok = save();
+  load_usage();
+  return ok;
+}
+
+size_t UsersDb::load_file(const char* path) {
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  import_len_ = 0;
+  import_lines_ = 0;
+  import_overflow_ = false;
+  char buf[256];
+  for (;;) {
+    size_t n = file.read(reinterpret_cast<uint8_t*>(buf), sizeof(buf));
+    if (n == 0) {
+      break;
+    }
+    import_chunk(buf, n);
+  }
   file.close();
+  if (import_len_ > 0 && !import_overflow_) {
+    apply_line(import_line_, import_len_);
+    import_lines_++;
+  }
+  import_len_ = 0;
+  return import_lines_;
+}
+
+bool UsersDb::load() {
+  WriteGuard guard(*this);
+  if (!LittleFS.begin()) {
+    return false;
+  }
+  uint32_t previous = generation_;
+  clear();
+  suppress_save_ = true;
+  stored_generation_ = 0;
+  xSemaphoreTake(snapshot_mutex_, portMAX_DELAY);
+  if (LittleFS.exists(kUsersPath)) {
+    load_file(kUsersPath);
+  }
+  generation_ = stored_generation_;
+  // Replay changes made since the snapshot was written, the old journal
+  // first. Each record sets a user's whole state, so replaying one the
+  // snapshot already holds (a background snapshot reads the table while
+  // it changes, and a crash can come before the journal delete) is
+  // harmless.
+  journal_entries_ = 0;
+  if (LittleFS.exists(kJournalOldPath)) {
+    // A background snapshot did not finish; ask again at the first idle.
+    load_file(kJournalOldPath);
+    journal_entries_ = kJournalCompactAt;
+  }
+  if (LittleFS.exists(kJournalPath)) {
+    journal_entries_ += load_file(kJournalPath);
+  }
+  xSemaphoreGive(snapshot_mutex_);
+  suppress_save_ = false;
+  // Reloading within a session must not hand out generations again.
+  if (previous != 0 && generation_ <= previous) {
+    generation_ = previous + 1;
+  }
+  change_floor_ = generation_;
+  load_usage();
   return true;
 }
 
-bool UsersDb::save() const {
+size_t UsersDb::format_line(size_t slot, char* out, size_t out_len) const {
+  const UserSlot& user = slot_at(slot);
+  const TermsSlot* terms = terms_at(slot);
+  char uid[kUidTextLen];
+  uid_format(slot_key(user), uid, sizeof(uid));
+  const char* name = names_.get(user.name);
+  char relay1 = (user.groups & kGroupRelay1) ? '1' : '0';
+  char relay2 = (user.groups & kGroupRelay2) ? '1' : '0';
+  int len = 0;
+  // Older firmware reads the first four fields, so they stay first and the
+  // optional ones are only written when they carry something.
+  if (terms && (terms->flags & kTermsActive)) {
+    char uses[8] = "";
+    if (terms->flags & kTermsLimited) {
+      snprintf(uses, sizeof(uses), "%u", static_cast<unsigned>(terms->uses_left));
+    }
+    len = snprintf(out, out_len, "%s|%s|%c|%c|%u|0x%lX|%lu|%lu|%s\n", uid, name, relay1, relay2,
+                   static_cast<unsigned>(user.schedule), static_cast<unsigned long>(user.groups),
+                   static_cast<unsigned long>(terms->valid_from), static_cast<unsigned long>(terms->valid_until), uses);
+  } else if (user.groups & ~(kGroupRelay1 | kGroupRelay2)) {
+    len = snprintf(out, out_len, "%s|%s|%c|%c|%u|0x%lX\n", uid, name, relay1, relay2,
+                   static_cast<unsigned>(user.schedule), static_cast<unsigned long>(user.groups));
+  } else if (user.schedule != 0) {
+    len = snprintf(out, out_len, "%s|%s|%c|%c|%u\n", uid, name, relay1, relay2, static_cast<unsigned>(user.schedule));
+  } else {
+    len = snprintf(out, out_len, "%s|%s|%c|%c\n", uid, name, relay1, relay2);
+  }
+  if (len < 0) {
+    return 0;
+  }
+  return static_cast<size_t>(len) < out_len ? static_cast<size_t>(len) : out_len - 1;
+}
+
+size_t UsersDb::format_json(size_t slot, char* out, size_t out_len) const {
+  const UserSlot& user = slot_at(slot);
+  static const UserUsage kNoUsage{};
+  const UserUsage* usage = usage_at(slot);
+  if (!usage) {
+    usage = &kNoUsage;
+  }
+  char month[8] = "";
+  if (usage->month != 0) {
+    snprintf(month, sizeof(month), "%04u-%02u", static_cast<unsigned>(usage->month / 12),
+             static_cast<unsigned>(usage->month % 12 + 1));
+  }
+  char terms_json[80] = "";
+  const TermsSlot* terms = terms_at(slot);
+  if (terms && (terms->flags & kTermsActive)) {
+    char uses[8] = "null";
+    if (terms->flags & kTermsLimited) {
+      snprintf(uses, sizeof(uses), "%u", static_cast<unsigned>(terms->uses_left));
+    }
+    snprintf(terms_json, sizeof(terms_json), ",\"valid_from\":%lu,\"valid_until\":%lu,\"uses_left\":%s",
+             static_cast<unsigned long>(terms->valid_from), static_cast<unsigned long>(terms->valid_until), uses);
+  }
+  char uid[kUidTextLen];
+  char name[2 * sizeof(UserRecord::name)];
+  uid_format(slot_key(user), uid, sizeof(uid));
+  json_escape(names_.get(user.name), name, sizeof(name));
+  int len = snprintf(out, out_len,
+                     "\"uid\":\"%s\",\"name\":\"%s\",\"relay1\":%s,\"relay2\":%s,\"groups\":%lu,\"schedule\":%u,"
+                     "\"last_seen\":%lu,\"month\":\"%s\",\"uses\":[%u,%u],\"denied\":%u%s",
+                     uid, name, (user.groups & kGroupRelay1) ? "true" : "false", (user.groups & kGroupRelay2) ? "true" : "false",
+                     static_cast<unsigned long>(user.groups), static_cast<unsigned>(user.schedule),
+                     static_cast<unsigned long>(usage->last_seen), month, static_cast<unsigned>(usage->uses[0]),
+                     static_cast<unsigned>(usage->uses[1]), static_cast<unsigned>(usage->denied), terms_json);
+  if (len < 0 || static_cast<size_t>(len) >= out_len) {
+    return 0;
+  }
+  return static_cast<size_t>(len);
+}
+
+bool UsersDb::save() {
   if (!LittleFS.begin()) {
     return false;
   }
-  File file = LittleFS.open(kUsersPath, FILE_WRITE);
+  xSemaphoreTake(snapshot_mutex_, portMAX_DELAY);
+  snapshot_epoch_.fetch_add(1);
+  bool ok = write_snapshot();
+  xSemaphoreGive(snapshot_mutex_);
+  return ok;
+}
+
+bool UsersDb::write_snapshot() {
+  File file = LittleFS.open(kUsersTmpPath, FILE_WRITE);
   if (!file) {
     return false;
   }
-  if (!users_ || capacity_ == 0) {
+  char line[kUserLineMax];
+  size_t header = static_cast<size_t>(snprintf(line, sizeof(line), "#gen=%lu\n", static_cast<unsigned long>(generation_)));
+  if (file.write(reinterpret_cast<const uint8_t*>(line), header) != header) {
     file.close();
-    return true;
+    LittleFS.remove(kUsersTmpPath);
+    return false;
   }
   for (size_t i = 0; i < capacity_; ++i) {
-    const auto & user = users_[i];
-    if (!user.in_use) {
+    const UserSlot& user = slot_at(i);
+    if (user.uid_len == 0) {
       continue;
     }
-    file.print(user.uid);
-    file.print('|');
-    file.print(user.name);
-    file.print('|');
-    file.print(user.relay1 ? '1' : '0');
-    file.print('|');
-    file.print(user.relay2 ? '1' : '0');
-    file.print('\n');
+    size_t len = format_line(i, line, sizeof(line));
+    if (file.write(reinterpret_cast<const uint8_t*>(line), len) != len) {
+      file.close();
+      LittleFS.remove(kUsersTmpPath);
+      return false;
+    }
   }
   file.close();
+  if (!LittleFS.rename(kUsersTmpPath, kUsersPath)) {
+    return false;
+  }
+  LittleFS.remove(kJournalOldPath);
+  LittleFS.remove(kJournalPath);
+  journal_entries_ = 0;
   return true;
 }
 
-static void copy_field(char* dest, size_t dest_len, const char* src) {
-  if (!dest || dest_len == 0) {
-    return;
+bool UsersDb::write_snapshot_if_requested() {
+  if (!snapshot_requested_.load(std::memory_order_acquire)) {
+    return true;
   }
-  if (!src) {
-    dest[0] = '\0';
-    return;
+  const uint32_t epoch = snapshot_epoch_.load();
+  // Only the storage task gets here, and its stack is small.
+  static char page[kSnapshotPage];
+  File file = LittleFS.open(kSnapshotTmpPath, FILE_WRITE);
+  bool ok = static_cast<bool>(file);
+  bool header = true;
+  size_t cursor = 0;
+  while (ok) {
+    size_t used = 0;
+    read_lock();
+    if (snapshot_epoch_.load() != epoch) {
+      read_unlock();
+      ok = false;
+      break;
+    }
+    if (header) {
+      used = static_cast<size_t>(
+          snprintf(page, sizeof(page), "#gen=%lu\n", static_cast<unsigned long>(generation_)));
+      header = false;
+    }
+    const size_t end = capacity_;
+    while (cursor < end && sizeof(page) - used > kUserLineMax) {
+      if (slot_at(cursor).uid_len != 0) {
+        used += format_line(cursor, page + used, sizeof(page) - used);
+      }
+      ++cursor;
+    }
+    read_unlock();
+    if (used > 0 && file.write(reinterpret_cast<const uint8_t*>(page), used) != used) {
+      ok = false;
+    }
+    if (cursor >= end) {
+      break;
+    }
   }
-  strncpy(dest, src, dest_len - 1);
-  dest[dest_len - 1] = '\0';
+  if (file) {
+    file.close();
+  }
+  // A save() or reload since the start has its own snapshot; this one is
+  // stale then.
+  xSemaphoreTake(snapshot_mutex_, portMAX_DELAY);
+  ok = ok && snapshot_epoch_.load() == epoch && LittleFS.rename(kSnapshotTmpPath, kUsersPath);
+  if (ok) {
+    LittleFS.remove(kJournalOldPath);
+  } else {
+    LittleFS.remove(kSnapshotTmpPath);
+  }
+  xSemaphoreGive(snapshot_mutex_);
+  snapshot_requested_.store(false, std::memory_order_release);
+  return ok;
 }
 
-bool UsersDb::add_user(const char* uid, const char* name, bool relay1, bool relay2) {
-  if (!uid || uid[0] == '\0') {
+bool UsersDb::append_journal(char op, size_t slot) {
+  if (!LittleFS.begin()) {
     return false;
   }
+  const UserSlot& user = slot_at(slot);
+  char line[kUserLineMax];
+  size_t len = 0;
+  line[len++] = op;
+  if (op == '+') {
+    len += format_line(slot, line + len, sizeof(line) - len);
+  } else {
+    uid_format(slot_key(user), line + len, sizeof(line) - len - 1);
+    len = strlen(line);
+    line[len++] = '\n';
+  }
+  journal_entries_++;
+  if (batch_journal_) {
+    return batch_journal_.write(reinterpret_cast<const uint8_t*>(line), len) == len;
+  }
+  File file = LittleFS.open(kJournalPath, FILE_APPEND);
+  if (!file) {
+    file = LittleFS.open(kJournalPath, FILE_WRITE);
+  }
+  if (!file) {
+    return false;
+  }
+  bool ok = file.write(reinterpret_cast<const uint8_t*>(line), len) == len;
+  file.close();
+  return ok;
+}
 
-  if (!users_ || capacity_ == 0) {
+bool UsersDb::compact_if_needed() {
+  if (bloom_stale_ > count_ / 8 + 16) {
+    WriteGuard guard(*this);
+    bloom_rebuild();
+  }
+  // An import keeps the table partial until it ends.
+  if (suppress_save_ || journal_entries_ < kJournalCompactAt || snapshot_requested_.load(std::memory_order_acquire)) {
+    return true;
+  }
+  // New records go to a fresh journal while the storage task folds the old
+  // one in. An old journal left by a snapshot that failed stays until one
+  // succeeds; the current journal then just keeps growing.
+  journal_entries_ = 0;
+  if (!LittleFS.exists(kJournalOldPath) && !LittleFS.rename(kJournalPath, kJournalOldPath)) {
     return false;
   }
+  snapshot_requested_.store(true, std::memory_order_release);
+  return true;
+}
 
-  for (size_t i = 0; i < capacity_; ++i) {
-    auto & user = users_[i];
-    if (user.in_use && strcmp(user.uid, uid) == 0) {
-      return false;
-    }
+bool UsersDb::add_user(const UidKey& uid, const char* name, uint32_t groups, uint8_t schedule,
+                       const UserTerms* terms) {
+  WriteGuard guard(*this);
+  if (!uid_valid(uid) || !index_ || count_ >= kMaxUsers) {
+    return false;
   }
 
-  for (size_t i = 0; i < capacity_; ++i) {
-    auto & user = users_[i];
-    if (!user.in_use) {
-      user.in_use = true;
-      copy_field(user.uid, sizeof(user.uid), uid);
-      copy_field(user.name, sizeof(user.name), name);
-      user.relay1 = relay1;
-      user.relay2 = relay2;
-      if (!suppress_save_) {
-        save();
-      }
-      return true;
+  if (find_slot(uid) != kNoSlot) {
+    return false;
+  }
+
+  // Keep the index at most 3/4 full (tombstones included).
+  if ((count_ + index_deleted_ + 1) * 4 > index_size_ * 3) {
+    if (!index_resize(index_size_ * 2)) {
+      index_rebuild();
+    }
+    if (count_ + 1 >= index_size_) {
+      return false;
     }
   }
 
-  return false;
+  size_t slot = alloc_slot();
+  if (slot == kNoSlot) {
+    return false;
+  }
+  UserSlot& user = slot_at(slot);
+  // Terms first: a visitor whose expiry or use limit cannot be stored must
+  // not be added as a permanent user.
+  if (!set_terms(slot, terms)) {
+    user.uid_lo = free_head_;
+    free_head_ = static_cast<uint32_t>(slot);
+    return false;
+  }
+  user.uid_lo = static_cast<uint32_t>(uid.value);
+  user.uid_hi = static_cast<uint32_t>(uid.value >> 32);
+  user.uid_len = uid.len;
+  user.groups = groups;
+  user.schedule = schedule;
+  user.name = names_.acquire(name);
+  index_insert(uid, slot);
+  bloom_add(uid);
+  count_++;
+  record_change('+', user);
+  if (!suppress_save_) {
+    append_journal('+', slot);
+  }
+  return true;
 }
 
 String UsersDb::to_text() const {
   String out;
-  if (!users_ || capacity_ == 0) {
-    return out;
-  }
+  char line[kUserLineMax];
   for (size_t i = 0; i < capacity_; ++i) {
-    const auto & user = users_[i];
-    if (!user.in_use) {
+    const UserSlot& user = slot_at(i);
+    if (user.uid_len == 0) {
       continue;
     }
-    out += user.uid;
-    out += '|';
-    out += user.name;
-    out += '|';
-    out += (user.relay1 ? '1' : '0');
-    out += '|';
-    out += (user.relay2 ? '1' : '0');
-    out += '\n';
+    format_line(i, line, sizeof(line));
+    out += line;
   }
   return out;
 }
@@ -188,128 +896,697 @@ bool UsersDb::import_text(const char* text) {
   if (!text) {
     return false;
   }
-  suppress_save_ = true;
-  clear();
-  String data(text);
-  int start = 0;
-  while (start < data.length()) {
-    int end = data.indexOf('\n', start);
-    if (end < 0) {
-      end = data.length();
-    }
-    String line = data.substring(start, end);
-    line.trim();
-    start = end + 1;
-    if (line.length() == 0) {
+  begin_import();
+  import_chunk(text, strlen(text));
+  return end_import(true);
+}
+
+bool UsersDb::update_user(const UidKey& uid, const char* name, uint32_t groups, uint8_t schedule,
+                          const UserTerms* terms) {
+  WriteGuard guard(*this);
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot) {
+    return false;
+  }
+  // Leaves the user as it was when the new terms cannot be stored.
+  if (!set_terms(slot, terms)) {
+    return false;
+  }
+  UserSlot& user = slot_at(slot);
+  // Acquire before release so an unchanged name keeps its arena entry.
+  uint16_t id = names_.acquire(name);
+  names_.release(user.name);
+  user.name = id;
+  user.groups = groups;
+  user.schedule = schedule;
+  record_change('+', user);
+  if (!suppress_save_) {
+    append_journal('+', slot);
+  }
+  return true;
+}
+
+bool UsersDb::parse_batch_line(const char* line, size_t len, UserBatchOp* out) {
+  if (!out) {
+    return false;
+  }
+  memset(out, 0, sizeof(*out));
+  out->result = BatchResult::Invalid;
+  while (len > 0 && (line[0] == ' ' || line[0] == '\t')) {
+    ++line;
+    --len;
+  }
+  while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) {
+    --len;
+  }
+  if (len < 2) {
+    return false;
+  }
+  char op = line[0];
+  if (op == '-') {
+    out->op = op;
+    return uid_parse(line + 1, len - 1, &out->uid);
+  }
+  if (op != '+' && op != '~') {
+    return false;
+  }
+  out->op = op;
+  return parse_user_line(line + 1, len - 1, &out->uid, out->name, sizeof(out->name), &out->groups, &out->schedule,
+                         &out->terms);
+}
+
+size_t UsersDb::apply_batch(UserBatchOp* ops, size_t count) {
+  WriteGuard guard(*this);
+  if (!ops) {
+    return 0;
+  }
+  if (LittleFS.begin()) {
+    batch_journal_ = LittleFS.open(kJournalPath, FILE_APPEND);
+    if (!batch_journal_) {
+      batch_journal_ = LittleFS.open(kJournalPath, FILE_WRITE);
+    }
+  }
+  size_t applied = 0;
+  for (size_t i = 0; i < count; ++i) {
+    UserBatchOp& op = ops[i];
+    if (!uid_valid(op.uid)) {
+      op.result = BatchResult::Invalid;
       continue;
     }
-    int p1 = line.indexOf('|');
-    int p2 = line.indexOf('|', p1 + 1);
-    int p3 = line.indexOf('|', p2 + 1);
-    if (p1 < 0 || p2 < 0 || p3 < 0) {
+    if (op.op == '+') {
+      if (find_slot(op.uid) != kNoSlot) {
+        op.result = BatchResult::Exists;
+      } else {
+        op.result = add_user(op.uid, op.name, op.groups, op.schedule, &op.terms) ? BatchResult::Ok : BatchResult::Full;
+      }
+    } else if (op.op == '~') {
+      if (find_slot(op.uid) == kNoSlot) {
+        op.result = BatchResult::NotFound;
+      } else {
+        op.result = update_user(op.uid, op.name, op.groups, op.schedule, &op.terms) ? BatchResult::Ok : BatchResult::Full;
+      }
+    } else if (op.op == '-') {
+      op.result = remove(op.uid) ? BatchResult::Ok : BatchResult::NotFound;
+    } else {
+      op.result = BatchResult::Invalid;
+    }
+    if (op.result == BatchResult::Ok) {
+      applied++;
+    }
+  }
+  if (batch_journal_) {
+    batch_journal_.close();
+  }
+  batch_journal_ = File();
+  return applied;
+}
+
+void UsersDb::record_change(char op, const UserSlot& user) {
+  generation_++;
+  ChangeEntry& entry = changes_[generation_ % kChangeLogSize];
+  entry.uid_lo = user.uid_lo;
+  entry.uid_hi = user.uid_hi;
+  entry.uid_len = user.uid_len;
+  entry.op = op;
+}
+
+bool UsersDb::remove(const UidKey& uid) {
+  WriteGuard guard(*this);
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot) {
+    return false;
+  }
+  index_remove(uid);
+  UserSlot& user = slot_at(slot);
+  record_change('-', user);
+  if (!suppress_save_) {
+    append_journal('-', slot);
+  }
+  set_terms(slot, nullptr);
+  names_.release(user.name);
+  bloom_stale_++;
+  UserUsage* usage = usage_at(slot, false);
+  if (usage) {
+    memset(usage, 0, sizeof(*usage));
+  }
+  user.uid_len = 0;
+  user.uid_hi = 0;
+  user.groups = 0;
+  user.schedule = 0;
+  user.name = NameStore::kEmpty;
+  user.uid_lo = free_head_;
+  free_head_ = static_cast<uint32_t>(slot);
+  count_--;
+  return true;
+}
+
+bool UsersDb::authorized(const UidKey& uid, uint32_t door_groups, uint32_t now) const {
+  bool allowed = false;
+  lookup(uid, door_groups, now, nullptr, &allowed);
+  return allowed;
+}
+
+bool UsersDb::get_user(const UidKey& uid, UserRecord* out) const {
+  if (!out || !bloom_may_contain(uid)) {
+    return false;
+  }
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot) {
+    return false;
+  }
+  fill_record(slot_at(slot), out);
+  return true;
+}
+
+bool UsersDb::lookup(const UidKey& uid, uint32_t door_groups, uint32_t now, UserRecord* out, bool* allowed) const {
+  if (allowed) {
+    *allowed = false;
+  }
+  if (!bloom_may_contain(uid)) {
+    bloom_rejected_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot) {
+    bloom_false_positives_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  const UserSlot& user = slot_at(slot);
+  if (out) {
+    fill_record(user, out);
+  }
+  if (allowed) {
+    *allowed = (user.groups & door_groups) != 0 && terms_allow(slot, now);
+  }
+  return true;
+}
+
+UserUsage* UsersDb::usage_at(size_t slot, bool create) {
+  size_t chunk = slot / kChunkUsers;
+  if (chunk >= chunk_count_) {
+    return nullptr;
+  }
+  if (!usage_chunks_[chunk]) {
+    const size_t bytes = sizeof(UserUsage) * kChunkUsers;
+    if (!create || ESP.getFreeHeap() < kHeapReserve + bytes) {
+      return nullptr;
+    }
+    auto* usage = static_cast<UserUsage*>(calloc(kChunkUsers, sizeof(UserUsage)));
+    if (!usage) {
+      return nullptr;
+    }
+    WriteGuard guard(*this);
+    usage_chunks_[chunk] = usage;
+  }
+  return &usage_chunks_[chunk][slot % kChunkUsers];
+}
+
+const UserUsage* UsersDb::usage_at(size_t slot) const {
+  size_t chunk = slot / kChunkUsers;
+  if (chunk >= chunk_count_ || !usage_chunks_[chunk]) {
+    return nullptr;
+  }
+  return &usage_chunks_[chunk][slot % kChunkUsers];
+}
+
+void UsersDb::record_use(const UidKey& uid, uint8_t door, bool allowed, const RtcDateTime* now) {
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot) {
+    return;
+  }
+  TermsSlot* terms = terms_at(slot, false);
+  if (allowed && terms && (terms->flags & kTermsLimited) && terms->uses_left > 0) {
+    WriteGuard guard(*this);
+    terms->uses_left--;
+    record_change('+', slot_at(slot));
+    if (!(terms->flags & kTermsUnjournaled)) {
+      terms->flags |= kTermsUnjournaled;
+      terms_unjournaled_++;
+    }
+    if (terms->uses_left == 0) {
+      terms_unlink(slot);
+      terms_link(slot, kPurgeList);
+    }
+  }
+  UserUsage* usage = usage_at(slot, true);
+  if (!usage) {
+    return;
+  }
+  if (now) {
+    uint16_t month = static_cast<uint16_t>(now->year * 12 + now->month - 1);
+    if (usage->month != month) {
+      usage->uses[0] = 0;
+      usage->uses[1] = 0;
+      usage->denied = 0;
+      usage->month = month;
+    }
+    if (allowed) {
+      usage->last_seen = rtc_to_epoch(*now);
+    }
+  }
+  if (!allowed) {
+    if (usage->denied < UINT16_MAX) {
+      usage->denied++;
+    }
+  } else if ((door == 1 || door == 2) && usage->uses[door - 1] < UINT16_MAX) {
+    usage->uses[door - 1]++;
+  }
+  usage_dirty_ = true;
+}
+
+bool UsersDb::flush_terms() {
+  if (terms_unjournaled_ == 0) {
+    return true;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < capacity_ && terms_unjournaled_ > 0; ++i) {
+    TermsSlot* terms = terms_at(i, false);
+    if (!terms || !(terms->flags & kTermsUnjournaled)) {
       continue;
     }
-    String uid = line.substring(0, p1);
-    String name = line.substring(p1 + 1, p2);
-    String d1 = line.substring(p2 + 1, p3);
-    String d2 = line.substring(p3 + 1);
-    add_user(uid.c_str(), name.c_str(), parse_bool(d1.c_str()), parse_bool(d2.c_str()));
+    terms->flags &= ~kTermsUnjournaled;
+    terms_unjournaled_--;
+    if (slot_at(i).uid_len != 0) {
+      ok = append_journal('+', i) && ok;
+    }
   }
-  suppress_save_ = false;
-  return save();
+  // Flags dropped with a removed user's terms leave the count behind.
+  terms_unjournaled_ = 0;
+  return ok;
 }
 
-bool UsersDb::remove(const char* uid) {
-  if (!uid || uid[0] == '\0') {
+bool UsersDb::flush_usage() {
+  if (!LittleFS.begin()) {
     return false;
   }
-  if (!users_ || capacity_ == 0) {
+  File file = LittleFS.open(kUsageTmpPath, FILE_WRITE);
+  if (!file) {
     return false;
   }
-  for (size_t i = 0; i < capacity_; ++i) {
-    auto & user = users_[i];
-    if (user.in_use && strcmp(user.uid, uid) == 0) {
-      user.in_use = false;
-      user.uid[0] = '\0';
-      user.name[0] = '\0';
-      user.relay1 = false;
-      user.relay2 = false;
-      if (!suppress_save_) {
-        save();
-      }
-      return true;
+  uint32_t magic = kUsageMagic;
+  bool ok = file.write(reinterpret_cast<const uint8_t*>(&magic), sizeof(magic)) == sizeof(magic);
+  for (size_t i = 0; ok && i < capacity_; ++i) {
+    const UserSlot& user = slot_at(i);
+    const UserUsage* usage = usage_at(i);
+    if (user.uid_len == 0 || !usage || (usage->last_seen == 0 && usage->month == 0 && usage->denied == 0 &&
+                                        usage->uses[0] == 0 && usage->uses[1] == 0)) {
+      continue;
     }
+    UsageFileRecord record{};
+    record.uid_lo = user.uid_lo;
+    record.uid_hi = user.uid_hi;
+    record.uid_len = user.uid_len;
+    record.usage = *usage;
+    ok = file.write(reinterpret_cast<const uint8_t*>(&record), sizeof(record)) == sizeof(record);
+  }
+  file.close();
+  if (!ok || !LittleFS.rename(kUsageTmpPath, kUsagePath)) {
+    LittleFS.remove(kUsageTmpPath);
+    return false;
   }
-  return false;
+  usage_dirty_ = false;
+  usage_flushed_ms_ = millis();
+  return true;
 }
 
-bool UsersDb::authorized(const char* uid, uint8_t relay_id) const {
-  if (!uid || uid[0] == '\0') {
+bool UsersDb::flush_usage_if_due(uint32_t now_ms) {
+  if (!usage_dirty_ || now_ms - usage_flushed_ms_ < kUsageFlushMs) {
+    return true;
+  }
+  return flush_usage();
+}
+
+bool UsersDb::load_usage() {
+  usage_dirty_ = false;
+  usage_flushed_ms_ = millis();
+  if (!LittleFS.exists(kUsagePath)) {
+    return true;
+  }
+  File file = LittleFS.open(kUsagePath, FILE_READ);
+  if (!file) {
     return false;
   }
-  if (!users_ || capacity_ == 0) {
+  uint32_t magic = 0;
+  if (file.read(reinterpret_cast<uint8_t*>(&magic), sizeof(magic)) != sizeof(magic) || magic != kUsageMagic) {
+    file.close();
     return false;
   }
-  for (size_t i = 0; i < capacity_; ++i) {
-    const auto & user = users_[i];
-    if (user.in_use && strcmp(user.uid, uid) == 0) {
-      if (relay_id == 1) {
-        return user.relay1;
-      }
-      if (relay_id == 2) {
-        return user.relay2;
-      }
-      return false;
+  UsageFileRecord record{};
+  while (file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record)) {
+    UidKey key{(static_cast<uint64_t>(record.uid_hi) << 32) | record.uid_lo, record.uid_len};
+    size_t slot = find_slot(key);
+    UserUsage* usage = slot != kNoSlot ? usage_at(slot, true) : nullptr;
+    if (usage) {
+      *usage = record.usage;
     }
   }
-  return false;
+  file.close();
+  return true;
 }
 
-bool UsersDb::get_user(const char* uid, UserRecord* out) const {
-  if (!uid || uid[0] == '\0' || !out) {
+bool UsersDb::user_json(const UidKey& uid, char* out, size_t out_len) const {
+  size_t slot = find_slot(uid);
+  if (slot == kNoSlot || !out || out_len < 3) {
     return false;
   }
-  if (!users_ || capacity_ == 0) {
+  out[0] = '{';
+  size_t len = format_json(slot, out + 1, out_len - 2);
+  if (len == 0) {
     return false;
   }
-  for (size_t i = 0; i < capacity_; ++i) {
-    const auto & user = users_[i];
-    if (user.in_use && strcmp(user.uid, uid) == 0) {
-      *out = user;
-      return true;
+  out[len + 1] = '}';
+  out[len + 2] = '\0';
+  return true;
+}
+
+size_t UsersDb::top_usage(uint16_t month, UserUsageRank* out, size_t max) const {
+  size_t filled = 0;
+  for (size_t i = 0; i < capacity_ && max > 0; ++i) {
+    const UserSlot& user = slot_at(i);
+    const UserUsage* usage = usage_at(i);
+    if (user.uid_len == 0 || !usage || usage->month != month) {
+      continue;
+    }
+    uint32_t granted = static_cast<uint32_t>(usage->uses[0]) + usage->uses[1];
+    uint32_t total = granted + usage->denied;
+    if (total == 0 || (filled == max && total <= static_cast<uint32_t>(out[max - 1].granted) + out[max - 1].denied)) {
+      continue;
+    }
+    // Insertion into the short sorted list; the last entry falls off when full.
+    size_t at = filled < max ? filled++ : max - 1;
+    while (at > 0 && static_cast<uint32_t>(out[at - 1].granted) + out[at - 1].denied < total) {
+      out[at] = out[at - 1];
+      --at;
     }
+    out[at].uid = slot_key(user);
+    out[at].granted = granted > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(granted);
+    out[at].denied = usage->denied;
   }
-  return false;
+  return filled;
 }
 
-String UsersDb::to_json() const {
-  String json = "{\"users\":[";
-  bool first = true;
-  if (!users_ || capacity_ == 0) {
-    json += "]}";
-    return json;
+UsersDb::TermsSlot* UsersDb::terms_at(size_t slot, bool create) {
+  size_t chunk = slot / kChunkUsers;
+  if (chunk >= chunk_count_) {
+    return nullptr;
+  }
+  if (!terms_chunks_[chunk]) {
+    const size_t bytes = sizeof(TermsSlot) * kChunkUsers;
+    if (!create || ESP.getFreeHeap() < kHeapReserve + bytes) {
+      return nullptr;
+    }
+    auto* terms = static_cast<TermsSlot*>(calloc(kChunkUsers, sizeof(TermsSlot)));
+    if (!terms) {
+      return nullptr;
+    }
+    terms_chunks_[chunk] = terms;
+  }
+  return &terms_chunks_[chunk][slot % kChunkUsers];
+}
+
+const UsersDb::TermsSlot* UsersDb::terms_at(size_t slot) const {
+  size_t chunk = slot / kChunkUsers;
+  if (chunk >= chunk_count_ || !terms_chunks_[chunk]) {
+    return nullptr;
+  }
+  return &terms_chunks_[chunk][slot % kChunkUsers];
+}
+
+bool UsersDb::set_terms(size_t slot, const UserTerms* terms) {
+  bool timed = terms && terms->any();
+  TermsSlot* t = terms_at(slot, timed);
+  if (!t) {
+    // No chunk: fine for a permanent user, which has nothing to clear.
+    return !timed;
+  }
+  terms_unlink(slot);
+  memset(t, 0, sizeof(*t));
+  if (!timed) {
+    return true;
+  }
+  t->valid_from = terms->valid_from;
+  t->valid_until = terms->valid_until;
+  t->uses_left = terms->uses_left;
+  t->flags = kTermsActive | (terms->limited_uses ? kTermsLimited : 0);
+  if (terms->limited_uses && terms->uses_left == 0) {
+    terms_link(slot, kPurgeList);
+  } else {
+    wheel_place(slot);
   }
+  return true;
+}
+
+bool UsersDb::terms_allow(size_t slot, uint32_t now) const {
+  const TermsSlot* t = terms_at(slot);
+  if (!t || !(t->flags & kTermsActive)) {
+    return true;
+  }
+  if ((t->flags & kTermsLimited) && t->uses_left == 0) {
+    return false;
+  }
+  if (t->valid_from == 0 && t->valid_until == 0) {
+    return true;
+  }
+  if (now == 0 || now < t->valid_from) {
+    return false;
+  }
+  return t->valid_until == 0 || now < t->valid_until;
+}
+
+void UsersDb::terms_link(size_t slot, uint8_t list) {
+  TermsSlot* t = terms_at(slot, false);
+  if (!t) {
+    return;
+  }
+  t->prev = kNoLink;
+  t->next = wheel_[list];
+  if (t->next != kNoLink) {
+    terms_at(t->next, false)->prev = static_cast<uint16_t>(slot);
+  }
+  wheel_[list] = static_cast<uint16_t>(slot);
+  t->bucket = list;
+  t->flags |= kTermsLinked;
+}
+
+void UsersDb::terms_unlink(size_t slot) {
+  TermsSlot* t = terms_at(slot, false);
+  if (!t || !(t->flags & kTermsLinked)) {
+    return;
+  }
+  if (t->prev != kNoLink) {
+    terms_at(t->prev, false)->next = t->next;
+  } else {
+    wheel_[t->bucket] = t->next;
+  }
+  if (t->next != kNoLink) {
+    terms_at(t->next, false)->prev = t->prev;
+  }
+  t->flags &= static_cast<uint8_t>(~kTermsLinked);
+}
+
+void UsersDb::wheel_place(size_t slot) {
+  TermsSlot* t = terms_at(slot, false);
+  if (!t || t->valid_until == 0) {
+    return;
+  }
+  if (wheel_tick_ == 0) {
+    terms_link(slot, kPendingList);
+    return;
+  }
+  // Due at the first whole minute at or after valid_until.
+  uint32_t due = t->valid_until / 60 + (t->valid_until % 60 ? 1 : 0);
+  if (due <= wheel_tick_) {
+    terms_link(slot, kPurgeList);
+    return;
+  }
+  // Lowest level whose slot for due lies within one turn of now.
+  for (size_t level = 0; level < kWheelLevels; ++level) {
+    const size_t shift = level * kWheelBits;
+    uint32_t distance = (due >> shift) - (wheel_tick_ >> shift);
+    if (distance < kWheelSlots || level == kWheelLevels - 1) {
+      uint32_t target = distance < kWheelSlots ? (due >> shift) : (wheel_tick_ >> shift) + kWheelSlots - 1;
+      terms_link(slot, static_cast<uint8_t>(level * kWheelSlots + (target & (kWheelSlots - 1))));
+      return;
+    }
+  }
+}
+
+void UsersDb::wheel_cascade(uint8_t bucket) {
+  uint16_t slot = wheel_[bucket];
+  wheel_[bucket] = kNoLink;
+  while (slot != kNoLink) {
+    TermsSlot* t = terms_at(slot, false);
+    uint16_t next = t->next;
+    t->flags &= static_cast<uint8_t>(~kTermsLinked);
+    wheel_place(slot);
+    slot = next;
+  }
+}
+
+void UsersDb::wheel_advance(uint32_t tick) {
+  if (wheel_tick_ == 0) {
+    wheel_tick_ = tick;
+    wheel_cascade(kPendingList);
+    return;
+  }
+  if (tick <= wheel_tick_) {
+    return;
+  }
+  if (tick - wheel_tick_ > kWheelSlots * kWheelSlots) {
+    // The clock jumped (e.g. set after a long outage): re-file everything
+    // queued at the new time instead of stepping through every minute.
+    for (uint8_t bucket = 0; bucket < kWheelBuckets; ++bucket) {
+      while (wheel_[bucket] != kNoLink) {
+        uint16_t slot = wheel_[bucket];
+        terms_unlink(slot);
+        terms_link(slot, kPendingList);
+      }
+    }
+    wheel_tick_ = tick;
+    wheel_cascade(kPendingList);
+    return;
+  }
+  while (wheel_tick_ < tick) {
+    ++wheel_tick_;
+    if ((wheel_tick_ & (kWheelSlots - 1)) == 0) {
+      if (((wheel_tick_ >> kWheelBits) & (kWheelSlots - 1)) == 0) {
+        wheel_cascade(static_cast<uint8_t>(2 * kWheelSlots + ((wheel_tick_ >> (2 * kWheelBits)) & (kWheelSlots - 1))));
+      }
+      wheel_cascade(static_cast<uint8_t>(kWheelSlots + ((wheel_tick_ >> kWheelBits) & (kWheelSlots - 1))));
+    }
+    // Entries in the current level-0 slot are due now; wheel_place moves
+    // them to the purge list.
+    wheel_cascade(static_cast<uint8_t>(wheel_tick_ & (kWheelSlots - 1)));
+  }
+}
+
+size_t UsersDb::expire(uint32_t now) {
+  if (now != 0) {
+    wheel_advance(now / 60);
+  }
+  if (wheel_[kPurgeList] == kNoLink) {
+    return 0;
+  }
+  WriteGuard guard(*this);
+  if (LittleFS.begin()) {
+    batch_journal_ = LittleFS.open(kJournalPath, FILE_APPEND);
+    if (!batch_journal_) {
+      batch_journal_ = LittleFS.open(kJournalPath, FILE_WRITE);
+    }
+  }
+  size_t purged = 0;
+  while (wheel_[kPurgeList] != kNoLink && purged < kPurgeBatch) {
+    size_t slot = wheel_[kPurgeList];
+    if (!remove(slot_key(slot_at(slot)))) {
+      // Not a live user any more; just drop the entry.
+      terms_unlink(slot);
+      continue;
+    }
+    purged++;
+  }
+  if (batch_journal_) {
+    batch_journal_.close();
+  }
+  batch_journal_ = File();
+  return purged;
+}
+
+size_t UsersDb::cursor_at(size_t offset) const {
   for (size_t i = 0; i < capacity_; ++i) {
-    const auto & user = users_[i];
-    if (!user.in_use) {
+    if (slot_at(i).uid_len == 0) {
       continue;
     }
-    if (!first) {
-      json += ',';
-    }
-    first = false;
-    json += "{\"uid\":\"";
-    json += user.uid;
-    json += "\",\"name\":\"";
-    json += user.name;
-    json += "\",\"relay1\":";
-    json += (user.relay1 ? "true" : "false");
-    json += ",\"relay2\":";
-    json += (user.relay2 ? "true" : "false");
-    json += '}';
-  }
-  json += "]}";
-  return json;
+    if (offset == 0) {
+      return i;
+    }
+    --offset;
+  }
+  return capacity_;
+}
+
+size_t UsersDb::page_json(size_t cursor, size_t limit, char* out, size_t out_len, size_t* next) const {
+  size_t written = 0;
+  size_t count = 0;
+  size_t i = cursor;
+  char fields[kJsonFieldsMax];
+  if (!out || out_len == 0) {
+    return 0;
+  }
+  out[0] = '\0';
+  for (; i < capacity_ && count < limit; ++i) {
+    const UserSlot& user = slot_at(i);
+    if (user.uid_len == 0) {
+      continue;
+    }
+    if (format_json(i, fields, sizeof(fields)) == 0) {
+      continue;
+    }
+    int len = snprintf(out + written, out_len - written, "%s{%s}", count > 0 ? "," : "", fields);
+    if (len < 0 || static_cast<size_t>(len) >= out_len - written) {
+      // Out of room: drop the partial record and resume from it next page.
+      out[written] = '\0';
+      break;
+    }
+    written += static_cast<size_t>(len);
+    count++;
+  }
+  if (next) {
+    *next = i < capacity_ ? i : kPageEnd;
+  }
+  return written;
+}
+
+bool UsersDb::changes_json(uint32_t since, char* out, size_t out_len) const {
+  if (!out || out_len == 0) {
+    return false;
+  }
+  if (since < change_floor_ || since > generation_ || generation_ - since > kChangeLogSize) {
+    snprintf(out, out_len, "{\"generation\":%lu,\"resync\":true}", static_cast<unsigned long>(generation_));
+    return false;
+  }
+  // Reserve room for the closing fields; "generation" is the last change
+  // included, so a client that gets "more":true continues from there.
+  static constexpr size_t kTailMax = 48;
+  if (out_len < kTailMax + 16) {
+    out[0] = '\0';
+    return false;
+  }
+  size_t limit = out_len - kTailMax;
+  size_t written = static_cast<size_t>(snprintf(out, limit, "{\"changes\":["));
+  uint32_t upto = since;
+  bool first = true;
+  char uid[kUidTextLen];
+  char fields[kJsonFieldsMax];
+  for (uint32_t gen = since + 1; gen <= generation_; ++gen) {
+    const ChangeEntry& entry = changes_[gen % kChangeLogSize];
+    UidKey key{(static_cast<uint64_t>(entry.uid_hi) << 32) | entry.uid_lo, entry.uid_len};
+    uid_format(key, uid, sizeof(uid));
+    const char* sep = first ? "" : ",";
+    int len = 0;
+    size_t slot = entry.op == '+' ? find_slot(key) : kNoSlot;
+    if (slot != kNoSlot) {
+      // Adds are reported with the user's current state; entries are
+      // applied in order, so a later removal still wins.
+      if (format_json(slot, fields, sizeof(fields)) == 0) {
+        upto = gen;
+        continue;
+      }
+      len = snprintf(out + written, limit - written, "%s{\"op\":\"add\",%s}", sep, fields);
+    } else if (entry.op == '-') {
+      len = snprintf(out + written, limit - written, "%s{\"op\":\"del\",\"uid\":\"%s\"}", sep, uid);
+    }
+    if (len < 0 || static_cast<size_t>(len) >= limit - written) {
+      break;
+    }
+    if (len > 0) {
+      written += static_cast<size_t>(len);
+      first = false;
+    }
+    upto = gen;
+  }
+  snprintf(out + written, out_len - written, "],\"generation\":%lu,\"more\":%s}", static_cast<unsigned long>(upto),
+           upto < generation_ ? "true" : "false");
+  return true;
 }
 
 } // namespace app
@@ -1,36 +1,373 @@
 #pragma once
 
 #include <Arduino.h>
+#include <FS.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "name_store.h"
+#include "rtc.h"
+#include "schedule.h"
+#include "uid.h"
 
 namespace app {
 
+// Access is a group mask: a user may pass a door when the two masks share a
+// bit. The old relay1/relay2 flags are groups 0 and 1, which are also the
+// default groups of the two doors.
+constexpr uint32_t kGroupRelay1 = 0x01;
+constexpr uint32_t kGroupRelay2 = 0x02;
+// Longest user line in users.txt, the journal, imports and /users/batch:
+// a 16-digit UID, a 31-character name and every optional field.
+constexpr size_t kUserLineMax = 128;
+
+// Accepts decimal or 0x-prefixed hex.
+bool parse_group_mask(const char* text, size_t len, uint32_t* out);
+// Escapes " and \ for a JSON string and blanks control characters; out
+// needs twice the input length plus one.
+void json_escape(const char* in, char* out, size_t out_len);
+
+// Per-user audit counters, kept beside the slot table and flushed to
+// /usage.bin periodically rather than on every swipe.
+struct UserUsage {
+  uint32_t last_seen; // unix time of the last granted swipe, 0 = never or no clock
+  uint16_t uses[2];   // granted swipes per door during month
+  uint16_t denied;    // denied swipes during month
+  uint16_t month;     // year * 12 + month - 1, 0 = no clock yet
+};
+
+struct UserUsageRank {
+  UidKey uid;
+  uint16_t granted; // both doors
+  uint16_t denied;
+};
+
+// Validity window and use limit for temporary (visitor) credentials.
+struct UserTerms {
+  uint32_t valid_from;  // unix time, 0 = no start
+  uint32_t valid_until; // unix time, 0 = no end
+  uint16_t uses_left;
+  bool limited_uses;
+
+  bool any() const {
+    return valid_from != 0 || valid_until != 0 || limited_uses;
+  }
+};
+
 struct UserRecord {
+  uint64_t uid;
+  uint8_t uid_len;
   bool in_use;
-  char uid[20];
+  uint32_t groups;
+  uint8_t schedule;
+  char name[32];
+
+  UidKey key() const {
+    return UidKey{uid, uid_len};
+  }
+};
+
+enum class BatchResult : uint8_t {
+  Ok,
+  Invalid,
+  Exists,
+  NotFound,
+  Full
+};
+
+// Negative-lookup filter figures for /status. rejected and false_positives
+// count swipes (UsersDb::lookup), not page views: rejected were turned away
+// by the filter, false_positives passed it but had no user.
+struct UserFilterStats {
+  uint32_t bytes;
+  uint32_t bits_set;
+  uint32_t bits;
+  uint8_t hashes;
+  float estimated_fp;
+  uint32_t rejected;
+  uint32_t false_positives;
+};
+
+// One line of a /users/batch body in users.txt line format: "+uid|name|..."
+// adds, "~uid|name|..." updates and "-uid" deletes. result is filled in by
+// UsersDb::apply_batch().
+struct UserBatchOp {
+  UidKey uid;
   char name[32];
-  bool relay1;
-  bool relay2;
+  char op;
+  uint8_t schedule;
+  uint32_t groups;
+  UserTerms terms;
+  BatchResult result;
 };
 
 class UsersDb {
  public:
   void init();
   bool load();
-  bool save() const;
-  bool add_user(const char* uid, const char* name, bool relay1, bool relay2);
+  // Writes the snapshot on the calling task and drops both journals.
+  bool save();
+  // Idle-time upkeep on logic_task: rebuilds a stale Bloom filter and, once
+  // the journal holds kJournalCompactAt records, moves it aside as the old
+  // journal and asks the storage task for a new snapshot. The snapshot is
+  // never written here, so swipes do not wait for it.
+  bool compact_if_needed();
+  // Storage task side: writes the snapshot compact_if_needed() asked for,
+  // reading the table a page at a time under the read lock so logic_task
+  // keeps journaling meanwhile. A save(), load() or clear() in between
+  // voids it. True when there was nothing to do or it was written.
+  bool write_snapshot_if_requested();
+  // terms may be null for a permanent user. add_user() and update_user()
+  // fail, changing nothing, when timed terms cannot be stored.
+  bool add_user(const UidKey& uid, const char* name, uint32_t groups, uint8_t schedule, const UserTerms* terms);
   void clear();
-  bool remove(const char* uid);
-  bool authorized(const char* uid, uint8_t relay_id) const;
-  bool get_user(const char* uid, UserRecord* out) const;
-  String to_json() const;
+  bool remove(const UidKey& uid);
+  bool update_user(const UidKey& uid, const char* name, uint32_t groups, uint8_t schedule, const UserTerms* terms);
+  // Applies ops in order, writing their journal records through a single
+  // open file. Returns the number that succeeded.
+  size_t apply_batch(UserBatchOp* ops, size_t count);
+  static bool parse_batch_line(const char* line, size_t len, UserBatchOp* out);
+  // now is unix time, or 0 without a valid clock (time-bound users are
+  // then refused).
+  bool authorized(const UidKey& uid, uint32_t door_groups, uint32_t now) const;
+  // For display; leaves the filter counters alone.
+  bool get_user(const UidKey& uid, UserRecord* out) const;
+  // The swipe path: also counts the filter's rejections and false positives.
+  bool lookup(const UidKey& uid, uint32_t door_groups, uint32_t now, UserRecord* out, bool* allowed) const;
+  size_t count() const { return count_; }
+  void filter_stats(UserFilterStats* out) const;
+
+  // Swipe bookkeeping in RAM; now is null when the clock is not valid.
+  // Counters roll over when the month changes. A granted swipe also uses
+  // up one of a use-limited user's uses, which flush_terms() journals.
+  void record_use(const UidKey& uid, uint8_t door, bool allowed, const RtcDateTime* now);
+  // Journals the uses_left counts record_use() changed. Called when
+  // logic_task is idle, so no swipe waits for the file write.
+  bool flush_terms();
+  bool flush_usage();
+  // Flushes when counters changed and kUsageFlushMs has passed.
+  bool flush_usage_if_due(uint32_t now_ms);
+  // Renders one user's JSON object (fields and usage); false if unknown.
+  bool user_json(const UidKey& uid, char* out, size_t out_len) const;
+  // Up to max users with the most swipes in month (year * 12 + month - 1),
+  // most first, from the usage counters. Returns the number filled.
+  size_t top_usage(uint16_t month, UserUsageRank* out, size_t max) const;
+
+  // Advances the expiry wheel to now (unix time) and removes up to
+  // kPurgeBatch expired or used-up users through one journal write.
+  // Returns the number removed.
+  size_t expire(uint32_t now);
+
+  // Readers on other tasks bracket their access with read_lock() and
+  // read_unlock(); the logic task is the only writer and needs neither.
+  // Readers never block the writer for longer than one in-flight read and
+  // never touch logic_queue.
+  void read_lock() const;
+  void read_unlock() const;
+
+  // Paging over the slot table. A cursor is a slot index, so it stays valid
+  // across adds and removes; kPageEnd marks the end of the table.
+  static constexpr size_t kPageEnd = static_cast<size_t>(-1);
+  size_t cursor_at(size_t offset) const;
+  // Renders up to limit users starting at cursor as comma-separated JSON
+  // objects, stopping early rather than splitting a record. Returns bytes
+  // written and the cursor to resume from.
+  size_t page_json(size_t cursor, size_t limit, char* out, size_t out_len, size_t* next) const;
+
+  // Every mutation bumps the generation and is remembered in a small ring,
+  // so clients can fetch only what changed since a generation they saw.
+  uint32_t generation() const { return generation_; }
+  // Renders {"generation":G,"changes":[...],"more":bool} for changes after
+  // since, or {"generation":G,"resync":true} when the ring no longer covers
+  // them. Returns false in the resync case.
+  bool changes_json(uint32_t since, char* out, size_t out_len) const;
   String to_text() const;
   bool import_text(const char* text);
 
+  // Streaming bulk import of users.txt-format text. begin_import() empties
+  // the table, import_chunk() accepts arbitrary pieces of the body and
+  // end_import() either writes one snapshot or reloads the stored table.
+  void begin_import();
+  void import_chunk(const char* data, size_t len);
+  bool end_import(bool commit);
+
  private:
-  static constexpr size_t kMaxUsers = 1000;
-  UserRecord* users_ = nullptr;
+  // Body of save(), under snapshot_mutex_.
+  bool write_snapshot();
+
+  // Hot per-user data, 16 bytes so a probe touches one slot and stays
+  // 4-byte aligned. Names live in names_ and are referenced by id.
+  struct UserSlot {
+    uint32_t uid_lo;
+    uint32_t uid_hi;
+    uint32_t groups;
+    uint8_t uid_len; // 0 = free; uid_lo then links the free list
+    uint8_t schedule;
+    uint16_t name;
+  };
+
+  // format_json() output at its longest: about 110 bytes of keys, a 16-digit
+  // UID, a fully escaped name, 10-digit numbers and 80 bytes of terms.
+  static constexpr size_t kJsonFieldsMax = 384;
+  static constexpr size_t kMaxUsers = 20000;
+  static constexpr size_t kChunkUsers = 512;
+  static constexpr size_t kMaxChunks = (kMaxUsers + kChunkUsers - 1) / kChunkUsers;
+  static constexpr size_t kInitialIndexSize = 1024;
+  static constexpr size_t kHeapReserve = 24 * 1024;
+  static constexpr uint16_t kIndexEmpty = 0xFFFF;
+  static constexpr uint16_t kIndexDeleted = 0xFFFE;
+  static constexpr uint32_t kNoSlot = 0xFFFFFFFF;
+  static constexpr size_t kChangeLogSize = 128;
+  // 8 bits and 5 probes per slot of capacity: about 2% false positives
+  // with the table full, less while it still has free slots.
+  static constexpr size_t kBloomBitsPerUser = 8;
+  static constexpr uint8_t kBloomHashes = 5;
+  static constexpr uint32_t kUsageFlushMs = 15 * 60 * 1000;
+  // Hierarchical timing wheel over minutes: 3 levels of 64 slots reach
+  // 64^3 minutes (~182 days); later expiries park in the last level and
+  // are re-placed as it turns.
+  static constexpr size_t kWheelBits = 6;
+  static constexpr size_t kWheelSlots = 1 << kWheelBits;
+  static constexpr size_t kWheelLevels = 3;
+  static constexpr size_t kWheelBuckets = kWheelLevels * kWheelSlots;
+  static constexpr uint8_t kPurgeList = kWheelBuckets;
+  static constexpr uint8_t kPendingList = kWheelBuckets + 1;
+  static constexpr uint16_t kNoLink = 0xFFFF;
+  static constexpr size_t kPurgeBatch = 32;
+  static_assert(kMaxChunks * kChunkUsers < kNoLink, "slot numbers must fit the wheel links");
+
+  // Held by every mutating entry point; nests.
+  class WriteGuard {
+   public:
+    explicit WriteGuard(UsersDb& db);
+    ~WriteGuard();
+
+   private:
+    UsersDb& db_;
+  };
+
+  // Terms of a temporary user plus its links in one wheel bucket, the
+  // purge list or the pending list (used until the clock is known).
+  struct TermsSlot {
+    uint32_t valid_from;
+    uint32_t valid_until;
+    uint16_t uses_left;
+    uint16_t next;
+    uint16_t prev;
+    uint8_t flags;
+    uint8_t bucket;
+  };
+  static constexpr uint8_t kTermsActive = 0x01;
+  static constexpr uint8_t kTermsLimited = 0x02;
+  static constexpr uint8_t kTermsLinked = 0x04;
+  static constexpr uint8_t kTermsUnjournaled = 0x08; // uses_left changed since the last journal write
+
+  // One ring entry per generation; the entry for generation g lives at
+  // changes_[g % kChangeLogSize].
+  struct ChangeEntry {
+    uint32_t uid_lo;
+    uint32_t uid_hi;
+    uint8_t uid_len;
+    char op; // '+' added or updated, '-' removed
+  };
+
+  UserSlot& slot_at(size_t slot) const {
+    return chunks_[slot / kChunkUsers][slot % kChunkUsers];
+  }
+  static bool slot_matches(const UserSlot& s, const UidKey& uid) {
+    return s.uid_len == uid.len && s.uid_lo == static_cast<uint32_t>(uid.value) &&
+           s.uid_hi == static_cast<uint32_t>(uid.value >> 32);
+  }
+  static UidKey slot_key(const UserSlot& s) {
+    return UidKey{(static_cast<uint64_t>(s.uid_hi) << 32) | s.uid_lo, s.uid_len};
+  }
+  void fill_record(const UserSlot& s, UserRecord* out) const;
+  size_t format_line(size_t slot, char* out, size_t out_len) const;
+  size_t format_json(size_t slot, char* out, size_t out_len) const;
+  bool append_journal(char op, size_t slot);
+  void record_change(char op, const UserSlot& user);
+  void apply_line(const char* line, size_t len);
+  size_t load_file(const char* path);
+  size_t alloc_slot();
+  bool add_chunk();
+
+  // Open-addressing (linear probe) index from UID hash to slot number.
+  size_t find_slot(const UidKey& uid) const;
+  void index_insert(const UidKey& uid, size_t slot);
+  void index_remove(const UidKey& uid);
+  bool index_resize(size_t size);
+  void index_rebuild();
+
+  // Bloom filter over the stored UIDs so unknown cards are turned away
+  // without probing the index. Removals leave stale bits until the next
+  // rebuild, which only costs false positives.
+  void bloom_resize(size_t users);
+  void bloom_rebuild();
+  void bloom_add(const UidKey& uid);
+  bool bloom_may_contain(const UidKey& uid) const;
+
+  // Usage chunks parallel the slot chunks and are allocated on first use.
+  UserUsage* usage_at(size_t slot, bool create);
+  const UserUsage* usage_at(size_t slot) const;
+  bool load_usage();
+
+  TermsSlot* terms_at(size_t slot, bool create);
+  const TermsSlot* terms_at(size_t slot) const;
+  // False, with nothing changed, when timed terms need a terms chunk that
+  // cannot be allocated.
+  bool set_terms(size_t slot, const UserTerms* terms);
+  bool terms_allow(size_t slot, uint32_t now) const;
+  void terms_link(size_t slot, uint8_t list);
+  void terms_unlink(size_t slot);
+  // Files a timed user into the bucket for its expiry minute.
+  void wheel_place(size_t slot);
+  void wheel_cascade(uint8_t bucket);
+  void wheel_advance(uint32_t tick);
+
+  UserSlot* chunks_[kMaxChunks] = {nullptr};
+  size_t chunk_count_ = 0;
   size_t capacity_ = 0;
+  size_t count_ = 0;
+  uint32_t free_head_ = kNoSlot;
+  NameStore names_;
+  uint16_t* index_ = nullptr;
+  size_t index_size_ = 0;
+  size_t index_deleted_ = 0;
+  uint8_t* bloom_ = nullptr;
+  size_t bloom_bits_ = 0;
+  size_t bloom_set_ = 0;
+  size_t bloom_stale_ = 0;
+  mutable std::atomic<uint32_t> bloom_rejected_{0};
+  mutable std::atomic<uint32_t> bloom_false_positives_{0};
+  UserUsage* usage_chunks_[kMaxChunks] = {nullptr};
+  bool usage_dirty_ = false;
+  uint32_t usage_flushed_ms_ = 0;
+  TermsSlot* terms_chunks_[kMaxChunks] = {nullptr};
+  size_t terms_unjournaled_ = 0;
+  uint16_t wheel_[kWheelBuckets + 2];
+  uint32_t wheel_tick_ = 0; // minutes since the epoch, 0 = clock not seen yet
+  size_t journal_entries_ = 0; // records since the last snapshot or request
+  std::atomic<bool> snapshot_requested_{false};
+  // Bumped by every save() and clear(); a background snapshot started under
+  // another epoch is thrown away.
+  std::atomic<uint32_t> snapshot_epoch_{0};
+  // Held around every replacement of users.txt and around load(), so the
+  // old journal is never dropped under a reader.
+  SemaphoreHandle_t snapshot_mutex_ = nullptr;
+  uint32_t generation_ = 0;
+  uint32_t change_floor_ = 0; // oldest generation deltas can start from
+  uint32_t stored_generation_ = 0;
+  ChangeEntry changes_[kChangeLogSize] = {};
+  char import_line_[kUserLineMax];
+  size_t import_len_ = 0;
+  size_t import_lines_ = 0;
+  bool import_overflow_ = false;
   bool suppress_save_ = false;
+  File batch_journal_;
+  uint8_t write_depth_ = 0;
+  mutable std::atomic<uint32_t> seq_{0};
+  mutable std::atomic<uint32_t> readers_{0};
 };
 
 } // namespace app
@@ -6,10 +6,16 @@
 #include <esp_system.h>
 #include <cstring>
 
+#include "gzip.h"
+#include "log.h"
+#include "logic.h"
 #include "messages.h"
 #include "reader_uart.h"
 #include "rtc.h"
 #include "settings.h"
+#include "stats.h"
+#include "timing.h"
+#include "users.h"
 #include "wifi.h"
 #include "web/app.js.gz.h"
 #include "web/index.html.gz.h"
@@ -23,9 +29,19 @@ constexpr TickType_t kWebLoopDelay = pdMS_TO_TICKS(10);
 constexpr const char* kBackupHeader = "#RFID_BACKUP";
 constexpr const char* kApiKeyHeader = "X-API-Key";
 constexpr const char* kCookieHeader = "Cookie";
+constexpr const char* kRangeHeader = "Range";
+constexpr const char* kIfRangeHeader = "If-Range";
+constexpr const char* kAcceptEncodingHeader = "Accept-Encoding";
 constexpr const char* kSessionCookieName = "auth_token";
 constexpr uint32_t kAuthTimeoutMs = 5 * 60 * 1000;
 constexpr size_t kMaxSessions = 4;
+constexpr uint16_t kUsersPageDefault = 50;
+constexpr uint16_t kUsersPageMax = 200;
+constexpr uint16_t kLogQueryDefault = 100;
+constexpr uint16_t kLogQueryMax = 500;
+constexpr size_t kStreamChunk = 1024;
+constexpr size_t kStatsTopDefault = 10;
+constexpr size_t kStatsTopMax = 20;
 
 struct SessionEntry {
   bool in_use = false;
@@ -35,29 +51,136 @@ struct SessionEntry {
 
 SessionEntry g_sessions[kMaxSessions];
 
-bool logic_request(AppQueues* queues, LogicRequest& req, LogicResponse* out, uint32_t timeout_ms) {
-  if (!queues || !queues->logic_queue || !out) {
-    return false;
+// Queues req for the logic task with a new reply queue, which it returns;
+// nullptr when the request could not be queued and the logic task never
+// sees it.
+QueueHandle_t logic_send(AppQueues* queues, LogicRequest& req) {
+  if (!queues || !queues->logic_queue) {
+    return nullptr;
   }
   QueueHandle_t reply = xQueueCreate(1, sizeof(LogicResponse));
   if (!reply) {
-    return false;
+    return nullptr;
   }
   req.reply_queue = reply;
   if (xQueueSend(queues->logic_queue, &req, pdMS_TO_TICKS(50)) != pdTRUE) {
     vQueueDelete(reply);
-    return false;
+    return nullptr;
   }
+  return reply;
+}
+
+// Waits for the reply to a logic_send() and deletes its queue.
+bool logic_wait(QueueHandle_t reply, LogicResponse* out, uint32_t timeout_ms) {
   bool ok = (xQueueReceive(reply, out, pdMS_TO_TICKS(timeout_ms)) == pdTRUE);
   vQueueDelete(reply);
   return ok;
 }
 
+bool logic_request(AppQueues* queues, LogicRequest& req, LogicResponse* out, uint32_t timeout_ms) {
+  if (!out) {
+    return false;
+  }
+  QueueHandle_t reply = logic_send(queues, req);
+  return reply && logic_wait(reply, out, timeout_ms);
+}
+
 void send_gzip(WebServer& server, const char* content_type, const uint8_t* data, size_t len) {
   server.sendHeader("Content-Encoding", "gzip");
   server.send_P(200, content_type, reinterpret_cast<const char*>(data), len);
 }
 
+// True unless the client leaves gzip out of Accept-Encoding or gives it q=0.
+bool accepts_gzip(WebServer& server) {
+  if (!server.hasHeader(kAcceptEncodingHeader)) {
+    return false;
+  }
+  String accept = server.header(kAcceptEncodingHeader);
+  accept.toLowerCase();
+  int at = accept.indexOf("gzip");
+  if (at < 0) {
+    return false;
+  }
+  int end = accept.indexOf(',', at);
+  String params = accept.substring(at + 4, end < 0 ? accept.length() : end);
+  int q = params.indexOf("q=");
+  return q < 0 || strtod(params.c_str() + q + 2, nullptr) > 0;
+}
+
+// Body of a chunked response. When the client accepts gzip it goes through
+// a GzipWriter, so large listings cost the air time of their compressed
+// size with the same bounded memory; when that cannot be allocated the body
+// is sent as is.
+class ResponseBody {
+ public:
+  ResponseBody(WebServer& server, bool gzip) : server_(server), gzip_(nullptr), gzip_us_(0), send_us_(0) {
+    if (gzip) {
+      gzip_ = static_cast<GzipWriter*>(malloc(sizeof(GzipWriter)));
+    }
+    server_.sendHeader("Vary", "Accept-Encoding");
+    if (gzip_) {
+      server_.sendHeader("Content-Encoding", "gzip");
+      gzip_->begin(send_chunk, this);
+    }
+  }
+  ~ResponseBody() {
+    free(gzip_);
+  }
+  ResponseBody(const ResponseBody&) = delete;
+  ResponseBody& operator=(const ResponseBody&) = delete;
+
+  bool gzip() const {
+    return gzip_ != nullptr;
+  }
+  void begin(int code, const char* content_type) {
+    server_.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server_.send(code, content_type, "");
+  }
+  void write(const char* data, size_t len) {
+    if (gzip_) {
+      const uint32_t start = micros();
+      gzip_->write(data, len);
+      gzip_us_ += micros() - start;
+    } else {
+      server_.sendContent(data, len);
+    }
+  }
+  void write(const char* text) {
+    write(text, strlen(text));
+  }
+  void write(const String& text) {
+    write(text.c_str(), text.length());
+  }
+  // A gzip body adds its compression time, without the time spent sending
+  // chunks, to the /status timing.
+  void end() {
+    if (gzip_) {
+      const uint32_t start = micros();
+      gzip_->finish();
+      gzip_us_ += micros() - start;
+      timing_record(TimingProbe::Gzip, gzip_us_ - send_us_);
+    }
+    server_.sendContent("");
+  }
+
+  static void write_chunk(const char* data, size_t len, void* ctx) {
+    static_cast<ResponseBody*>(ctx)->write(data, len);
+  }
+
+ private:
+  static void send_chunk(const uint8_t* data, size_t len, void* ctx) {
+    auto* body = static_cast<ResponseBody*>(ctx);
+    const uint32_t start = micros();
+    body->server_.sendContent(reinterpret_cast<const char*>(data), len);
+    body->send_us_ += micros() - start;
+  }
+
+  WebServer& server_;
+  GzipWriter* gzip_;
+  uint32_t gzip_us_; // in GzipWriter, sends included
+  uint32_t send_us_; // in send_chunk()
+};
+
 bool parse_bool_arg(WebServer& server, const char* name, bool default_value) {
   if (!server.hasArg(name)) {
     return default_value;
@@ -261,6 +384,20 @@ String settings_to_text() {
   out += settings.relay1_state ? "1" : "0";
   out += "\nrelay2_state=";
   out += settings.relay2_state ? "1" : "0";
+  out += "\nrelay1_schedule=";
+  out += settings.relay1_schedule;
+  out += "\nrelay2_schedule=";
+  out += settings.relay2_schedule;
+  out += "\nrelay1_groups=";
+  out += settings.relay1_groups;
+  out += "\nrelay2_groups=";
+  out += settings.relay2_groups;
+  out += "\nlog_flush_ms=";
+  out += settings.log_flush_ms;
+  out += "\nlog_flush_events=";
+  out += settings.log_flush_events;
+  out += "\nlog_coalesce_ms=";
+  out += settings.log_coalesce_ms;
   out += "\nauth_enabled=";
   out += settings.auth_enabled ? "1" : "0";
   out += "\nauth_user=";
@@ -339,6 +476,34 @@ bool apply_settings_text(const String& text) {
       String value = line.substring(13);
       value.trim();
       settings.relay2_state = (value == "1" || value == "true" || value == "yes");
+    } else if (line.startsWith("relay1_schedule=")) {
+      String value = line.substring(16);
+      value.trim();
+      settings.relay1_schedule = static_cast<uint8_t>(value.toInt());
+    } else if (line.startsWith("relay2_schedule=")) {
+      String value = line.substring(16);
+      value.trim();
+      settings.relay2_schedule = static_cast<uint8_t>(value.toInt());
+    } else if (line.startsWith("relay1_groups=")) {
+      String value = line.substring(14);
+      value.trim();
+      parse_group_mask(value.c_str(), value.length(), &settings.relay1_groups);
+    } else if (line.startsWith("relay2_groups=")) {
+      String value = line.substring(14);
+      value.trim();
+      parse_group_mask(value.c_str(), value.length(), &settings.relay2_groups);
+    } else if (line.startsWith("log_flush_ms=")) {
+      String value = line.substring(13);
+      value.trim();
+      settings.log_flush_ms = static_cast<uint32_t>(value.toInt());
+    } else if (line.startsWith("log_flush_events=")) {
+      String value = line.substring(17);
+      value.trim();
+      settings.log_flush_events = static_cast<uint16_t>(value.toInt());
+    } else if (line.startsWith("log_coalesce_ms=")) {
+      String value = line.substring(16);
+      value.trim();
+      settings.log_coalesce_ms = static_cast<uint32_t>(value.toInt());
     } else if (line.startsWith("auth_enabled=")) {
       String value = line.substring(13);
       value.trim();
@@ -368,63 +533,571 @@ bool apply_settings_text(const String& text) {
   settings_set_relay_names(settings.relay1_name, settings.relay2_name);
   settings_set_relay_state(1, settings.relay1_state);
   settings_set_relay_state(2, settings.relay2_state);
+  settings_set_relay_schedules(settings.relay1_schedule, settings.relay2_schedule);
+  settings_set_relay_groups(settings.relay1_groups, settings.relay2_groups);
+  settings_set_log_flush(settings.log_flush_ms, settings.log_flush_events);
+  settings_set_log_coalesce(settings.log_coalesce_ms);
   settings_set_auth(settings.auth_enabled, settings.auth_user, settings.auth_pass, settings.api_key);
   rtc_init(settings.rtc_enabled);
   rtc_set_time_valid(settings.rtc_time_valid);
   return true;
 }
 
-String extract_section(const String& body, const char* name) {
-  String open = "[";
-  open += name;
-  open += "]";
-  String close = "[/";
-  close += name;
-  close += "]";
-  int start = body.indexOf(open);
-  if (start < 0) {
-    return "";
+// "granted,denied" -> mask of 1 << AccessResult.
+bool parse_result_mask(const String& text, uint8_t* mask) {
+  static const char* const kNames[] = {"granted", "denied", "unknown", "schedule"};
+  *mask = 0;
+  int start = 0;
+  while (start <= static_cast<int>(text.length())) {
+    int end = text.indexOf(',', start);
+    if (end < 0) {
+      end = text.length();
+    }
+    String name = text.substring(start, end);
+    name.trim();
+    bool found = false;
+    for (uint8_t i = 0; i < sizeof(kNames) / sizeof(kNames[0]); ++i) {
+      if (strcasecmp(name.c_str(), kNames[i]) == 0) {
+        *mask |= static_cast<uint8_t>(1u << i);
+        found = true;
+      }
+    }
+    if (!found) {
+      return false;
+    }
+    start = end + 1;
   }
-  start += open.length();
-  int end = body.indexOf(close, start);
-  if (end < 0) {
-    return "";
+  return *mask != 0;
+}
+
+struct LogQueryStream {
+  WebServer* server;
+  const UsersDb* users;
+  Settings settings;
+  String out;
+  bool empty;
+};
+
+void emit_log_event(const AccessEvent& event, void* ctx) {
+  auto* stream = static_cast<LogQueryStream*>(ctx);
+  char item[kLogJsonMax];
+  if (LogBuffer::format_json(event, stream->settings, *stream->users, item, sizeof(item)) == 0) {
+    return;
+  }
+  if (!stream->empty) {
+    stream->out += ',';
+  }
+  stream->out += item;
+  stream->empty = false;
+  if (stream->out.length() > kStreamChunk) {
+    stream->server->sendContent(stream->out);
+    stream->out = "";
   }
-  String section = body.substring(start, end);
-  section.trim();
-  return section;
 }
 
-String read_file_or_empty(const char* path) {
-  if (!LittleFS.begin()) {
-    return "";
+void send_export_chunk(const char* data, size_t len, void* ctx) {
+  static_cast<WebServer*>(ctx)->sendContent(data, len);
+}
+
+// Parses a single "bytes=a-b", "bytes=a-" or "bytes=-n" range against a body
+// of total bytes. False for anything else, including multiple ranges.
+bool parse_byte_range(const String& header, size_t total, size_t* start, size_t* end) {
+  if (!header.startsWith("bytes=") || header.indexOf(',') >= 0) {
+    return false;
   }
-  if (!LittleFS.exists(path)) {
-    return "";
+  String spec = header.substring(6);
+  spec.trim();
+  int dash = spec.indexOf('-');
+  if (dash < 0) {
+    return false;
+  }
+  String first = spec.substring(0, dash);
+  String last = spec.substring(dash + 1);
+  char* tail = nullptr;
+  if (first.length() == 0) {
+    unsigned long suffix = strtoul(last.c_str(), &tail, 10);
+    if (last.length() == 0 || *tail != '\0' || suffix == 0) {
+      return false;
+    }
+    *start = suffix < total ? total - suffix : 0;
+    *end = total;
+    return true;
+  }
+  unsigned long from = strtoul(first.c_str(), &tail, 10);
+  if (*tail != '\0') {
+    return false;
+  }
+  unsigned long to = total > 0 ? total - 1 : 0;
+  if (last.length() > 0) {
+    to = strtoul(last.c_str(), &tail, 10);
+    if (*tail != '\0' || to < from) {
+      return false;
+    }
+  }
+  *start = from;
+  *end = to + 1 < total ? to + 1 : total;
+  return true;
+}
+
+// Names the exported body: the oldest segment's first sequence, the end of
+// the range and the user table generation, since names are looked up again
+// on every render. The gzip representation gets its own tag: ranges are only
+// served on the plain text, so an If-Range from a gzip download restarts the
+// export.
+String export_etag(uint32_t first, uint32_t end, uint32_t generation, bool gzip) {
+  String tag = "\"";
+  tag += first;
+  tag += '-';
+  tag += end;
+  tag += '-';
+  tag += generation;
+  if (gzip) {
+    tag += "-gz";
+  }
+  tag += '"';
+  return tag;
+}
+
+// If-Range carries the ETag of an earlier export. The bytes of that export
+// can be rendered again as long as its oldest segment has not been reused
+// and no user has changed since.
+bool parse_export_etag(const String& tag, uint32_t first, uint32_t end, uint32_t generation, uint32_t* tag_end) {
+  if (tag.length() < 7 || tag[0] != '"' || tag[tag.length() - 1] != '"') {
+    return false;
+  }
+  char* tail = nullptr;
+  unsigned long tag_first = strtoul(tag.c_str() + 1, &tail, 10);
+  if (*tail != '-') {
+    return false;
+  }
+  unsigned long last = strtoul(tail + 1, &tail, 10);
+  if (*tail != '-') {
+    return false;
+  }
+  unsigned long tag_generation = strtoul(tail + 1, &tail, 10);
+  if (*tail != '"' || tag_first != first || tag_generation != generation || last - first > end - first) {
+    return false;
+  }
+  *tag_end = static_cast<uint32_t>(last);
+  return true;
+}
+
+// One series as [[granted,denied],...], oldest first, ending at last.
+void append_stats_series(String& out, const AccessStatsData& data, uint8_t reader, bool daily, uint32_t last) {
+  const size_t len = daily ? kStatsDays : kStatsHours;
+  out += '[';
+  for (size_t i = 0; i < len; ++i) {
+    uint32_t at = last - static_cast<uint32_t>(len - 1 - i);
+    StatsBucket bucket = daily ? AccessStats::day_bucket(data, reader, at) : AccessStats::hour_bucket(data, reader, at);
+    if (i > 0) {
+      out += ',';
+    }
+    out += '[';
+    out += bucket.granted;
+    out += ',';
+    out += bucket.denied;
+    out += ']';
+  }
+  out += ']';
+}
+
+// "name":{"count":N,"last_us":N,"max_us":N} for one /status probe.
+void append_timing(String& json, const char* name, TimingProbe probe) {
+  TimingStat stat{};
+  timing_get(probe, &stat);
+  json += '"';
+  json += name;
+  json += "\":{\"count\":";
+  json += stat.count;
+  json += ",\"last_us\":";
+  json += stat.last_us;
+  json += ",\"max_us\":";
+  json += stat.max_us;
+  json += '}';
+}
+
+void stream_file(ResponseBody& body, const char* path) {
+  if (!LittleFS.begin() || !LittleFS.exists(path)) {
+    return;
   }
   File file = LittleFS.open(path, FILE_READ);
   if (!file) {
-    return "";
+    return;
   }
-  String out;
-  while (file.available()) {
-    out += static_cast<char>(file.read());
+  uint8_t buf[512];
+  size_t got = 0;
+  while ((got = file.read(buf, sizeof(buf))) > 0) {
+    body.write(reinterpret_cast<const char*>(buf), got);
   }
   file.close();
-  return out;
 }
 
-bool write_file_text(const char* path, const String& data) {
-  if (!LittleFS.begin()) {
-    return false;
+// /restore bodies are consumed as they arrive instead of being buffered in
+// server.arg("plain"): user lines go to the logic task in small batches,
+// rule lines to a temporary file, and only the settings and schedules
+// sections are kept in RAM.
+constexpr size_t kRestoreSettingsMax = 4096;
+constexpr size_t kRestoreSchedulesMax = 2048;
+constexpr size_t kRestoreChunk = 1024;
+
+struct RestoreState {
+  bool authorized = false;
+  bool failed = false;
+  bool in_settings = false;
+  bool in_users = false;
+  bool in_schedules = false;
+  bool in_rules = false;
+  bool users_begun = false;
+  bool rules_seen = false;
+  File rules_file;
+  String settings;
+  String schedules;
+  char line[128];
+  size_t line_len = 0;
+  bool line_overflow = false;
+  char* chunk = nullptr; // kRestoreChunk bytes from lent_alloc(), one per batch
+  size_t chunk_len = 0;
+};
+
+RestoreState g_restore;
+
+void restore_reset() {
+  g_restore.authorized = false;
+  g_restore.failed = false;
+  g_restore.in_settings = false;
+  g_restore.in_users = false;
+  g_restore.in_schedules = false;
+  g_restore.in_rules = false;
+  g_restore.users_begun = false;
+  if (g_restore.rules_file) {
+    g_restore.rules_file.close();
   }
-  File file = LittleFS.open(path, FILE_WRITE);
-  if (!file) {
+  if (g_restore.rules_seen) {
+    LittleFS.remove(kRulesRestorePath);
+  }
+  g_restore.rules_seen = false;
+  g_restore.settings = "";
+  g_restore.schedules = "";
+  g_restore.line_len = 0;
+  g_restore.line_overflow = false;
+  lent_release(g_restore.chunk);
+  g_restore.chunk = nullptr;
+  g_restore.chunk_len = 0;
+}
+
+bool restore_flush_users(AppQueues* queues) {
+  if (g_restore.chunk_len == 0) {
+    return true;
+  }
+  static LogicRequest req;
+  static LogicResponse resp;
+  memset(&req, 0, sizeof(req));
+  req.type = LogicRequestType::ImportUsersChunk;
+  req.payload.import_chunk.data = g_restore.chunk;
+  req.payload.import_chunk.len = static_cast<uint16_t>(g_restore.chunk_len);
+  lent_share(g_restore.chunk);
+  QueueHandle_t reply = logic_send(queues, req);
+  if (!reply) {
+    lent_release(g_restore.chunk);
     return false;
   }
-  file.print(data);
-  file.close();
-  return true;
+  // The chunk is the logic task's now, even if the reply times out; the
+  // next lines go into a new one.
+  lent_release(g_restore.chunk);
+  g_restore.chunk = nullptr;
+  g_restore.chunk_len = 0;
+  return logic_wait(reply, &resp, 1000);
+}
+
+void restore_user_line(AppQueues* queues, const char* line, size_t len) {
+  if (!g_restore.users_begun) {
+    // Begin lazily so an empty [users] section leaves the table alone.
+    static LogicRequest req;
+    static LogicResponse resp;
+    memset(&req, 0, sizeof(req));
+    req.type = LogicRequestType::ImportUsersBegin;
+    if (!logic_request(queues, req, &resp, 1000)) {
+      g_restore.failed = true;
+      return;
+    }
+    g_restore.users_begun = true;
+  }
+  if (g_restore.chunk_len + len + 1 > kRestoreChunk && !restore_flush_users(queues)) {
+    g_restore.failed = true;
+    return;
+  }
+  if (!g_restore.chunk) {
+    g_restore.chunk = static_cast<char*>(lent_alloc(kRestoreChunk));
+    if (!g_restore.chunk) {
+      g_restore.failed = true;
+      return;
+    }
+  }
+  memcpy(g_restore.chunk + g_restore.chunk_len, line, len);
+  g_restore.chunk_len += len;
+  g_restore.chunk[g_restore.chunk_len++] = '\n';
+}
+
+void restore_rule_line(const char* line, size_t len) {
+  if (!g_restore.rules_file || g_restore.rules_file.write(reinterpret_cast<const uint8_t*>(line), len) != len ||
+      g_restore.rules_file.write(static_cast<uint8_t>('\n')) != 1) {
+    g_restore.failed = true;
+  }
+}
+
+void restore_line(AppQueues* queues) {
+  const char* line = g_restore.line;
+  size_t len = g_restore.line_len;
+  while (len > 0 && (line[0] == ' ' || line[0] == '\t')) {
+    ++line;
+    --len;
+  }
+  while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) {
+    --len;
+  }
+  if (len == 0) {
+    return;
+  }
+  if (line[0] == '[') {
+    if (len == 10 && memcmp(line, "[settings]", 10) == 0) {
+      g_restore.in_settings = true;
+      return;
+    }
+    if (len == 11 && memcmp(line, "[/settings]", 11) == 0) {
+      g_restore.in_settings = false;
+      return;
+    }
+    if (len == 7 && memcmp(line, "[users]", 7) == 0) {
+      g_restore.in_users = true;
+      return;
+    }
+    if (len == 8 && memcmp(line, "[/users]", 8) == 0) {
+      g_restore.in_users = false;
+      return;
+    }
+    if (len == 11 && memcmp(line, "[schedules]", 11) == 0) {
+      g_restore.in_schedules = true;
+      return;
+    }
+    if (len == 12 && memcmp(line, "[/schedules]", 12) == 0) {
+      g_restore.in_schedules = false;
+      return;
+    }
+    if (len == 7 && memcmp(line, "[rules]", 7) == 0) {
+      // Even an empty section replaces the table: the backup had no rules.
+      if (!g_restore.rules_seen) {
+        g_restore.rules_seen = true;
+        g_restore.rules_file = LittleFS.open(kRulesRestorePath, FILE_WRITE);
+      }
+      g_restore.in_rules = true;
+      return;
+    }
+    if (len == 8 && memcmp(line, "[/rules]", 8) == 0) {
+      g_restore.in_rules = false;
+      return;
+    }
+  }
+  if (g_restore.in_settings) {
+    if (g_restore.settings.length() + len + 1 > kRestoreSettingsMax) {
+      g_restore.failed = true;
+      return;
+    }
+    g_restore.settings.concat(line, len);
+    g_restore.settings += '\n';
+  } else if (g_restore.in_schedules) {
+    if (g_restore.schedules.length() + len + 1 > kRestoreSchedulesMax) {
+      g_restore.failed = true;
+      return;
+    }
+    g_restore.schedules.concat(line, len);
+    g_restore.schedules += '\n';
+  } else if (g_restore.in_users) {
+    restore_user_line(queues, line, len);
+  } else if (g_restore.in_rules) {
+    restore_rule_line(line, len);
+  }
+}
+
+void restore_feed(AppQueues* queues, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len && !g_restore.failed; ++i) {
+    char c = static_cast<char>(data[i]);
+    if (c == '\n') {
+      if (!g_restore.line_overflow) {
+        restore_line(queues);
+      }
+      g_restore.line_len = 0;
+      g_restore.line_overflow = false;
+      continue;
+    }
+    if (g_restore.line_len < sizeof(g_restore.line)) {
+      g_restore.line[g_restore.line_len++] = c;
+    } else {
+      g_restore.line_overflow = true;
+    }
+  }
+}
+
+// Replaces the schedule table with the restored profiles.
+bool restore_apply_schedules(AppQueues* queues) {
+  static LogicRequest req;
+  static LogicResponse resp;
+  bool ok = true;
+  bool seen[kMaxSchedules] = {false};
+  const String& text = g_restore.schedules;
+  int start = 0;
+  while (start < static_cast<int>(text.length())) {
+    int end = text.indexOf('\n', start);
+    if (end < 0) {
+      end = text.length();
+    }
+    String line = text.substring(start, end);
+    start = end + 1;
+    int p1 = line.indexOf('|');
+    int p2 = p1 >= 0 ? line.indexOf('|', p1 + 1) : -1;
+    long id = p1 > 0 ? line.substring(0, p1).toInt() : 0;
+    if (p2 < 0 || id <= 0 || id >= static_cast<long>(kMaxSchedules)) {
+      continue;
+    }
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
+    req.type = LogicRequestType::SetSchedule;
+    req.payload.schedule.id = static_cast<uint8_t>(id);
+    strncpy(req.payload.schedule.name, line.substring(p1 + 1, p2).c_str(), sizeof(req.payload.schedule.name) - 1);
+    strncpy(req.payload.schedule.spec, line.substring(p2 + 1).c_str(), sizeof(req.payload.schedule.spec) - 1);
+    if (!logic_request(queues, req, &resp, 500) || !resp.ok) {
+      ok = false;
+    }
+    seen[id] = true;
+  }
+  for (size_t id = 1; id < kMaxSchedules; ++id) {
+    if (seen[id]) {
+      continue;
+    }
+    memset(&req, 0, sizeof(req));
+    req.type = LogicRequestType::DeleteSchedule;
+    req.payload.schedule.id = static_cast<uint8_t>(id);
+    logic_request(queues, req, &resp, 500);
+  }
+  return ok;
+}
+
+// Replaces the rule table with the restored rules in one logic request.
+bool restore_apply_rules(AppQueues* queues) {
+  g_restore.rules_file.close();
+  static LogicRequest req;
+  static LogicResponse resp;
+  memset(&req, 0, sizeof(req));
+  memset(&resp, 0, sizeof(resp));
+  req.type = LogicRequestType::RestoreRules;
+  return logic_request(queues, req, &resp, 2000) && resp.ok;
+}
+
+bool restore_end_users(AppQueues* queues, bool commit) {
+  if (!g_restore.users_begun) {
+    return true;
+  }
+  g_restore.users_begun = false;
+  static LogicRequest req;
+  static LogicResponse resp;
+  memset(&req, 0, sizeof(req));
+  memset(&resp, 0, sizeof(resp));
+  req.type = LogicRequestType::ImportUsersEnd;
+  req.payload.import_end.commit = commit ? 1 : 0;
+  // Writing the snapshot of a large table takes a while on LittleFS.
+  return logic_request(queues, req, &resp, 10000) && resp.ok;
+}
+
+// /users/batch bodies are parsed line by line as they arrive into a heap
+// array that the logic task applies in one request.
+constexpr size_t kBatchMaxOps = 256;
+
+struct BatchState {
+  bool authorized = false;
+  bool too_many = false;
+  UserBatchOp* ops = nullptr; // from lent_alloc()
+  size_t count = 0;
+  char line[kUserLineMax];
+  size_t line_len = 0;
+  bool line_overflow = false;
+};
+
+BatchState g_batch;
+
+void batch_reset() {
+  lent_release(g_batch.ops);
+  g_batch.ops = nullptr;
+  g_batch.authorized = false;
+  g_batch.too_many = false;
+  g_batch.count = 0;
+  g_batch.line_len = 0;
+  g_batch.line_overflow = false;
+}
+
+void batch_line() {
+  size_t start = 0;
+  while (start < g_batch.line_len && (g_batch.line[start] == ' ' || g_batch.line[start] == '\t' ||
+                                      g_batch.line[start] == '\r')) {
+    ++start;
+  }
+  if (!g_batch.line_overflow && (start == g_batch.line_len || g_batch.line[start] == '#')) {
+    return;
+  }
+  if (g_batch.count >= kBatchMaxOps) {
+    g_batch.too_many = true;
+    return;
+  }
+  UserBatchOp* op = &g_batch.ops[g_batch.count++];
+  if (g_batch.line_overflow) {
+    memset(op, 0, sizeof(*op));
+    op->result = BatchResult::Invalid;
+    return;
+  }
+  UsersDb::parse_batch_line(g_batch.line + start, g_batch.line_len - start, op);
+}
+
+void batch_feed(const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    char c = static_cast<char>(data[i]);
+    if (c == '\n') {
+      batch_line();
+      g_batch.line_len = 0;
+      g_batch.line_overflow = false;
+      continue;
+    }
+    if (g_batch.line_len < sizeof(g_batch.line)) {
+      g_batch.line[g_batch.line_len++] = c;
+    } else {
+      g_batch.line_overflow = true;
+    }
+  }
+}
+
+const char* batch_result_name(BatchResult result) {
+  switch (result) {
+    case BatchResult::Ok:
+      return "ok";
+    case BatchResult::Exists:
+      return "uid_exists";
+    case BatchResult::NotFound:
+      return "not_found";
+    case BatchResult::Full:
+      return "full";
+    default:
+      return "invalid";
+  }
+}
+
+const char* batch_op_name(char op) {
+  switch (op) {
+    case '+':
+      return "add";
+    case '~':
+      return "update";
+    case '-':
+      return "delete";
+    default:
+      return "";
+  }
 }
 
 } // namespace
@@ -432,8 +1105,8 @@ bool write_file_text(const char* path, const String& data) {
 void web_task(void* param) {
   auto* queues = static_cast<AppQueues*>(param);
   WebServer server(80);
-  const char* header_keys[] = {kApiKeyHeader, kCookieHeader};
-  server.collectHeaders(header_keys, 2);
+  const char* header_keys[] = {kApiKeyHeader, kCookieHeader, kRangeHeader, kIfRangeHeader, kAcceptEncodingHeader};
+  server.collectHeaders(header_keys, sizeof(header_keys) / sizeof(header_keys[0]));
 
   Serial.println("Web task starting...");
   uint32_t waited_ms = 0;
@@ -513,6 +1186,98 @@ void web_task(void* param) {
     server.send(200, "application/json", "{\"ok\":true}");
   });
 
+  server.on(
+      "/users/batch", HTTP_POST,
+      [&]() {
+        if (!check_auth(server)) {
+          batch_reset();
+          send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+          return;
+        }
+        if (!g_batch.ops) {
+          batch_reset();
+          server.send(500, "application/json", "{\"ok\":false,\"error\":\"out of memory\"}");
+          return;
+        }
+        if (g_batch.too_many) {
+          batch_reset();
+          server.send(413, "application/json", "{\"ok\":false,\"error\":\"too many operations\"}");
+          return;
+        }
+        if (g_batch.count == 0) {
+          batch_reset();
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"empty batch\"}");
+          return;
+        }
+        static LogicRequest req;
+        static LogicResponse resp;
+        memset(&req, 0, sizeof(req));
+        memset(&resp, 0, sizeof(resp));
+        req.type = LogicRequestType::UsersBatch;
+        req.payload.users_batch.ops = g_batch.ops;
+        req.payload.users_batch.count = static_cast<uint16_t>(g_batch.count);
+        // The logic task releases its reference when done, so after a
+        // timeout the array outlives batch_reset() until then.
+        lent_share(g_batch.ops);
+        QueueHandle_t reply = logic_send(queues, req);
+        if (!reply) {
+          lent_release(g_batch.ops);
+        }
+        if (!reply || !logic_wait(reply, &resp, 10000)) {
+          batch_reset();
+          server.send(500, "application/json", "{\"ok\":false}");
+          return;
+        }
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "application/json", "");
+        String out = "{\"ok\":true,\"applied\":";
+        out += resp.total;
+        out += ",\"generation\":";
+        out += resp.generation;
+        out += ",\"results\":[";
+        char uid[kUidTextLen];
+        char item[80];
+        for (size_t i = 0; i < g_batch.count; ++i) {
+          const UserBatchOp& op = g_batch.ops[i];
+          uid_format(op.uid, uid, sizeof(uid));
+          snprintf(item, sizeof(item), "%s{\"op\":\"%s\",\"uid\":\"%s\",\"result\":\"%s\"}", i > 0 ? "," : "",
+                   batch_op_name(op.op), uid, batch_result_name(op.result));
+          out += item;
+          if (out.length() > 1024) {
+            server.sendContent(out);
+            out = "";
+          }
+        }
+        out += "]}";
+        server.sendContent(out);
+        server.sendContent("");
+        batch_reset();
+      },
+      [&]() {
+        HTTPRaw& raw = server.raw();
+        if (raw.status == RAW_START) {
+          batch_reset();
+          g_batch.authorized = check_auth(server);
+          if (g_batch.authorized) {
+            g_batch.ops = static_cast<UserBatchOp*>(lent_alloc(sizeof(UserBatchOp) * kBatchMaxOps));
+          }
+          return;
+        }
+        if (!g_batch.authorized || !g_batch.ops) {
+          return;
+        }
+        if (raw.status == RAW_WRITE) {
+          batch_feed(raw.buf, raw.currentSize);
+        } else if (raw.status == RAW_END) {
+          if (g_batch.line_len > 0) {
+            batch_line();
+          }
+          g_batch.line_len = 0;
+        } else if (raw.status == RAW_ABORTED) {
+          batch_reset();
+        }
+      });
+
   server.on("/users", HTTP_ANY, [&]() {
     Serial.printf("HTTP /users method %d\n", server.method());
     if (!check_auth(server)) {
@@ -523,13 +1288,96 @@ void web_task(void* param) {
     static LogicResponse resp;
     memset(&req, 0, sizeof(req));
     memset(&resp, 0, sizeof(resp));
+    const UsersDb& users = logic_users();
+    if (server.method() == HTTP_GET && server.hasArg("uid")) {
+      UidKey uid{};
+      if (!uid_parse(server.arg("uid").c_str(), &uid)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid uid\"}");
+        return;
+      }
+      static const char kHead[] = "{\"ok\":true,\"user\":";
+      memcpy(resp.json, kHead, sizeof(kHead) - 1);
+      users.read_lock();
+      bool found = users.user_json(uid, resp.json + sizeof(kHead) - 1, sizeof(resp.json) - sizeof(kHead) - 1);
+      users.read_unlock();
+      if (!found) {
+        server.send(404, "application/json", "{\"ok\":false,\"error\":\"not found\"}");
+        return;
+      }
+      strcat(resp.json, "}");
+      server.send(200, "application/json", resp.json);
+      return;
+    }
+
+    if (server.method() == HTTP_GET && server.hasArg("since")) {
+      uint32_t since = static_cast<uint32_t>(strtoul(server.arg("since").c_str(), nullptr, 10));
+      users.read_lock();
+      users.changes_json(since, resp.json, sizeof(resp.json));
+      users.read_unlock();
+      server.send(200, "application/json", resp.json);
+      return;
+    }
+
     if (server.method() == HTTP_GET) {
-      req.type = LogicRequestType::GetUsers;
-      if (logic_request(queues, req, &resp, 300)) {
-        server.send(200, "application/json", resp.json);
+      // Pages are rendered straight from the user table under its read lock
+      // into the fixed response buffer and streamed out one at a time, so
+      // memory use does not grow with the table and swipes never queue
+      // behind a listing. Without paging args every page is streamed.
+      bool paged = server.hasArg("limit") || server.hasArg("offset") || server.hasArg("cursor");
+      long limit = server.hasArg("limit") ? server.arg("limit").toInt() : kUsersPageDefault;
+      if (!paged || limit > static_cast<long>(kUsersPageMax)) {
+        limit = kUsersPageMax;
+      }
+      if (limit < 1) {
+        limit = 1;
+      }
+      size_t cursor = 0;
+      size_t next = 0;
+      users.read_lock();
+      if (server.hasArg("cursor")) {
+        cursor = static_cast<size_t>(server.arg("cursor").toInt());
+      } else if (server.hasArg("offset")) {
+        cursor = users.cursor_at(static_cast<size_t>(server.arg("offset").toInt()));
+      }
+      size_t len = users.page_json(cursor, static_cast<size_t>(limit), resp.json, sizeof(resp.json), &next);
+      // Changes after this generation may or may not appear in later pages;
+      // a follow-up ?since= request picks them up either way.
+      uint32_t generation = users.generation();
+      size_t total = users.count();
+      users.read_unlock();
+
+      ResponseBody body(server, accepts_gzip(server));
+      body.begin(200, "application/json");
+      body.write("{\"users\":[");
+      body.write(resp.json, len);
+      bool empty = len == 0;
+      while (!paged && next != UsersDb::kPageEnd) {
+        users.read_lock();
+        len = users.page_json(next, static_cast<size_t>(limit), resp.json, sizeof(resp.json), &next);
+        total = users.count();
+        users.read_unlock();
+        if (len == 0) {
+          continue;
+        }
+        if (!empty) {
+          body.write(",");
+        }
+        body.write(resp.json, len);
+        empty = false;
+      }
+      String tail = "],\"total\":";
+      tail += total;
+      tail += ",\"generation\":";
+      tail += generation;
+      tail += ",\"next\":";
+      if (paged && next != UsersDb::kPageEnd) {
+        tail += next;
       } else {
-        server.send(500, "application/json", "{\"ok\":false}");
+        tail += "null";
       }
+      tail += "}";
+      body.write(tail);
+      body.end();
       return;
     }
 
@@ -544,10 +1392,41 @@ void web_task(void* param) {
       bool relay2 = parse_bool_arg(server, "relay2", false);
 
       req.type = LogicRequestType::AddUser;
-      strncpy(req.payload.add_user.uid, uid.c_str(), sizeof(req.payload.add_user.uid) - 1);
+      if (!uid_parse(uid.c_str(), &req.payload.add_user.uid)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid uid\"}");
+        return;
+      }
       strncpy(req.payload.add_user.name, name.c_str(), sizeof(req.payload.add_user.name) - 1);
-      req.payload.add_user.relay1 = relay1 ? 1 : 0;
-      req.payload.add_user.relay2 = relay2 ? 1 : 0;
+      req.payload.add_user.groups = (relay1 ? kGroupRelay1 : 0) | (relay2 ? kGroupRelay2 : 0);
+      if (server.hasArg("groups")) {
+        String groups = server.arg("groups");
+        if (!parse_group_mask(groups.c_str(), groups.length(), &req.payload.add_user.groups)) {
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid groups\"}");
+          return;
+        }
+      }
+      long schedule = server.hasArg("schedule") ? server.arg("schedule").toInt() : kScheduleAlways;
+      if (schedule < 0 || schedule >= static_cast<long>(kMaxSchedules)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid schedule\"}");
+        return;
+      }
+      req.payload.add_user.schedule = static_cast<uint8_t>(schedule);
+      // Visitor credentials: unix-time window and/or a number of uses.
+      req.payload.add_user.valid_from = static_cast<uint32_t>(strtoul(server.arg("valid_from").c_str(), nullptr, 10));
+      req.payload.add_user.valid_until = static_cast<uint32_t>(strtoul(server.arg("valid_until").c_str(), nullptr, 10));
+      if (req.payload.add_user.valid_until != 0 && req.payload.add_user.valid_until <= req.payload.add_user.valid_from) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid validity window\"}");
+        return;
+      }
+      if (server.hasArg("uses") && server.arg("uses").length() > 0) {
+        long uses = server.arg("uses").toInt();
+        if (uses < 1 || uses > UINT16_MAX) {
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid uses\"}");
+          return;
+        }
+        req.payload.add_user.limited_uses = 1;
+        req.payload.add_user.uses_left = static_cast<uint16_t>(uses);
+      }
 
       if (logic_request(queues, req, &resp, 300)) {
         server.send(200, "application/json", resp.json);
@@ -564,7 +1443,10 @@ void web_task(void* param) {
       }
       String uid = server.arg("uid");
       req.type = LogicRequestType::DeleteUser;
-      strncpy(req.payload.del_user.uid, uid.c_str(), sizeof(req.payload.del_user.uid) - 1);
+      if (!uid_parse(uid.c_str(), &req.payload.del_user.uid)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid uid\"}");
+        return;
+      }
 
       if (logic_request(queues, req, &resp, 300)) {
         server.send(200, "application/json", resp.json);
@@ -583,20 +1465,28 @@ void web_task(void* param) {
       send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
       return;
     }
-    static LogicRequest req;
-    static LogicResponse resp;
-    memset(&req, 0, sizeof(req));
-    memset(&resp, 0, sizeof(resp));
     if (server.method() == HTTP_GET) {
-      req.type = LogicRequestType::GetLogs;
-      if (logic_request(queues, req, &resp, 400)) {
-        server.send(200, "application/json", resp.json);
-      } else {
-        server.send(500, "application/json", "{\"ok\":false}");
+      // Rendered here from a copy of the RAM ring; names are read under the
+      // user table's read lock, so a swipe never waits behind this page.
+      static AccessEvent events[kLogRecentMax];
+      size_t count = logic_logs().recent(events, kLogRecentMax);
+      LogQueryStream stream{&server, &logic_users(), settings_get(), String("{\"logs\":["), true};
+      server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+      server.send(200, "application/json", "");
+      for (size_t i = 0; i < count; ++i) {
+        emit_log_event(events[i], &stream);
       }
+      stream.out += "]}";
+      server.sendContent(stream.out);
+      server.sendContent("");
       return;
     }
 
+    static LogicRequest req;
+    static LogicResponse resp;
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
+
     if (server.method() == HTTP_DELETE) {
       String scope = server.hasArg("scope") ? server.arg("scope") : "all";
       scope.toLowerCase();
@@ -612,13 +1502,198 @@ void web_task(void* param) {
     server.send(405, "application/json", "{\"ok\":false,\"error\":\"method not allowed\"}");
   });
 
+  server.on("/logs/query", HTTP_GET, [&]() {
+    if (!check_auth(server)) {
+      send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+      return;
+    }
+    LogQuery query{};
+    query.from = server.hasArg("from") ? static_cast<uint32_t>(strtoul(server.arg("from").c_str(), nullptr, 10)) : 0;
+    query.to = server.hasArg("to") ? static_cast<uint32_t>(strtoul(server.arg("to").c_str(), nullptr, 10)) : 0;
+    if (server.hasArg("uid") && !uid_parse(server.arg("uid").c_str(), &query.uid)) {
+      server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid uid\"}");
+      return;
+    }
+    long reader = server.hasArg("reader") ? server.arg("reader").toInt() : 0;
+    if (reader < 0 || reader > 2 || (server.hasArg("result") && !parse_result_mask(server.arg("result"), &query.results))) {
+      server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid reader or result\"}");
+      return;
+    }
+    query.reader = static_cast<uint8_t>(reader);
+    if (server.hasArg("cursor")) {
+      query.has_cursor = true;
+      query.cursor = static_cast<uint32_t>(strtoul(server.arg("cursor").c_str(), nullptr, 10));
+    }
+    long limit = server.hasArg("limit") ? server.arg("limit").toInt() : kLogQueryDefault;
+    if (limit < 1) {
+      limit = 1;
+    } else if (limit > static_cast<long>(kLogQueryMax)) {
+      limit = kLogQueryMax;
+    }
+    query.limit = static_cast<uint16_t>(limit);
+
+    LogQueryStream stream{&server, &logic_users(), settings_get(), String("{\"events\":["), true};
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    LogQueryResult result{};
+    logic_logs().query(query, emit_log_event, &stream, &result);
+    stream.out += "],\"matched\":";
+    stream.out += result.matched;
+    stream.out += ",\"scanned\":";
+    stream.out += result.scanned;
+    stream.out += ",\"skipped_blocks\":";
+    stream.out += result.blocks_skipped;
+    stream.out += ",\"next\":";
+    if (result.more) {
+      stream.out += result.next;
+    } else {
+      stream.out += "null";
+    }
+    stream.out += "}";
+    server.sendContent(stream.out);
+    server.sendContent("");
+  });
+
   server.on("/logs/export", HTTP_GET, [&]() {
     if (!check_auth(server)) {
       send_unauthorized(server, "text/plain", "unauthorized");
       return;
     }
-    String data = read_file_or_empty("/logs.txt");
-    server.send(200, "text/plain", data);
+    const LogBuffer& logs = logic_logs();
+    LogExportRange range{0, 0, 0, SIZE_MAX};
+    logs.snapshot(&range.first, &range.end);
+    const uint32_t generation = logic_users().generation();
+    bool partial = server.hasHeader(kRangeHeader);
+    if (partial && server.hasHeader(kIfRangeHeader)) {
+      partial = parse_export_etag(server.header(kIfRangeHeader), range.first, range.end, generation, &range.end);
+    }
+    server.sendHeader("Accept-Ranges", "bytes");
+    if (!partial) {
+      ResponseBody body(server, accepts_gzip(server));
+      server.sendHeader("ETag", export_etag(range.first, range.end, generation, body.gzip()));
+      body.begin(200, "text/plain");
+      logs.export_text(range, logic_users(), ResponseBody::write_chunk, &body);
+      body.end();
+      return;
+    }
+    server.sendHeader("ETag", export_etag(range.first, range.end, generation, false));
+
+    // A range needs the total length first: one counting pass, then the
+    // real one that skips to the requested offset.
+    size_t total = logs.export_text(range, logic_users(), nullptr, nullptr);
+    size_t start = 0;
+    size_t end = 0;
+    if (!parse_byte_range(server.header(kRangeHeader), total, &start, &end) || start >= total) {
+      String unsatisfied = "bytes */";
+      unsatisfied += static_cast<unsigned long>(total);
+      server.sendHeader("Content-Range", unsatisfied);
+      server.send(416, "text/plain", "range not satisfiable");
+      return;
+    }
+    String content_range = "bytes ";
+    content_range += static_cast<unsigned long>(start);
+    content_range += '-';
+    content_range += static_cast<unsigned long>(end - 1);
+    content_range += '/';
+    content_range += static_cast<unsigned long>(total);
+    server.sendHeader("Content-Range", content_range);
+    server.setContentLength(end - start);
+    server.send(206, "text/plain", "");
+    range.offset = start;
+    range.length = end - start;
+    logs.export_text(range, logic_users(), send_export_chunk, &server);
+  });
+
+  server.on("/schedules", HTTP_ANY, [&]() {
+    if (!check_auth(server)) {
+      send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+      return;
+    }
+    static LogicRequest req;
+    static LogicResponse resp;
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
+    if (server.method() == HTTP_GET) {
+      req.type = LogicRequestType::GetSchedules;
+    } else if (server.method() == HTTP_POST || server.method() == HTTP_DELETE) {
+      long id = server.hasArg("id") ? server.arg("id").toInt() : 0;
+      if (id <= 0 || id >= static_cast<long>(kMaxSchedules)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid id\"}");
+        return;
+      }
+      req.payload.schedule.id = static_cast<uint8_t>(id);
+      if (server.method() == HTTP_POST) {
+        if (!server.hasArg("spec")) {
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"missing spec\"}");
+          return;
+        }
+        req.type = LogicRequestType::SetSchedule;
+        strncpy(req.payload.schedule.name, server.arg("name").c_str(), sizeof(req.payload.schedule.name) - 1);
+        strncpy(req.payload.schedule.spec, server.arg("spec").c_str(), sizeof(req.payload.schedule.spec) - 1);
+      } else {
+        req.type = LogicRequestType::DeleteSchedule;
+      }
+    } else {
+      server.send(405, "application/json", "{\"ok\":false}");
+      return;
+    }
+    if (logic_request(queues, req, &resp, 500)) {
+      server.send(resp.ok ? 200 : 400, "application/json", resp.json);
+    } else {
+      server.send(500, "application/json", "{\"ok\":false}");
+    }
+  });
+
+  server.on("/rules", HTTP_ANY, [&]() {
+    if (!check_auth(server)) {
+      send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+      return;
+    }
+    static LogicRequest req;
+    static LogicResponse resp;
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
+    if (server.method() == HTTP_GET) {
+      req.type = LogicRequestType::GetRules;
+      long offset = server.hasArg("offset") ? server.arg("offset").toInt() : 0;
+      req.payload.rule.offset = static_cast<uint16_t>(offset < 0 ? 0 : offset > static_cast<long>(kMaxRules) ? kMaxRules : offset);
+    } else if (server.method() == HTTP_POST || server.method() == HTTP_DELETE) {
+      if (!server.hasArg("spec")) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"missing spec\"}");
+        return;
+      }
+      strncpy(req.payload.rule.spec, server.arg("spec").c_str(), sizeof(req.payload.rule.spec) - 1);
+      if (server.method() == HTTP_POST) {
+        req.type = LogicRequestType::AddRule;
+        strncpy(req.payload.rule.name, server.arg("name").c_str(), sizeof(req.payload.rule.name) - 1);
+        bool relay1 = parse_bool_arg(server, "relay1", false);
+        bool relay2 = parse_bool_arg(server, "relay2", false);
+        req.payload.rule.groups = (relay1 ? kGroupRelay1 : 0) | (relay2 ? kGroupRelay2 : 0);
+        if (server.hasArg("groups")) {
+          String groups = server.arg("groups");
+          if (!parse_group_mask(groups.c_str(), groups.length(), &req.payload.rule.groups)) {
+            server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid groups\"}");
+            return;
+          }
+        }
+        long schedule = server.hasArg("schedule") ? server.arg("schedule").toInt() : kScheduleAlways;
+        if (schedule < 0 || schedule >= static_cast<long>(kMaxSchedules)) {
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid schedule\"}");
+          return;
+        }
+        req.payload.rule.schedule = static_cast<uint8_t>(schedule);
+      } else {
+        req.type = LogicRequestType::DeleteRule;
+      }
+    } else {
+      server.send(405, "application/json", "{\"ok\":false}");
+      return;
+    }
+    if (logic_request(queues, req, &resp, 1000)) {
+      server.send(resp.ok ? 200 : 400, "application/json", resp.json);
+    } else {
+      server.send(500, "application/json", "{\"ok\":false}");
+    }
   });
 
   server.on("/rfid", HTTP_GET, [&]() {
@@ -646,88 +1721,224 @@ void web_task(void* param) {
     }
     String type = server.hasArg("type") ? server.arg("type") : "full";
     type.toLowerCase();
+    bool with_settings = type == "settings" || type == "full";
+    bool with_users = type == "users" || type == "full";
+
+    if (with_users) {
+      // Fold the journal into /users.txt so the file holds the whole table;
+      // without that the backup would miss the journaled changes.
+      static LogicRequest req;
+      static LogicResponse resp;
+      memset(&req, 0, sizeof(req));
+      memset(&resp, 0, sizeof(resp));
+      req.type = LogicRequestType::CompactUsers;
+      if (!logic_request(queues, req, &resp, 10000) || !resp.ok) {
+        server.send(503, "text/plain", "users snapshot failed, try again");
+        return;
+      }
+    }
 
-    String out;
-    out += kBackupHeader;
-    out += "\n";
-
-    if (type == "settings" || type == "full") {
-      out += "[settings]\n";
-      out += settings_to_text();
-      out += "[/settings]\n";
+    // The files are streamed as they are read, so a large user table is
+    // never held in memory as one string.
+    ResponseBody body(server, accepts_gzip(server));
+    body.begin(200, "text/plain");
+    body.write(kBackupHeader);
+    body.write("\n");
+
+    if (with_settings) {
+      body.write("[settings]\n");
+      body.write(settings_to_text());
+      body.write("[/settings]\n");
     }
 
-    if (type == "users" || type == "full") {
-      out += "[users]\n";
-      out += read_file_or_empty("/users.txt");
-      out += "[/users]\n";
+    if (with_users) {
+      // Users refer to schedule profiles by id, so the two travel together.
+      body.write("[schedules]\n");
+      stream_file(body, "/schedules.txt");
+      body.write("[/schedules]\n");
+      body.write("[users]\n");
+      stream_file(body, "/users.txt");
+      body.write("[/users]\n");
+      body.write("[rules]\n");
+      stream_file(body, "/rules.txt");
+      body.write("[/rules]\n");
     }
 
-    server.send(200, "text/plain", out);
+    body.end();
   });
 
-  server.on("/restore", HTTP_POST, [&]() {
-    if (!check_auth(server)) {
-      send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
-      return;
-    }
-    if (!server.hasArg("plain")) {
-      server.send(400, "application/json", "{\"ok\":false,\"error\":\"missing body\"}");
-      return;
-    }
-    String body = server.arg("plain");
-    String settings_text = extract_section(body, "settings");
-    String users_text = extract_section(body, "users");
-    bool has_sections = settings_text.length() > 0 || users_text.length() > 0;
+  server.on(
+      "/restore", HTTP_POST,
+      [&]() {
+        if (!check_auth(server)) {
+          restore_reset();
+          send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+          return;
+        }
+        if (g_restore.settings.length() == 0 && g_restore.schedules.length() == 0 && !g_restore.users_begun &&
+            !g_restore.rules_seen) {
+          restore_reset();
+          server.send(400, "application/json", "{\"ok\":false,\"error\":\"no sections\"}");
+          return;
+        }
 
-    if (!has_sections) {
-      server.send(400, "application/json", "{\"ok\":false,\"error\":\"no sections\"}");
-      return;
-    }
+        bool ok = !g_restore.failed;
+        if (ok && g_restore.settings.length() > 0) {
+          ok = apply_settings_text(g_restore.settings);
+          if (ok) {
+            auto settings = settings_get();
+            static LogicRequest req;
+            static LogicResponse resp;
+            memset(&req, 0, sizeof(req));
+            memset(&resp, 0, sizeof(resp));
+            req.type = LogicRequestType::SetRelayState;
+            req.payload.relay_state.relay_id = 1;
+            req.payload.relay_state.enabled = settings.relay1_state ? 1 : 0;
+            if (!logic_request(queues, req, &resp, 300)) {
+              ok = false;
+            }
+            if (ok) {
+              memset(&req, 0, sizeof(req));
+              memset(&resp, 0, sizeof(resp));
+              req.type = LogicRequestType::SetRelayState;
+              req.payload.relay_state.relay_id = 2;
+              req.payload.relay_state.enabled = settings.relay2_state ? 1 : 0;
+              if (!logic_request(queues, req, &resp, 300)) {
+                ok = false;
+              }
+            }
+          }
+        }
 
-    bool ok = true;
-    if (settings_text.length() > 0) {
-      ok = apply_settings_text(settings_text);
-      if (ok) {
-        auto settings = settings_get();
-        static LogicRequest req;
-        static LogicResponse resp;
-        memset(&req, 0, sizeof(req));
-        memset(&resp, 0, sizeof(resp));
-        req.type = LogicRequestType::SetRelayState;
-        req.payload.relay_state.relay_id = 1;
-        req.payload.relay_state.enabled = settings.relay1_state ? 1 : 0;
-        if (!logic_request(queues, req, &resp, 300)) {
+        if (ok && g_restore.schedules.length() > 0 && !restore_apply_schedules(queues)) {
+          ok = false;
+        }
+        // Rules name schedule profiles too, so they follow the schedules.
+        if (ok && g_restore.rules_seen && !restore_apply_rules(queues)) {
+          ok = false;
+        }
+        if (!restore_end_users(queues, ok)) {
           ok = false;
         }
-        if (ok) {
-          memset(&req, 0, sizeof(req));
-          memset(&resp, 0, sizeof(resp));
-          req.type = LogicRequestType::SetRelayState;
-          req.payload.relay_state.relay_id = 2;
-          req.payload.relay_state.enabled = settings.relay2_state ? 1 : 0;
-          if (!logic_request(queues, req, &resp, 300)) {
-            ok = false;
+        restore_reset();
+        server.send(200, "application/json", ok ? "{\"ok\":true}" : "{\"ok\":false}");
+      },
+      [&]() {
+        HTTPRaw& raw = server.raw();
+        if (raw.status == RAW_START) {
+          restore_reset();
+          g_restore.authorized = check_auth(server);
+          return;
+        }
+        if (!g_restore.authorized) {
+          return;
+        }
+        if (raw.status == RAW_WRITE) {
+          restore_feed(queues, raw.buf, raw.currentSize);
+        } else if (raw.status == RAW_END) {
+          if (!g_restore.failed && !g_restore.line_overflow) {
+            restore_line(queues);
           }
+          g_restore.line_len = 0;
+          if (!g_restore.failed && !restore_flush_users(queues)) {
+            g_restore.failed = true;
+          }
+        } else if (raw.status == RAW_ABORTED) {
+          restore_end_users(queues, false);
+          restore_reset();
         }
+      });
+
+  server.on("/stats", HTTP_GET, [&]() {
+    if (!check_auth(server)) {
+      send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
+      return;
+    }
+    uint8_t only_reader = 0;
+    if (server.hasArg("reader")) {
+      long reader = server.arg("reader").toInt();
+      if (reader < 1 || reader > static_cast<long>(kStatsReaders)) {
+        server.send(400, "application/json", "{\"ok\":false,\"error\":\"invalid reader\"}");
+        return;
       }
+      only_reader = static_cast<uint8_t>(reader);
+    }
+    size_t top = kStatsTopDefault;
+    if (server.hasArg("top")) {
+      long value = server.arg("top").toInt();
+      top = value < 0 ? 0 : (value > static_cast<long>(kStatsTopMax) ? kStatsTopMax : static_cast<size_t>(value));
     }
 
-    if (ok && users_text.length() > 0) {
-      ok = write_file_text("/users.txt", users_text);
-      if (ok) {
-        static LogicRequest req;
-        static LogicResponse resp;
-        memset(&req, 0, sizeof(req));
-        memset(&resp, 0, sizeof(resp));
-        req.type = LogicRequestType::ReloadUsers;
-        if (!logic_request(queues, req, &resp, 1000)) {
-          ok = false;
-        }
+    // Copies, not the live counters: the swipe path only waits for a memcpy.
+    static AccessStatsData data;
+    logic_stats().snapshot(&data);
+    RtcDateTime dt{};
+    bool has_time = rtc_has_valid_time() && rtc_get_datetime(&dt);
+    uint32_t now = has_time ? rtc_to_epoch(dt) : 0;
+    // Without a clock the series end at the last hour and day counted.
+    uint32_t last_hour = has_time ? now / 3600 : data.hour;
+    uint32_t last_day = has_time ? now / 86400 : data.day;
+
+    ResponseBody body(server, accepts_gzip(server));
+    body.begin(200, "application/json");
+    String out = "{\"clock\":";
+    out += has_time ? "true" : "false";
+    out += ",\"now\":";
+    out += now;
+    out += ",\"hour\":";
+    out += last_hour;
+    out += ",\"day\":";
+    out += last_day;
+    out += ",\"readers\":[";
+    bool first = true;
+    for (uint8_t reader = 1; reader <= kStatsReaders; ++reader) {
+      if (only_reader != 0 && reader != only_reader) {
+        continue;
+      }
+      if (!first) {
+        out += ',';
       }
+      first = false;
+      out += "{\"reader\":";
+      out += reader;
+      out += ",\"hourly\":";
+      append_stats_series(out, data, reader, false, last_hour);
+      body.write(out);
+      out = ",\"daily\":";
+      append_stats_series(out, data, reader, true, last_day);
+      out += ",\"unclocked\":[";
+      out += data.unclocked[reader - 1][0];
+      out += ',';
+      out += data.unclocked[reader - 1][1];
+      out += "]}";
+      body.write(out);
+      out = "";
     }
-
-    server.send(200, "application/json", ok ? "{\"ok\":true}" : "{\"ok\":false}");
+    out += "],\"users\":[";
+    if (has_time && top > 0) {
+      // Per user: this month's counters kept with the user table.
+      UserUsageRank ranks[kStatsTopMax];
+      const UsersDb& users = logic_users();
+      users.read_lock();
+      size_t count = users.top_usage(static_cast<uint16_t>(dt.year * 12 + dt.month - 1), ranks, top);
+      for (size_t i = 0; i < count; ++i) {
+        UserRecord user{};
+        users.get_user(ranks[i].uid, &user);
+        char uid[24];
+        uid_format(ranks[i].uid, uid, sizeof(uid));
+        char name[2 * sizeof(user.name)];
+        json_escape(user.name, name, sizeof(name));
+        char item[160];
+        snprintf(item, sizeof(item), "%s{\"uid\":\"%s\",\"name\":\"%s\",\"granted\":%u,\"denied\":%u}",
+                 i > 0 ? "," : "", uid, name, static_cast<unsigned>(ranks[i].granted),
+                 static_cast<unsigned>(ranks[i].denied));
+        out += item;
+      }
+      users.read_unlock();
+    }
+    out += "]}";
+    body.write(out);
+    body.end();
   });
 
   server.on("/status", HTTP_GET, [&]() {
@@ -761,6 +1972,47 @@ void web_task(void* param) {
     json += LittleFS.totalBytes();
     json += ",\"littlefs_free\":";
     json += LittleFS.usedBytes() > LittleFS.totalBytes() ? 0 : (LittleFS.totalBytes() - LittleFS.usedBytes());
+    json += "},\"users\":{";
+    const UsersDb& users = logic_users();
+    UserFilterStats filter{};
+    users.read_lock();
+    size_t user_count = users.count();
+    users.filter_stats(&filter);
+    users.read_unlock();
+    json += "\"count\":";
+    json += static_cast<uint32_t>(user_count);
+    json += ",\"filter\":{\"bytes\":";
+    json += filter.bytes;
+    json += ",\"hashes\":";
+    json += filter.hashes;
+    json += ",\"fill\":";
+    json += String(filter.bits ? static_cast<float>(filter.bits_set) / filter.bits : 0.0f, 4);
+    json += ",\"estimated_fp\":";
+    json += String(filter.estimated_fp, 4);
+    json += ",\"rejected\":";
+    json += filter.rejected;
+    json += ",\"false_positives\":";
+    json += filter.false_positives;
+    LogWriterStats writer{};
+    logic_logs().writer_stats(&writer);
+    json += "}},\"logs\":{\"stored\":";
+    json += writer.stored;
+    json += ",\"queued\":";
+    json += writer.queued;
+    json += ",\"flushed\":";
+    json += writer.flushed;
+    json += ",\"dropped\":";
+    json += writer.dropped;
+    json += ",\"pending\":";
+    json += writer.pending;
+    json += ",\"recovered\":";
+    json += writer.recovered;
+    json += "},\"timing\":{";
+    append_timing(json, "user_lookup", TimingProbe::UserLookup);
+    json += ',';
+    append_timing(json, "log_append", TimingProbe::LogAppend);
+    json += ',';
+    append_timing(json, "gzip", TimingProbe::Gzip);
     json += "},\"network\":{";
     bool sta = (WiFi.getMode() == WIFI_STA);
     json += "\"mode\":\"";
@@ -810,6 +2062,20 @@ void web_task(void* param) {
       json += settings.relay1_state ? "true" : "false";
       json += ",\"relay2_state\":";
       json += settings.relay2_state ? "true" : "false";
+      json += ",\"relay1_schedule\":";
+      json += settings.relay1_schedule;
+      json += ",\"relay2_schedule\":";
+      json += settings.relay2_schedule;
+      json += ",\"relay1_groups\":";
+      json += settings.relay1_groups;
+      json += ",\"relay2_groups\":";
+      json += settings.relay2_groups;
+      json += ",\"log_flush_ms\":";
+      json += settings.log_flush_ms;
+      json += ",\"log_flush_events\":";
+      json += settings.log_flush_events;
+      json += ",\"log_coalesce_ms\":";
+      json += settings.log_coalesce_ms;
       json += ",\"auth_enabled\":";
       json += settings.auth_enabled ? "true" : "false";
       json += ",\"auth_user\":\"";
@@ -869,6 +2135,47 @@ void web_task(void* param) {
       if (server.hasArg("relay1") || server.hasArg("relay2")) {
         settings_set_relay_names(relay1.c_str(), relay2.c_str());
       }
+      if (server.hasArg("relay1_schedule") || server.hasArg("relay2_schedule")) {
+        long schedule1 = server.hasArg("relay1_schedule") ? server.arg("relay1_schedule").toInt() : current.relay1_schedule;
+        long schedule2 = server.hasArg("relay2_schedule") ? server.arg("relay2_schedule").toInt() : current.relay2_schedule;
+        if (schedule1 < 0 || schedule1 >= static_cast<long>(kMaxSchedules) || schedule2 < 0 ||
+            schedule2 >= static_cast<long>(kMaxSchedules)) {
+          ok = false;
+        } else {
+          settings_set_relay_schedules(static_cast<uint8_t>(schedule1), static_cast<uint8_t>(schedule2));
+        }
+      }
+      if (server.hasArg("relay1_groups") || server.hasArg("relay2_groups")) {
+        uint32_t groups1 = current.relay1_groups;
+        uint32_t groups2 = current.relay2_groups;
+        String value1 = server.arg("relay1_groups");
+        String value2 = server.arg("relay2_groups");
+        if ((server.hasArg("relay1_groups") && !parse_group_mask(value1.c_str(), value1.length(), &groups1)) ||
+            (server.hasArg("relay2_groups") && !parse_group_mask(value2.c_str(), value2.length(), &groups2))) {
+          ok = false;
+        } else {
+          settings_set_relay_groups(groups1, groups2);
+        }
+      }
+      if (server.hasArg("log_flush_ms") || server.hasArg("log_flush_events")) {
+        long flush_ms = server.hasArg("log_flush_ms") ? server.arg("log_flush_ms").toInt() : current.log_flush_ms;
+        long flush_events =
+            server.hasArg("log_flush_events") ? server.arg("log_flush_events").toInt() : current.log_flush_events;
+        if (flush_ms < 0 || flush_ms > static_cast<long>(kMaxLogFlushMs) || flush_events < 1 ||
+            flush_events > static_cast<long>(kMaxLogFlushEvents)) {
+          ok = false;
+        } else {
+          settings_set_log_flush(static_cast<uint32_t>(flush_ms), static_cast<uint16_t>(flush_events));
+        }
+      }
+      if (server.hasArg("log_coalesce_ms")) {
+        long coalesce_ms = server.arg("log_coalesce_ms").toInt();
+        if (coalesce_ms < 0 || coalesce_ms > static_cast<long>(kMaxLogCoalesceMs)) {
+          ok = false;
+        } else {
+          settings_set_log_coalesce(static_cast<uint32_t>(coalesce_ms));
+        }
+      }
       if (server.hasArg("auth_enabled")) {
         auto current_auth = settings_get();
         char new_key[40] = {0};
@@ -984,6 +2291,12 @@ void web_task(void* param) {
       send_unauthorized(server, "application/json", "{\"ok\":false,\"error\":\"unauthorized\"}");
       return;
     }
+    // Usage counters are only flushed periodically; keep them across a clean restart.
+    static LogicRequest req;
+    static LogicResponse resp;
+    memset(&req, 0, sizeof(req));
+    req.type = LogicRequestType::FlushUsage;
+    logic_request(queues, req, &resp, 2000);
     server.send(200, "application/json", "{\"ok\":true}");
     delay(100);
     ESP.restart();